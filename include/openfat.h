@@ -49,11 +49,70 @@ typedef struct fat_file_handle FatFile;
  * block device.
  * \param dev Pointer to block device to mount.
  * \param vol Pointer to filesystem handle to initialise.
- * \return 0 on success.
+ * \return 0 on success, -EINVAL if the library was not built to
+ * support the volume's FAT type or geometry.
  */
 int __attribute__((warn_unused_result))
 fat_vol_init(const struct block_device *dev, FatVol *vol);
 
+/** \brief Volume is mounted read only. */
+#define FAT_VOL_RDONLY		0x04
+
+/** \brief Mount a FAT volume with options.
+ *
+ * As fat_vol_init(), with flags.  If FAT_VOL_RDONLY is given, calls that
+ * would change the volume fail with -EROFS, and the block device's
+ * write method is never called.  Reads from a read only volume never
+ * have to check the sector buffer for changes, so sectors the block 
+ * device holds in memory are read in place without taking the cache 
+ * lock, and whole sectors are read without flushing the buffer.  The
+ * block device must not be mounted writable at the same time.
+ *
+ * \param dev Pointer to block device to mount.
+ * \param vol Pointer to filesystem handle to initialise.
+ * \param flags FAT_VOL_RDONLY or 0.
+ * \return 0 on success, -EINVAL if the library was not built to
+ * support the volume's FAT type or geometry.
+ */
+int __attribute__((warn_unused_result))
+fat_vol_mount(const struct block_device *dev, FatVol *vol, int flags);
+
+/** \brief Volume wasn't unmounted cleanly, or is FAT12 which doesn't
+ * record it. */
+#define FAT_VOL_DIRTY		0x01
+/** \brief A disk error was recorded on the volume. */
+#define FAT_VOL_HARD_ERROR	0x02
+
+/** \brief State of a volume when it was mounted.
+ * FAT16 and FAT32 volumes record in the FAT whether they were unmounted
+ * cleanly.  The record is cleared by the first change to the volume and
+ * set again by fat_vol_umount().  Metadata cached on the volume, such as
+ * the FAT32 free cluster count, is only trusted if it was clean.  A 
+ * dirty volume is left marked dirty for a full check by another system.
+ * \param vol Pointer to FAT volume handle.
+ * \return FAT_VOL_DIRTY, FAT_VOL_HARD_ERROR and FAT_VOL_RDONLY flags.
+ */
+int fat_vol_state(const FatVol *vol);
+
+/** \brief Unmount a FAT volume.
+ * Writes out the sector buffer and, if the volume was clean when mounted,
+ * the FAT32 FSInfo sector, and marks the volume clean.  Open files must
+ * be synced first.  A volume may still be used afterwards, in which case
+ * it is marked dirty again by the next change.
+ * \param vol Pointer to FAT volume handle.
+ * \return 0 on success.
+ */
+int fat_vol_umount(FatVol *vol);
+
+/** \brief Number of free clusters on a volume.
+ * Taken from the FSInfo sector of a clean FAT32 volume, otherwise the
+ * FAT is scanned the first time this is called.  The count is kept up to
+ * date from then on.
+ * \param vol Pointer to FAT volume handle.
+ * \return Number of free clusters.
+ */
+uint32_t fat_vol_free_clusters(FatVol *vol);
+
 /** \brief Change current working directory. 
  * \param vol Pointer to FAT volume handle.
  * \param name Directory name to change to.  Relative to the current dir.
@@ -73,17 +132,30 @@ int fat_mkdir(FatVol *vol, const char *name);
  */
 int fat_rmdir(FatVol *vol, const char *name); /* TODO */
 
-/** \brief Open an existing file.
+/** \brief Open a file.
+ * If O_CREAT is passed in flags, the file is created if it doesn't exist,
+ * and with O_EXCL as well, fails with -EEXIST if it does.  O_TRUNC
+ * discards the contents of an existing file.  Checking for the name,
+ * choosing a short name and finding space for the new directory entries
+ * are all done in a single pass over the directory.
+ *
  * The option O_ASYNC may be passed in flags to surpress the automatic
  * updating of the files directory entry on writes.  fat_file_sync() must be
  * called explicitly to update it in this case.
  *
- * This function uses a ::dirent on the stack for iterating over the directory.
- * This is a fairly large structure.
+ * The option O_APPEND may be passed in flags to have every write go to the
+ * end of the file, regardless of the current position.  The end of the
+ * file is remembered in the handle so repeated appends don't walk the
+ * cluster chain, and sectors past the end of file are not read before
+ * being written.
+ *
+ * Long names are compared against the directory entries as they are read,
+ * so no ::dirent is needed on the stack.
  *
  * \param vol Pointer to FAT volume handle.
  * \param name File name in current directory to open.
- * \param flags O_RDONLY, O_WRONLY, or O_RDWR. (currently not implemented)
+ * \param flags O_CREAT, O_EXCL, O_TRUNC, O_APPEND, O_ASYNC.
+ * O_RDONLY, O_WRONLY, or O_RDWR are currently not implemented.
  * \param file Pointer to file handle to initialise.
  * \return 0 on success.
  */
@@ -91,6 +163,7 @@ int __attribute__((warn_unused_result))
 fat_open(FatVol *vol, const char *name, int flags, FatFile *file);
 
 /** \brief Create a new file.
+ * Same as fat_open() with O_CREAT and O_EXCL.
  * \see fat_open()
  *
  * \param vol Pointer to FAT volume handle.
@@ -112,6 +185,35 @@ fat_create(FatVol *vol, const char *name, int flags, FatFile *file);
  */
 int fat_file_sync(FatFile *h);
 
+/** \brief Policy for updating a file's directory entry on writes.
+ * By default a file's directory entry is updated on every write that grows
+ * the file.  If any of the fields below are non-zero, the entry is only
+ * updated once one of the enabled thresholds has been passed since the
+ * last update.  Files opened with O_ASYNC are never updated automatically.
+ */
+struct fat_sync_policy {
+	uint32_t bytes;		/**< Update after this many bytes, 0 disables. */
+	uint32_t clusters;	/**< Update after this many clusters, 0 disables. */
+	uint32_t interval;	/**< Update after this many clock ticks, 0 disables. */
+	/** Caller supplied clock for interval, free running tick counter. */
+	uint32_t (*clock)(void);
+};
+
+/** \brief Set the default directory entry sync policy for a volume.
+ * The policy is copied.  Applies to all files without their own policy.
+ * \param vol Pointer to FAT volume handle.
+ * \param policy Pointer to policy, or NULL to sync on every write.
+ */
+void fat_vol_set_sync_policy(FatVol *vol, const struct fat_sync_policy *policy);
+
+/** \brief Set the directory entry sync policy for an open file.
+ * The policy is not copied, and must remain valid while the file is open.
+ * \param file Pointer to file handle.
+ * \param policy Pointer to policy, or NULL to use the volume's policy.
+ */
+void fat_file_set_sync_policy(FatFile *file, 
+			const struct fat_sync_policy *policy);
+
 /** \brief Read from an open file.
  * \param file Pointer to file handle from which to read.
  * \param buf Buffer into which to read.
@@ -145,6 +247,26 @@ off_t fat_lseek(FatFile *file, off_t offset, int whence);
  */
 int fat_unlink(FatVol *vol, const char *name);
 
+/** \brief Compact a directory, reclaiming space from deleted entries.
+ * Live entries are moved down over deleted ones, keeping long name entries
+ * together with their short entry.  Orphaned long name entries are
+ * dropped, and clusters no longer needed are freed.
+ *
+ * Open handles of files in the directory refer to their directory entry
+ * by location, so must be passed in files to be updated.  Any other open
+ * file in the directory must be reopened, and handles reading the
+ * directory itself must be rewound.
+ *
+ * \param vol Pointer to FAT volume handle.
+ * \param name Name of directory in current directory, or "." for the
+ * current directory.
+ * \param files Array of open file handles to update, may be NULL.
+ * \param nfiles Number of handles in files.
+ * \return 0 on success.
+ */
+int fat_dir_compact(FatVol *vol, const char *name, FatFile **files, 
+		int nfiles);
+
 #define FAT_ATTR_READ_ONLY	0x01
 #define FAT_ATTR_HIDDEN		0x02
 #define FAT_ATTR_SYSTEM		0x04
@@ -170,6 +292,242 @@ struct dirent {
  */
 int fat_readdir(FatFile *dir, struct dirent *ent);
 
+/** \brief Detailed directory entry, returned by fat_getdents() */
+struct fat_dirent_plus {
+	struct dirent d;	/**< Name and attributes, as fat_readdir() */
+	uint32_t size;		/**< File size in bytes */
+	uint32_t first_cluster;	/**< First cluster, 0 if file is empty */
+	uint32_t dirent_sector;	/**< Sector holding the short entry */
+	uint16_t dirent_offset;	/**< Offset of short entry in sector */
+	/* Raw FAT timestamps */
+	uint8_t create_time_fine; /**< Creation time, 10ms units */
+	uint16_t create_time;	/**< Creation time, FAT format */
+	uint16_t create_date;	/**< Creation date, FAT format */
+	uint16_t access_date;	/**< Last access date, FAT format */
+	uint16_t write_time;	/**< Last write time, FAT format */
+	uint16_t write_date;	/**< Last write date, FAT format */
+};
+
+/** \brief Read several directory entries with their details.
+ * Like fat_readdir(), but fills in up to count entries per call, including
+ * the size, first cluster, location and timestamps of each file, so
+ * listing a directory with sizes doesn't need each file to be opened.
+ * \param dir Pointer to file handle for the directory to be read.
+ * \param ents Array of entries to fill in.
+ * \param count Number of entries in ents.
+ * \return Number of entries read, 0 at end of directory.
+ */
+int fat_getdents(FatFile *dir, struct fat_dirent_plus *ents, int count);
+
+
+/** \brief Entry in a directory name index.
+ * Do not access directly.  Structure has no public fields.
+ */
+struct fat_dir_index_entry {
+	uint32_t hash;		/* Hash of case-folded name */
+	uint32_t shash;		/* Hash of DOS short name */
+	uint32_t pos;		/* Position of entry in directory */
+	uint32_t cluster;	/* Directory cluster at pos, 0 if unknown */
+	/* Entries are chained in buckets by each hash.  Every entry also
+	 * holds the heads of the buckets with its own number. */
+	uint16_t head;
+	uint16_t shead;
+	uint16_t next;
+	uint16_t snext;
+};
+
+/** \brief In-memory name index for a single directory.
+ * Do not access directly.  Structure has no public fields.
+ */
+struct fat_dir_index {
+	struct fat_dir_index *next;
+	struct fat_dir_index_entry *ent;
+	uint16_t size;
+	uint16_t count;
+	uint32_t dir;
+	uint32_t stamp;
+	uint8_t valid;
+	uint8_t complete;
+};
+
+/** \brief Add a directory name index to a volume.
+ * Once added, fat_open() builds an index of a directory the first time it
+ * is searched, and later lookups in that directory use the index instead
+ * of scanning the directory.  Indexes are kept up to date by fat_create(),
+ * fat_mkdir() and fat_unlink().  Several indexes may be added to a volume;
+ * the least recently used one is reused when a new directory is searched.
+ * If a directory has more entries than fit in the index, names not in
+ * the index fall back to a directory scan.
+ *
+ * Must be called after fat_vol_init().
+ *
+ * \param vol Pointer to FAT volume handle.
+ * \param idx Pointer to index structure to initialise.
+ * \param ent Storage for index entries, must remain valid while mounted.
+ * \param size Number of entries in ent.
+ */
+void fat_dir_index_add(FatVol *vol, struct fat_dir_index *idx,
+		struct fat_dir_index_entry *ent, uint16_t size);
+
+/** \brief Maximum name length held in the path component cache. */
+#define FAT_DCACHE_NAME_MAX	32
+
+/** \brief Entry in the path component cache.
+ * Do not access directly.  Structure has no public fields.
+ */
+struct fat_dcache_entry {
+	uint32_t parent;
+	uint32_t stamp;
+	uint32_t first_cluster;
+	uint32_t size;
+	uint32_t dirent_sector;
+	uint16_t dirent_offset;
+	uint8_t flags;
+	uint8_t len;
+	char name[FAT_DCACHE_NAME_MAX];
+};
+
+/** \brief Set up the path component cache for a volume.
+ * The cache remembers the result of looking up a name in a directory,
+ * including names that were not found, so ufat_open() can resolve
+ * repeated paths without reading directories.  It is kept up to date
+ * by fat_create(), fat_mkdir(), fat_unlink() and fat_file_sync().
+ * ufat_mount() sets up a cache automatically.
+ *
+ * Must be called after fat_vol_init().
+ *
+ * \param vol Pointer to FAT volume handle.
+ * \param ent Storage for cache entries, must remain valid while mounted.
+ * \param size Number of entries in ent.
+ */
+void fat_dcache_init(FatVol *vol, struct fat_dcache_entry *ent, 
+		uint16_t size);
+
+/** \brief Lock primitives supplied by the application.
+ *
+ * Locks are opaque pointers passed back to these functions, such as a
+ * pthread_mutex_t or an RTOS mutex.  They need not be recursive.
+ */
+struct fat_lock_ops {
+	/** Acquire lock, blocking until it is available. */
+	void (*lock)(void *lock);
+	/** Release lock. */
+	void (*unlock)(void *lock);
+};
+
+/** \brief Enable locking for use from several threads.
+ *
+ * Without locking, the library must only be used from one thread at a 
+ * time.  With locking, volumes and files may be used concurrently, except
+ * that each open file must only be used by one thread unless it has its
+ * own lock.
+ *
+ * Locks are taken in the order: volume metadata or file, volume
+ * allocation, cache.  The cache lock guards the shared sector buffer and
+ * is held only for the duration of a sector access.  Reads of whole
+ * sectors, and reads by files with their own buffer, call the block 
+ * device without holding any lock, so the device must allow concurrent
+ * calls.
+ *
+ * Must be called before any volume is mounted.
+ *
+ * \param ops Lock primitives, or NULL to disable locking.
+ * \param cache_lock Lock for the shared sector buffer.
+ */
+void fat_lock_init(const struct fat_lock_ops *ops, void *cache_lock);
+
+/** \brief Set the locks used for a volume.
+ *
+ * Must be called after fat_vol_init(), and before the volume is shared.
+ * The metadata lock serialises operations on directories: fat_open(),
+ * fat_create(), fat_chdir(), fat_mkdir(), fat_unlink() and 
+ * fat_dir_compact().  Files passed to fat_dir_compact() must not be in use
+ * by other threads.  The allocation lock serialises changes to the
+ * cluster chains.
+ *
+ * \param vol Pointer to FAT volume handle.
+ * \param meta_lock Lock for directory operations, or NULL.
+ * \param alloc_lock Lock for cluster allocation, or NULL.
+ */
+void fat_vol_set_locks(FatVol *vol, void *meta_lock, void *alloc_lock);
+
+/** \brief Set the lock used for a file.
+ *
+ * Needed only if the file handle itself is shared between threads.  Must
+ * be called after the file is opened.
+ *
+ * \param file Pointer to FAT file handle.
+ * \param lock Lock for file operations, or NULL.
+ */
+void fat_file_set_lock(FatFile *file, void *lock);
+
+/** \brief Give a file its own sector buffer for reading.
+ *
+ * Reads of parts of sectors normally go through the sector buffer shared
+ * by all volumes.  With its own buffer, a file only uses the shared 
+ * buffer for sectors already in it, so threads reading different files 
+ * don't evict each other's sectors or wait for each other.
+ * Must be called after the file is opened.
+ *
+ * \param file Pointer to FAT file handle.
+ * \param buf Buffer of one sector, must remain valid while the file is
+ *	used, or NULL to use the shared buffer.
+ */
+void fat_file_set_buffer(FatFile *file, void *buf);
+
+/** \brief Streaming write state, see fat_file_stream().
+ * Do not access directly.  Structure has no public fields.
+ */
+struct fat_stream {
+	uint8_t *buf;
+	uint32_t buf_size;	/* Whole sectors */
+	uint32_t buf_pos;	/* File position of buf[0], sector aligned */
+	uint32_t fill;		/* Bytes in buf */
+	uint32_t prev_cluster;	/* Cluster linked to run, 0 if run is first */
+	uint32_t run_cluster;	/* First cluster of reserved run */
+	uint32_t run_count;	/* Clusters in run, 0 if none reserved */
+	uint32_t run_pos;	/* File position of run_cluster */
+	uint32_t au_clusters;	/* Clusters per allocation unit, 0 if none */
+	uint32_t au_first;	/* First unit aligned cluster */
+	uint8_t no_au;		/* No free allocation unit was found */
+	uint8_t no_run;		/* No free run the size of buf was found */
+};
+
+/** \brief Write a file as a stream of allocation units.
+ *
+ * Flash cards write fastest when whole allocation units are filled in
+ * order.  In streaming mode, clusters are reserved a run at a time,
+ * aligned to the block device's erase_size where it reports one, or
+ * sized to the buffer otherwise.  Each run is linked into the cluster
+ * chain when reserved, so the FAT and directory entry are only updated
+ * then, and by fat_file_sync() and fat_file_stream_end().  File data is
+ * collected in buf and written directly to the run in multi-sector
+ * writes, bypassing the shared sector buffer.
+ *
+ * Writes continue from the end of the file.  Until fat_file_stream_end()
+ * is called only fat_write() and fat_file_sync() may be used on the file.
+ *
+ * \param file Pointer to FAT file handle.
+ * \param stream Pointer to stream state to initialise, must remain valid
+ *	until fat_file_stream_end().
+ * \param buf Data buffer, must remain valid until fat_file_stream_end().
+ * \param size Size of buf in bytes, at least one sector.  Larger buffers
+ *	give longer writes.
+ * \return 0 on success, -EINVAL if buf is too small or the file is the
+ * FAT12/16 root directory, -EBUSY if the file is already streaming, 
+ * -EROFS if the volume is read only.
+ */
+int fat_file_stream(FatFile *file, struct fat_stream *stream, void *buf,
+		uint32_t size);
+
+/** \brief Leave streaming mode.
+ * Buffered data is written out, reserved clusters past the end of file
+ * are freed and the directory entry is updated.
+ * \param file Pointer to FAT file handle.
+ * \return 0 on success.
+ */
+int fat_file_stream_end(FatFile *file);
+
 
 /* Everything below is private.  Applications should not direcly access
  * anything here.
@@ -188,6 +546,21 @@ struct fat_file_handle {
 	/* Reference to dirent */
 	uint32_t dirent_sector;
 	uint16_t dirent_offset;
+	/* Cached end of file for appending, tail_sector is 0 if unknown */
+	uint32_t tail_cluster;
+	uint32_t tail_sector;
+	/* Directory entry sync state, policy is NULL for volume default */
+	const struct fat_sync_policy *sync_policy;
+	uint32_t synced_size;
+	uint32_t synced_time;
+	/* Application lock, NULL if not locking */
+	void *lock;
+	/* Private read buffer, NULL to use the shared one */
+	uint8_t *buf;
+	uint32_t buf_sector;	/* 0 if buf is empty */
+	uint32_t buf_gen;
+	/* Streaming write state, NULL if not streaming */
+	struct fat_stream *stream;
 };
 
 struct fat_vol_handle {
@@ -203,6 +576,10 @@ struct fat_vol_handle {
 	uint32_t first_data_sector;
 	uint32_t cluster_count;
 	uint32_t fat_size;
+	/* log2 of bytes_per_sector and sectors_per_cluster.  sector_shift
+	 * is 0 if either is not a power of two. */
+	uint8_t sector_shift;
+	uint8_t cluster_shift;
 	union {
 		struct {
 			uint32_t root_cluster;
@@ -214,6 +591,23 @@ struct fat_vol_handle {
 	};
 	/* Internal state */
 	uint32_t last_cluster_alloc;
+	/* FAT_VOL_* flags found at mount */
+	uint8_t state;
+	/* Non-zero once the volume is marked dirty on the medium */
+	uint8_t written;
+	/* FAT32 FSInfo sector, 0 if none */
+	uint16_t fsinfo_sector;
+	/* Free clusters, 0xFFFFFFFF until known */
+	uint32_t free_count;
+	struct fat_sync_policy sync_policy;
+	struct fat_dir_index *dir_index;
+	uint32_t dir_index_stamp;
+	struct fat_dcache_entry *dcache;
+	uint16_t dcache_size;
+	uint32_t dcache_stamp;
+	/* Application locks, NULL if not locking */
+	void *meta_lock;
+	void *alloc_lock;
 	struct fat_file_handle cwd;
 };
 
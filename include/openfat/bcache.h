@@ -0,0 +1,108 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file bcache.h
+ * \brief Caching block device.
+ * This module provides a block device that wraps any other, keeping
+ * recently read sectors in an LRU cache and combining adjacent writes
+ * into multiple sector requests.  All memory is supplied by the caller.
+ */
+
+#ifndef __BCACHE_H
+#define __BCACHE_H
+
+#include <stdint.h>
+
+#include "blockdev.h"
+
+/** \brief A cached run of sectors.  Don't access directly. */
+struct block_cache_line {
+	uint32_t sector;
+	uint16_t count;		/* Sectors held, 0 if unused */
+	uint32_t stamp;
+	uint8_t *data;
+};
+
+/** \brief Structure representing a caching block device.
+ * Don't access directly.  No public fields. */
+struct block_cache {
+	struct block_device bldev;
+	struct block_device *lower;
+	uint16_t sector_size;
+	void *lock;
+
+	/* Read cache */
+	struct block_cache_line *lines;
+	uint16_t nlines;
+	uint16_t line_sectors;
+	uint32_t stamp;
+
+	/* Write combining window */
+	uint8_t *wbuf;
+	uint16_t wsize;
+	uint16_t wcount;
+	uint32_t wstart;
+};
+
+/** \brief Initialise a caching block device.
+ * A read miss loads line_sectors sectors from the missing sector on, so
+ * line_sectors greater than 1 gives read-ahead.  Reads of at least
+ * line_sectors sectors bypass the cache.  Writes are held in a window of
+ * wsize sectors while they continue the same run, and go to the lower
+ * device when a write outside the run, an overlapping read or
+ * block_cache_flush() needs them.
+ * \param cache Pointer to caching block device to initialize.
+ * \param lower Pointer to block device to cache.
+ * \param lines Array of nlines cache lines.
+ * \param nlines Number of cache lines.
+ * \param line_sectors Sectors in each cache line.
+ * \param data Buffer of nlines * line_sectors sectors for the lines.
+ * \param wbuf Buffer of wsize sectors for write combining.
+ * \param wsize Size of write combining window, 0 for write through.
+ * \return 0 on success.
+ */
+int block_cache_init(struct block_cache *cache, struct block_device *lower,
+		struct block_cache_line *lines, uint16_t nlines,
+		uint16_t line_sectors, void *data, void *wbuf, uint16_t wsize);
+
+/** \brief Set a lock for a cache shared by several volumes.
+ * Needed when the volumes are used from several threads, see 
+ * fat_lock_init().
+ * \param cache Pointer to caching block device.
+ * \param lock Lock for the cache, or NULL.
+ */
+void block_cache_set_lock(struct block_cache *cache, void *lock);
+
+/** \brief Write any combined writes to the lower device.
+ * Must be called before the lower device is used directly or removed.
+ * \param cache Pointer to caching block device.
+ * \return 0 on success.
+ */
+int block_cache_flush(struct block_cache *cache);
+
+/** \brief Drop all cached sectors, after flushing.
+ * Needed if the lower device was changed other than through the cache.
+ * \param cache Pointer to caching block device.
+ * \return 0 on success.
+ */
+int block_cache_invalidate(struct block_cache *cache);
+
+#endif
+
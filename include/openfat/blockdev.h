@@ -26,7 +26,35 @@
 #ifndef __BLOCKDEV_H
 #define __BLOCKDEV_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+/** \brief Block device geometry and capabilities.
+ * Sizes are in sectors.  Anything the device doesn't know is left zero.
+ */
+struct block_device_info {
+	/** \brief Total number of sectors. */
+	uint32_t sector_count;
+	/** \brief Preferred size of a transfer. */
+	uint32_t opt_transfer;
+	/** \brief Largest transfer done in one request. */
+	uint32_t max_transfer;
+	/** \brief Erase block or allocation unit size. */
+	uint32_t erase_size;
+	/** \brief Offset of sector 0 from the start of the medium, so
+	 * erase_size alignment can be checked on partitions. */
+	uint32_t offset;
+	/** \brief BLOCK_CAP_* flags. */
+	uint32_t flags;
+};
+
+/** \brief Device can discard unused sectors. */
+#define BLOCK_CAP_DISCARD	0x01
+/** \brief Device caches writes, they are only durable after a flush. */
+#define BLOCK_CAP_FLUSH		0x02
+/** \brief Device can write through its cache for single requests. */
+#define BLOCK_CAP_FUA		0x04
 
 /** \brief Structure representing an abstract block device. 
  * This abstraction must be provided by the application.
@@ -35,6 +63,10 @@ struct block_device {
 	/* Info about the device */
 	/** \brief Method to get sector size. */
 	uint16_t (*get_sector_size)(const struct block_device *dev);
+	/** \brief Optional method to fill in geometry and capabilities.
+	 * Called with info zeroed.  NULL if not supported. */
+	int (*get_info)(const struct block_device *dev, 
+			struct block_device_info *info);
 	/* ... more to be added as needed ... */
 
 	/* Actions on the device */
@@ -44,6 +76,12 @@ struct block_device {
 	/** \brief Method to write sectors. */
 	int (*write_sectors)(const struct block_device *dev, 
 			uint32_t sector, uint32_t count, const void *buf);
+	/** \brief Optional method to get a sector's contents in memory.
+	 * For devices held in memory, such as mapped image files.  NULL if
+	 * not supported, or the method may return NULL for any sector.  
+	 * The contents may only change through write_sectors(). */
+	const void *(*get_sector_ptr)(const struct block_device *dev,
+			uint32_t sector);
 	/* ... more to be added as needed ... */
 
 	/* May be private fields here ... */
@@ -56,6 +94,14 @@ block_get_sector_size(const struct block_device *dev)
 	return dev->get_sector_size(dev);
 }
 
+/* Fills in info, returns 0 or negative if the device gave no info */
+static inline int
+block_get_info(const struct block_device *dev, struct block_device_info *info)
+{
+	memset(info, 0, sizeof(*info));
+	return dev->get_info ? dev->get_info(dev, info) : -1;
+}
+
 /* Returns the number of sectors read or negative on error */
 static inline int __attribute__((warn_unused_result))
 block_read_sectors(const struct block_device *dev,
@@ -72,5 +118,12 @@ block_write_sectors(const struct block_device *dev,
 	return dev->write_sectors(dev, sector, count, buf);
 }
 
+/* Returns a pointer to the sector's contents or NULL if not in memory */
+static inline const void *
+block_get_sector_ptr(const struct block_device *dev, uint32_t sector)
+{
+	return dev->get_sector_ptr ? dev->get_sector_ptr(dev, sector) : NULL;
+}
+
 #endif
 
@@ -0,0 +1,162 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file iostat.h
+ * \brief I/O accounting block device.
+ * This module provides a block device that wraps any other, counting
+ * the requests passed through it.  Sectors are counted by the region of
+ * the FAT volume they fall in, taken from the boot sector when the
+ * volume is mounted, and the distance between consecutive requests is
+ * recorded.  Each request may also be passed to a trace function.
+ */
+
+#ifndef __IOSTAT_H
+#define __IOSTAT_H
+
+#include <stdint.h>
+
+#include "blockdev.h"
+
+/** \brief Regions of a FAT volume. */
+enum {
+	/** \brief Boot sector and other reserved sectors. */
+	BLOCK_IOSTAT_BOOT,
+	/** \brief All copies of the FAT. */
+	BLOCK_IOSTAT_FAT,
+	/** \brief Root directory of FAT12 and FAT16 volumes. */
+	BLOCK_IOSTAT_ROOT,
+	/** \brief Clusters, including the FAT32 root directory. */
+	BLOCK_IOSTAT_DATA,
+	BLOCK_IOSTAT_REGIONS,
+};
+
+/** \brief Number of request size classes, see block_iostat_counts. */
+#define BLOCK_IOSTAT_SIZES	16
+
+/** \brief Counts for reads or writes. */
+struct block_iostat_counts {
+	/** \brief Requests passed to the lower device. */
+	uint32_t calls;
+	/** \brief Sectors in all requests. */
+	uint32_t sectors;
+	/** \brief Bytes in all requests. */
+	uint64_t bytes;
+	/** \brief Sectors in the largest request. */
+	uint32_t max_sectors;
+	/** \brief Sectors in each BLOCK_IOSTAT_* region. */
+	uint32_t region[BLOCK_IOSTAT_REGIONS];
+	/** \brief Requests of 1, 2-3, 4-7, ... sectors.  The last class
+	 * holds everything larger. */
+	uint32_t sizes[BLOCK_IOSTAT_SIZES];
+	/** \brief Requests not starting where the previous request,
+	 * read or write, ended. */
+	uint32_t seeks;
+	/** \brief Sum of those distances in sectors. */
+	uint64_t seek_sectors;
+};
+
+/** \brief A request, as passed to the trace function. */
+struct block_iostat_req {
+	uint32_t sector;
+	uint32_t count;
+	/** \brief Signed distance from the end of the previous request. */
+	int32_t seek;
+	/** \brief Return value from the lower device. */
+	int ret;
+	/** \brief Non-zero for writes. */
+	uint8_t write;
+	/** \brief Region of the first sector. */
+	uint8_t region;
+};
+
+/** \brief Trace function, called for each request after it is done. */
+typedef void (*block_iostat_trace_t)(void *priv,
+		const struct block_iostat_req *req);
+
+/** \brief Structure representing an accounting block device.
+ * Counts may be read directly, other fields are private. */
+struct block_iostat {
+	struct block_device bldev;
+	struct block_device *lower;
+	uint16_t sector_size;
+	void *lock;
+
+	/* Region boundaries, 0 until a boot sector is read */
+	uint32_t fat_start;
+	uint32_t root_start;
+	uint32_t data_start;
+
+	/* Sector following the previous request */
+	uint32_t next;
+
+	block_iostat_trace_t trace;
+	void *trace_priv;
+
+	/** \brief Read requests. */
+	struct block_iostat_counts read;
+	/** \brief Write requests. */
+	struct block_iostat_counts write;
+	/** \brief Bytes given by the application, see
+	 * block_iostat_add_user(). */
+	uint64_t user_bytes;
+};
+
+/** \brief Initialise an accounting block device.
+ * The volume must be mounted on the accounting device, for the region
+ * boundaries to be read from the boot sector.  Until then every sector
+ * counts as data.  Sectors are not read in place through the device, so
+ * that every access is counted.
+ * \param stat Pointer to accounting block device to initialize.
+ * \param lower Pointer to block device to account.
+ * \return 0 on success.
+ */
+int block_iostat_init(struct block_iostat *stat, struct block_device *lower);
+
+/** \brief Set a lock for a device shared by several volumes.
+ * Needed when the volumes are used from several threads, see
+ * fat_lock_init().
+ * \param stat Pointer to accounting block device.
+ * \param lock Lock for the device, or NULL.
+ */
+void block_iostat_set_lock(struct block_iostat *stat, void *lock);
+
+/** \brief Set a function to be called for each request.
+ * Called with the lock held, so requests are traced in order.
+ * \param stat Pointer to accounting block device.
+ * \param trace Trace function, or NULL.
+ * \param priv Passed to the trace function.
+ */
+void block_iostat_set_trace(struct block_iostat *stat,
+		block_iostat_trace_t trace, void *priv);
+
+/** \brief Count bytes written by the application.
+ * Write amplification is write.bytes / user_bytes.
+ * \param stat Pointer to accounting block device.
+ * \param bytes Bytes passed to fat_write().
+ */
+void block_iostat_add_user(struct block_iostat *stat, uint32_t bytes);
+
+/** \brief Clear all counts.  Region boundaries are kept.
+ * \param stat Pointer to accounting block device.
+ */
+void block_iostat_reset(struct block_iostat *stat);
+
+#endif
+
@@ -0,0 +1,106 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** \file trace.h
+ * \brief Recording of calls to the filesystem.
+ * When the library is built with OPENFAT_TRACE defined (make TRACE=1),
+ * each call to the public interface can be recorded with its arguments,
+ * result and duration, so that a workload can be replayed elsewhere.
+ * File contents are not recorded, only sizes.
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+/** \brief Calls recorded. */
+enum {
+	FAT_TRACE_MOUNT = 1,	/**< fat_vol_init(), fat_vol_mount() */
+	FAT_TRACE_UMOUNT,	/**< fat_vol_umount() */
+	FAT_TRACE_CHDIR,	/**< fat_chdir() */
+	FAT_TRACE_MKDIR,	/**< fat_mkdir() */
+	FAT_TRACE_OPEN,		/**< fat_open() */
+	FAT_TRACE_CREATE,	/**< fat_create() */
+	FAT_TRACE_SYNC,		/**< fat_file_sync() */
+	FAT_TRACE_READ,		/**< fat_read() */
+	FAT_TRACE_WRITE,	/**< fat_write() */
+	FAT_TRACE_LSEEK,	/**< fat_lseek() */
+	FAT_TRACE_UNLINK,	/**< fat_unlink() */
+	FAT_TRACE_COMPACT,	/**< fat_dir_compact() */
+	FAT_TRACE_READDIR,	/**< fat_readdir() */
+	FAT_TRACE_GETDENTS,	/**< fat_getdents() */
+	FAT_TRACE_STREAM,	/**< fat_file_stream() */
+	FAT_TRACE_STREAM_END,	/**< fat_file_stream_end() */
+	FAT_TRACE_UFAT_OPEN,	/**< ufat_open() */
+	FAT_TRACE_OPS,
+};
+
+/** \brief Size of a record without its name.
+ *
+ * Records are little endian:
+ *   0	op	uint8_t		FAT_TRACE_*
+ *   1	aux	uint8_t		whence and signs for fat_lseek()
+ *   2	namelen	uint16_t	Length of name following the record
+ *   4	vol	uint32_t	Volume handle
+ *   8	file	uint32_t	File handle, 0 for calls on the volume
+ *   12	arg	int32_t		Size, count, flags or offset
+ *   16	ret	int32_t		Return value
+ *   20	start	uint32_t	Time of call
+ *   24	time	uint32_t	Duration of call
+ *   28	name			Name or path, not terminated
+ * Handles are identified by the low 32 bits of their address.  For
+ * ufat_open() file is the handle returned, and ret is 0 or -1.  Times
+ * are in the units of the clock supplied.
+ *
+ * Files may be up to 4 GiB, so for fat_lseek() arg and ret hold the low
+ * 32 bits of the offset and result, and aux holds their signs as well
+ * as whence.
+ */
+#define FAT_TRACE_HEADER	28
+
+/** \brief Fields of aux in fat_lseek() records. */
+#define FAT_TRACE_SEEK_WHENCE	0x0F	/**< whence */
+#define FAT_TRACE_SEEK_RET_NEG	0x40	/**< Result is negative */
+#define FAT_TRACE_SEEK_ARG_NEG	0x80	/**< Offset is negative */
+
+/** \brief Longest name recorded, longer names are cut short. */
+#define FAT_TRACE_NAME_MAX	255
+
+/** \brief Output for recording, supplied by the application. */
+struct fat_trace_ops {
+	/** Store one record of len bytes.  Called after each call
+	 * returns, from the calling thread, so must serialise itself if
+	 * the library is used from several threads. */
+	void (*write)(void *priv, const void *rec, int len);
+	/** Current time, in any units. */
+	uint32_t (*clock)(void *priv);
+};
+
+/** \brief Start or stop recording calls.
+ * \param ops Output for records, or NULL to stop.
+ * \param priv Passed to the ops functions.
+ * \return 0 on success, -ENOSYS if the library was built without
+ * OPENFAT_TRACE.
+ */
+int fat_trace_init(const struct fat_trace_ops *ops, void *priv);
+
+#endif
+
@@ -30,7 +30,11 @@
 #include <stdlib.h>
 
 FatVol * ufat_mount(struct block_device *dev);
-static inline void ufat_umount(FatVol *vol) { free(vol); }
+static inline void ufat_umount(FatVol *vol)
+{
+	fat_vol_umount(vol);
+	free(vol);
+}
 
 FatFile * ufat_open(FatVol *vol, const char *path, int flags);
 static inline void ufat_close(FatFile *file) { free(file); }
@@ -0,0 +1,319 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Caching block device.
+ * Reads are served from an LRU cache of sector runs, loaded with
+ * read-ahead.  Writes update cached copies and are combined in a window
+ * while they continue the same run of sectors.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "openfat.h"
+#include "openfat/bcache.h"
+
+#include "fat_core.h"
+
+static uint16_t bcache_get_sector_size(const struct block_device *dev)
+{
+	struct block_cache *cache = (void*)dev;
+
+	return cache->sector_size;
+}
+
+static int bcache_get_info(const struct block_device *dev, 
+			struct block_device_info *info)
+{
+	struct block_cache *cache = (void*)dev;
+
+	block_get_info(cache->lower, info);
+	if(cache->wsize)
+		info->flags |= BLOCK_CAP_FLUSH;
+
+	return 0;
+}
+
+static inline uint8_t *
+line_sector(struct block_cache *cache, struct block_cache_line *l, 
+		uint32_t sector)
+{
+	return l->data + (sector - l->sector) * cache->sector_size;
+}
+
+static struct block_cache_line *
+bcache_find(struct block_cache *cache, uint32_t sector)
+{
+	for(int i = 0; i < cache->nlines; i++) {
+		struct block_cache_line *l = &cache->lines[i];
+		if(l->count && (sector >= l->sector) && 
+		   (sector - l->sector < l->count))
+			return l;
+	}
+	return NULL;
+}
+
+static void bcache_drop_lines(struct block_cache *cache)
+{
+	for(int i = 0; i < cache->nlines; i++)
+		cache->lines[i].count = 0;
+}
+
+/* Write out the combining window.  If that fails the cached copies may
+ * hold data that never reached the device, so they are dropped. */
+static int bcache_wflush(struct block_cache *cache)
+{
+	int ret;
+
+	if(!cache->wcount)
+		return 0;
+
+	ret = block_write_sectors(cache->lower, cache->wstart, cache->wcount,
+			cache->wbuf);
+	if(ret != cache->wcount) {
+		bcache_drop_lines(cache);
+		ret = -1;
+	} else {
+		ret = 0;
+	}
+	cache->wcount = 0;
+
+	return ret;
+}
+
+/* Read a line's worth of sectors from sector on into the least recently
+ * used line. */
+static struct block_cache_line *
+bcache_load(struct block_cache *cache, uint32_t sector)
+{
+	struct block_cache_line *lru = &cache->lines[0];
+	int ret;
+
+	for(int i = 1; (i < cache->nlines) && lru->count; i++)
+		if(!cache->lines[i].count || 
+		   (cache->lines[i].stamp < lru->stamp))
+			lru = &cache->lines[i];
+
+	/* Read-ahead may reach combined writes */
+	if(cache->wcount && (sector < cache->wstart + cache->wcount) &&
+	   (sector + cache->line_sectors > cache->wstart) && 
+	   bcache_wflush(cache))
+		return NULL;
+
+	lru->count = 0;
+	ret = block_read_sectors(cache->lower, sector, cache->line_sectors,
+			lru->data);
+	if((ret <= 0) && (cache->line_sectors > 1)) 
+		/* Read-ahead may have run off the end of the device */
+		ret = block_read_sectors(cache->lower, sector, 1, lru->data);
+	if(ret <= 0)
+		return NULL;
+
+	lru->sector = sector;
+	lru->count = ret;
+
+	return lru;
+}
+
+static int bcache_read_sectors(const struct block_device *dev, 
+			uint32_t sector, uint32_t count, void *buf)
+{
+	struct block_cache *cache = (void*)dev;
+	struct block_cache_line *l;
+	uint8_t *p = buf;
+	uint32_t i = 0;
+	int ret = -1;
+
+	_fat_lock(cache->lock);
+
+	/* Combined writes are newer than the lower device */
+	if(cache->wcount && (sector < cache->wstart + cache->wcount) &&
+	   (sector + count > cache->wstart) && bcache_wflush(cache))
+		goto out;
+
+	while(i < count) {
+		uint32_t n;
+
+		l = bcache_find(cache, sector + i);
+		if(l) {
+			memcpy(p, line_sector(cache, l, sector + i), 
+					cache->sector_size);
+			l->stamp = ++cache->stamp;
+			p += cache->sector_size;
+			i++;
+			continue;
+		}
+
+		for(n = 1; (i + n < count) && 
+			   !bcache_find(cache, sector + i + n); n++)
+			;
+		if(n >= cache->line_sectors) {
+			/* Long reads go straight to the caller */
+			ret = block_read_sectors(cache->lower, sector + i, 
+					n, p);
+			if(ret <= 0)
+				break;
+			p += ret * cache->sector_size;
+			i += ret;
+			if((uint32_t)ret < n)
+				break;
+			continue;
+		}
+
+		if(!bcache_load(cache, sector + i))
+			break;
+	}
+	ret = (i || !count) ? (int)i : -1;
+
+out:
+	_fat_unlock(cache->lock);
+	return ret;
+}
+
+static int bcache_write_sectors(const struct block_device *dev, 
+			uint32_t sector, uint32_t count, const void *buf)
+{
+	struct block_cache *cache = (void*)dev;
+	int ret;
+
+	_fat_lock(cache->lock);
+
+	if(cache->wcount && (sector >= cache->wstart) && 
+	   (sector <= cache->wstart + cache->wcount) &&
+	   (sector + count <= cache->wstart + cache->wsize)) {
+		/* Continues or rewrites the current run */
+		memcpy(cache->wbuf + 
+			(sector - cache->wstart) * cache->sector_size, 
+			buf, count * cache->sector_size);
+		if(sector + count > cache->wstart + cache->wcount)
+			cache->wcount = sector + count - cache->wstart;
+		ret = count;
+	} else if(bcache_wflush(cache)) {
+		ret = -1;
+	} else if(count >= cache->wsize) {
+		ret = block_write_sectors(cache->lower, sector, count, buf);
+		if(ret != (int)count) {
+			bcache_drop_lines(cache);
+			goto out;
+		}
+	} else {
+		memcpy(cache->wbuf, buf, count * cache->sector_size);
+		cache->wstart = sector;
+		cache->wcount = count;
+		ret = count;
+	}
+
+	/* Keep cached copies current */
+	for(int i = 0; (ret > 0) && (i < cache->nlines); i++) {
+		struct block_cache_line *l = &cache->lines[i];
+		uint32_t first, last;
+		if(!l->count)
+			continue;
+		first = (sector > l->sector) ? sector : l->sector;
+		last = (sector + count < l->sector + l->count) ? 
+			sector + count : l->sector + l->count;
+		if(first < last)
+			memcpy(line_sector(cache, l, first), 
+				(const uint8_t *)buf + 
+					(first - sector) * cache->sector_size,
+				(last - first) * cache->sector_size);
+	}
+
+out:
+	_fat_unlock(cache->lock);
+	return ret;
+}
+
+static const void *bcache_get_sector_ptr(const struct block_device *dev, 
+			uint32_t sector)
+{
+	struct block_cache *cache = (void*)dev;
+	const void *p = NULL;
+
+	/* Cache lines are reused, so only the lower device's memory is
+	 * stable enough to hand out. */
+	_fat_lock(cache->lock);
+	if(!cache->wcount || (sector < cache->wstart) || 
+	   (sector >= cache->wstart + cache->wcount))
+		p = block_get_sector_ptr(cache->lower, sector);
+	_fat_unlock(cache->lock);
+
+	return p;
+}
+
+int block_cache_init(struct block_cache *cache, struct block_device *lower,
+		struct block_cache_line *lines, uint16_t nlines,
+		uint16_t line_sectors, void *data, void *wbuf, uint16_t wsize)
+{
+	if(!nlines || !line_sectors)
+		return -1;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->lower = lower;
+	cache->sector_size = block_get_sector_size(lower);
+	cache->lines = lines;
+	cache->nlines = nlines;
+	cache->line_sectors = line_sectors;
+	cache->wbuf = wbuf;
+	cache->wsize = wbuf ? wsize : 0;
+
+	for(int i = 0; i < nlines; i++) {
+		lines[i].data = (uint8_t *)data + 
+			i * line_sectors * cache->sector_size;
+		lines[i].count = 0;
+	}
+
+	cache->bldev.get_sector_size = bcache_get_sector_size;
+	cache->bldev.get_info = bcache_get_info;
+	cache->bldev.read_sectors = bcache_read_sectors;
+	cache->bldev.write_sectors = bcache_write_sectors;
+	cache->bldev.get_sector_ptr = bcache_get_sector_ptr;
+
+	return 0;
+}
+
+void block_cache_set_lock(struct block_cache *cache, void *lock)
+{
+	cache->lock = lock;
+}
+
+int block_cache_flush(struct block_cache *cache)
+{
+	int ret;
+
+	_fat_lock(cache->lock);
+	ret = bcache_wflush(cache);
+	_fat_unlock(cache->lock);
+
+	return ret;
+}
+
+int block_cache_invalidate(struct block_cache *cache)
+{
+	int ret;
+
+	_fat_lock(cache->lock);
+	ret = bcache_wflush(cache);
+	bcache_drop_lines(cache);
+	_fat_unlock(cache->lock);
+
+	return ret;
+}
+
@@ -109,6 +109,30 @@ _bpb_first_sector_of_cluster(struct bpb_common *bpb, uint32_t n)
 		_bpb_first_data_sector(bpb);
 }
 
+/* FSInfo sector, FAT32 only */
+struct fat_fsinfo {
+	uint32_t lead_sig;
+	uint8_t Reserved1[480];
+	uint32_t struc_sig;
+	uint32_t free_count;
+	uint32_t nxt_free;
+	uint8_t Reserved2[12];
+	uint32_t trail_sig;
+} __attribute__((packed));
+
+#define FSINFO_LEAD_SIG		0x41615252
+#define FSINFO_STRUC_SIG	0x61417272
+#define FSINFO_TRAIL_SIG	0xAA550000
+#define FSINFO_UNKNOWN		0xFFFFFFFF
+
+/* Volume flags in FAT[1] on FAT16 and FAT32.  The clean shutdown bit is
+ * cleared while the volume is mounted and being changed, and the hard
+ * error bit is cleared if a disk error was seen. */
+#define FAT16_CLN_SHUT		0x8000
+#define FAT16_HRD_ERR		0x4000
+#define FAT32_CLN_SHUT		0x08000000
+#define FAT32_HRD_ERR		0x04000000
+
 enum fat_type {
 	FAT_TYPE_FAT12 = 12,
 	FAT_TYPE_FAT16 = 16,
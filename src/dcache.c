@@ -0,0 +1,195 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Path component cache.
+ * Remembers the result of looking up a name in a directory, keyed by the
+ * directory's first cluster and the name as given, so resolving the same
+ * path again doesn't read any directories.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "openfat.h"
+
+#include "fat_core.h"
+
+#define DCACHE_NEGATIVE		0x01	/* Name was not found */
+#define DCACHE_ROOT		0x02	/* Name is the root directory */
+
+void fat_dcache_init(struct fat_vol_handle *vol, struct fat_dcache_entry *ent,
+		uint16_t size)
+{
+	memset(ent, 0, size * sizeof(*ent));
+	vol->dcache = ent;
+	vol->dcache_size = size;
+	vol->dcache_stamp = 0;
+}
+
+static struct fat_dcache_entry *
+dcache_find(struct fat_vol_handle *vol, uint32_t parent,
+		const char *name, int len)
+{
+	for(int i = 0; i < vol->dcache_size; i++) {
+		struct fat_dcache_entry *e = &vol->dcache[i];
+		if(e->stamp && (e->parent == parent) && (e->len == len) &&
+		   !memcmp(e->name, name, len))
+			return e;
+	}
+	return NULL;
+}
+
+/* The cache is shared with open files, which update it when their
+ * directory entry is written, so all access is under the cache lock. */
+
+/* Look up name in directory parent.  Returns 0 and fills in file if the
+ * name is cached, -ENOENT if the name is cached as not existing, or -1 if
+ * the name isn't in the cache. */
+int _fat_dcache_lookup(struct fat_vol_handle *vol, uint32_t parent,
+		const char *name, struct fat_file_handle *file)
+{
+	int len = strcspn(name, "/");
+	struct fat_dcache_entry *e;
+	int ret = 0;
+
+	FAT_CACHE_LOCK();
+	e = dcache_find(vol, parent, name, len);
+	if(e)
+		e->stamp = ++vol->dcache_stamp;
+
+	if(!e) {
+		ret = -1;
+	} else if(e->flags & DCACHE_NEGATIVE) {
+		ret = -ENOENT;
+	} else if(e->flags & DCACHE_ROOT) {
+		_fat_file_root(vol, file);
+	} else {
+		memset(file, 0, sizeof(*file));
+		file->fat = vol;
+		file->first_cluster = e->first_cluster;
+		file->cur_cluster = e->first_cluster;
+		file->size = e->size;
+		file->synced_size = e->size;
+		if(vol->sync_policy.clock)
+			file->synced_time = vol->sync_policy.clock();
+		file->dirent_sector = e->dirent_sector;
+		file->dirent_offset = e->dirent_offset;
+	}
+	FAT_CACHE_UNLOCK();
+
+	return ret;
+}
+
+/* Remember the result of looking up name in directory parent. */
+void _fat_dcache_insert(struct fat_vol_handle *vol, uint32_t parent,
+		const char *name, int result,
+		const struct fat_file_handle *file)
+{
+	int len = strcspn(name, "/");
+	struct fat_dcache_entry *e;
+
+	if(!vol->dcache_size || (len > FAT_DCACHE_NAME_MAX) ||
+	   (result && (result != -ENOENT)))
+		return;
+
+	FAT_CACHE_LOCK();
+	e = dcache_find(vol, parent, name, len);
+	if(!e) {
+		/* Replace an unused or the least recently used entry */
+		e = &vol->dcache[0];
+		for(int i = 1; (i < vol->dcache_size) && e->stamp; i++)
+			if(vol->dcache[i].stamp < e->stamp)
+				e = &vol->dcache[i];
+	}
+
+	memset(e, 0, sizeof(*e));
+	e->parent = parent;
+	e->stamp = ++vol->dcache_stamp;
+	e->len = len;
+	memcpy(e->name, name, len);
+	if(result) {
+		e->flags = DCACHE_NEGATIVE;
+	} else if(file->root_flag) {
+		e->flags = DCACHE_ROOT;
+	} else {
+		e->first_cluster = file->first_cluster;
+		e->size = file->size;
+		e->dirent_sector = file->dirent_sector;
+		e->dirent_offset = file->dirent_offset;
+	}
+	FAT_CACHE_UNLOCK();
+}
+
+/* A file's directory entry was written, update cached copies. */
+void _fat_dcache_update(const struct fat_file_handle *file)
+{
+	struct fat_vol_handle *vol = file->fat;
+
+	FAT_CACHE_LOCK();
+	for(int i = 0; i < vol->dcache_size; i++) {
+		struct fat_dcache_entry *e = &vol->dcache[i];
+		if(e->stamp && (e->dirent_sector == file->dirent_sector) &&
+		   (e->dirent_offset == file->dirent_offset)) {
+			e->first_cluster = file->first_cluster;
+			e->size = file->size;
+		}
+	}
+	FAT_CACHE_UNLOCK();
+}
+
+/* A file was deleted, forget any names that found it. */
+void _fat_dcache_drop_file(const struct fat_file_handle *file)
+{
+	struct fat_vol_handle *vol = file->fat;
+
+	FAT_CACHE_LOCK();
+	for(int i = 0; i < vol->dcache_size; i++) {
+		struct fat_dcache_entry *e = &vol->dcache[i];
+		if((e->dirent_sector == file->dirent_sector) &&
+		   (e->dirent_offset == file->dirent_offset))
+			e->stamp = 0;
+	}
+	FAT_CACHE_UNLOCK();
+}
+
+/* A file was created in directory parent, forget names that weren't
+ * found there, as the new file may match them. */
+void _fat_dcache_drop_negative(struct fat_vol_handle *vol, uint32_t parent)
+{
+	FAT_CACHE_LOCK();
+	for(int i = 0; i < vol->dcache_size; i++) {
+		struct fat_dcache_entry *e = &vol->dcache[i];
+		if((e->parent == parent) && (e->flags & DCACHE_NEGATIVE))
+			e->stamp = 0;
+	}
+	FAT_CACHE_UNLOCK();
+}
+
+/* Forget everything cached for directory parent.  Used when a
+ * directory's clusters are reused or its entries are moved. */
+void _fat_dcache_drop_dir(struct fat_vol_handle *vol, uint32_t parent)
+{
+	FAT_CACHE_LOCK();
+	for(int i = 0; i < vol->dcache_size; i++)
+		if(vol->dcache[i].parent == parent)
+			vol->dcache[i].stamp = 0;
+	FAT_CACHE_UNLOCK();
+}
+
@@ -68,25 +68,32 @@ static int ascii_from_utf16(char *ascii, const uint16_t *utf16, int count)
 }
 #endif
 
-int fat_readdir(struct fat_file_handle *h, struct dirent *ent)
+/* Read the next directory entry, also returning the short entry and its
+ * location. */
+static int fat_readdir_entry(struct fat_file_handle *h, struct dirent *ent,
+		struct fat_sdirent *fatent, uint32_t *sector, uint16_t *offset)
 {
 #ifdef LONG_NAME_SUPPORT
 	uint16_t csum = -1;
 #endif
-	struct fat_sdirent fatent;
 	int i, j;
 
-	while(fat_read(h, &fatent, sizeof(fatent)) == sizeof(fatent)) {
+	for(;;) {
+		if(!h->root_flag && (h->cur_cluster >= fat_eoc(h->fat)))
+			return -1;	/* End of cluster chain */
+		_fat_file_sector_offset(h, sector, offset);
+		if(_fat_read(h, fatent, sizeof(*fatent)) != sizeof(*fatent))
+			return -1;
 
-		if(fatent.name[0] == 0) 
+		if(fatent->name[0] == 0) 
 			return -1;	/* Empty entry, end of directory */
-		if(fatent.name[0] == (char)0xe5)
+		if(fatent->name[0] == (char)0xe5)
 			continue;	/* Deleted entry */
-		if(fatent.attr == FAT_ATTR_VOLUME_ID)
+		if(fatent->attr == FAT_ATTR_VOLUME_ID)
 			continue;	/* Ignore volume id entry */
-		if(fatent.attr == FAT_ATTR_LONG_NAME) {
+		if(fatent->attr == FAT_ATTR_LONG_NAME) {
 #ifdef LONG_NAME_SUPPORT
-			struct fat_ldirent *ld = (void*)&fatent;
+			struct fat_ldirent *ld = (void*)fatent;
 			if(ld->ord & FAT_LAST_LONG_ENTRY) {
 				memset(ent->d_name, 0, sizeof(ent->d_name));
 				csum = ld->checksum;
@@ -109,16 +116,16 @@ int fat_readdir(struct fat_file_handle *h, struct dirent *ent)
 			continue;
 		}
 #ifdef LONG_NAME_SUPPORT
-		if(csum != _fat_dirent_chksum((uint8_t*)fatent.name)) 
+		if(csum != _fat_dirent_chksum((uint8_t*)fatent->name)) 
 			ent->d_name[0] = 0;
 
 		if(ent->d_name[0] == 0) {
 #endif
 			for(i = 0, j = 0; i < 11; i++, j++) {
-				ent->d_name[j] = tolower(fatent.name[i]);
-				if(fatent.name[i] == ' ') {
+				ent->d_name[j] = tolower(fatent->name[i]);
+				if(fatent->name[i] == ' ') {
 					ent->d_name[j] = '.';
-					while((fatent.name[++i] == ' ') && (i < 11));
+					while((fatent->name[++i] == ' ') && (i < 11));
 				}
 			} 
 			if(ent->d_name[j-1] == '.')
@@ -129,52 +136,77 @@ int fat_readdir(struct fat_file_handle *h, struct dirent *ent)
 		}
 #endif
 		/* Non-standard */
-		ent->fat_attr = fatent.attr;
-		memcpy(ent->fat_sname, fatent.name, 11);
+		ent->fat_attr = fatent->attr;
+		memcpy(ent->fat_sname, fatent->name, 11);
 
 		return 0;
 	}
-	return -1;
 }
 
-/* Seek to a place in the directory suitable for writing 'entries' new
- * directory entries.  Called when creating files. */
-int _fat_dir_seek_empty(struct fat_file_handle *dir, int entries)
+int fat_readdir(struct fat_file_handle *h, struct dirent *ent)
 {
-	uint32_t pos = 0;
-	struct fat_sdirent ent;
-	int i = 0;
+	int ret;
+	FAT_TRACE_START();
+
+	_fat_lock(h->lock);
+	ret = _fat_readdir(h, ent);
+	_fat_unlock(h->lock);
+	FAT_TRACE(READDIR, h->fat, h, NULL, 0, 0, ret);
+
+	return ret;
+}
 
-	fat_lseek(dir, 0, SEEK_SET);
+int _fat_readdir(struct fat_file_handle *h, struct dirent *ent)
+{
+	struct fat_sdirent fatent;
+	uint32_t sector;
+	uint16_t offset;
+
+	return fat_readdir_entry(h, ent, &fatent, &sector, &offset);
+}
+
+int fat_getdents(struct fat_file_handle *dir, struct fat_dirent_plus *ents,
+		int count)
+{
+	struct fat_sdirent fatent;
+	int i;
+	FAT_TRACE_START();
 
-	while(fat_read(dir, &ent, sizeof(ent)) == sizeof(ent)) {
-		if(ent.name[0] == 0) /* Empty entry, end of directory */
+	_fat_lock(dir->lock);
+	for(i = 0; i < count; i++) {
+		struct fat_dirent_plus *e = &ents[i];
+		if(fat_readdir_entry(dir, &e->d, &fatent, 
+				&e->dirent_sector, &e->dirent_offset))
 			break;
-		if(ent.name[0] == (char)0xe5) {	/* Deleted entry */
-			i++;
-			if(i == entries) 
-				break;
-			continue;	
-		}
-		i = 0;
-		pos = dir->position;
+		e->size = __get_le32(&fatent.size);
+		e->first_cluster = 
+			((uint32_t)__get_le16(&fatent.cluster_hi) << 16) | 
+			__get_le16(&fatent.cluster_lo);
+		e->create_time_fine = fatent.create_time_fine;
+		e->create_time = __get_le16(&fatent.create_time);
+		e->create_date = __get_le16(&fatent.create_date);
+		e->access_date = __get_le16(&fatent.access_date);
+		e->write_time = __get_le16(&fatent.write_time);
+		e->write_date = __get_le16(&fatent.write_date);
 	}
-
-	fat_lseek(dir, pos, SEEK_SET);
-	return 0;
+	_fat_unlock(dir->lock);
+	FAT_TRACE(GETDENTS, dir->fat, dir, NULL, count, 0, i);
+	return i;
 }
 
-static int fat_comparesfn(const char * name, const char *fatname)
+/* Convert a name to its DOS 8.3 canonical form for comparison.  Stops at
+ * end of string or a path separator.  Returns non-zero if the whole name
+ * was consumed. */
+int _fat_canon_sname(const char *name, char *canonname)
 {
-	char canonname[11];
 	int i;
 
-	memset(canonname, ' ', sizeof(canonname));
+	memset(canonname, ' ', 11);
 	if(name[0] == '.') {
 		/* Special case:
 		 * Only legal names are '.' and '..' */
-		memcpy(canonname, name, strlen(name));
-		name += strlen(name);
+		for(i = 0; (i < 2) && (*name == '.'); i++)
+			canonname[i] = *name++;
 	} else for(i = 0; (i < 11) && *name && (*name != '/'); i++) {
 		if(*name == '.') {
 			if(i < 8) continue;
@@ -182,56 +214,322 @@ static int fat_comparesfn(const char * name, const char *fatname)
 		}
 		canonname[i] = toupper(*name++);
 	}
-	return ((*name == 0) || (*name == '/')) && !memcmp(canonname, fatname, 11);
+	return (*name == 0) || (*name == '/');
+}
+
+/* Compare the part of name held in a long name entry, ignoring case as
+ * FAT names are case insensitive.  Characters past
+ * the end of the name are not checked, but must be terminated with a null
+ * if there is room. */
+static int fat_ldirent_match(const struct fat_ldirent *ld, 
+		const char *name, int len)
+{
+	int base = ((ld->ord & 0x3f) - 1) * 13;
+
+	for(int j = 0; (j < 13) && (base + j <= len); j++) {
+		uint16_t c;
+		if(j < 5)
+			c = __get_le16(&ld->name1[j]);
+		else if(j < 11)
+			c = __get_le16(&ld->name2[j - 5]);
+		else
+			c = __get_le16(&ld->name3[j - 11]);
+
+		if(base + j == len)
+			return c == 0;
+		if((c > 127) || (tolower(c) != tolower(name[base + j])))
+			return 0;
+	}
+	return 1;
+}
+
+/* State for comparing a name against directory entries as they are read */
+struct fat_name_match {
+	const char *name;
+	int len;
+	int sname_ok;
+	char canonname[11];
+	uint8_t lfn_next;
+	uint8_t lfn_csum;
+	uint8_t lfn_match;
+};
+
+static void fat_match_init(struct fat_name_match *m, const char *name)
+{
+	m->name = name;
+	m->len = strcspn(name, "/");
+	m->sname_ok = _fat_canon_sname(name, m->canonname);
+	m->lfn_next = m->lfn_match = 0;
+}
+
+/* Feed the next directory entry to the matcher.  Returns 1 if it is the
+ * short entry for the name, 0 if it is some other short entry, or -1 if
+ * it isn't a short entry at all.  The short name is compared against the
+ * canonical form of the name, a long name match must have all parts and
+ * a matching checksum. */
+static int fat_match_entry(struct fat_name_match *m, 
+		const struct fat_sdirent *fatent)
+{
+	int match;
+
+	if((fatent->name[0] == (char)0xe5) || 
+	   (fatent->attr == FAT_ATTR_VOLUME_ID)) {
+		/* Deleted entry or volume id */
+		m->lfn_next = m->lfn_match = 0;
+		return -1;
+	}
+	if(fatent->attr == FAT_ATTR_LONG_NAME) {
+		const struct fat_ldirent *ld = (const void*)fatent;
+		if(ld->ord & FAT_LAST_LONG_ENTRY) {
+			/* First entry of long name, check length.  The
+			 * terminating null may be in an entry of its own. */
+			m->lfn_next = ld->ord & 0x3f;
+			m->lfn_csum = ld->checksum;
+			m->lfn_match = (m->len >= (m->lfn_next - 1) * 13) &&
+				(m->len <= m->lfn_next * 13);
+		}
+		if(((ld->ord & 0x3f) != m->lfn_next) || 
+		   (ld->checksum != m->lfn_csum)) {
+			/* Abandon orphaned entry */
+			m->lfn_next = m->lfn_match = 0;
+			return -1;
+		}
+		if(m->lfn_match)
+			m->lfn_match = fat_ldirent_match(ld, m->name, m->len);
+		m->lfn_next--;
+		return -1;
+	}
+
+	match = (m->sname_ok && !memcmp(m->canonname, fatent->name, 11)) ||
+		(m->lfn_match && !m->lfn_next && 
+		 (m->lfn_csum == _fat_dirent_chksum((uint8_t*)fatent->name)));
+	m->lfn_next = m->lfn_match = 0;
+	return match;
+}
+
+/* Search a directory for a file from the current position.  The name may
+ * be terminated by a null or a path separator.  Long name entries are
+ * compared as they are read, so the name doesn't need to be assembled
+ * in a struct dirent.  If count is non-zero, give up after checking count
+ * short entries.  On success, the short entry is copied into fatent and
+ * its location stored in sector and offset.  Returns 0 on success. */
+int _fat_dir_lookup(struct fat_file_handle *dir, const char *name, int count,
+		struct fat_sdirent *fatent, uint32_t *sector, uint16_t *offset)
+{
+	const struct fat_vol_handle *fat = dir->fat;
+	struct fat_name_match m;
+	uint32_t sec = 0;
+	uint16_t off = FAT_BPS(fat);
+	int ret;
+
+	fat_match_init(&m, name);
+
+	for(;;) {
+		if(!dir->root_flag && (dir->cur_cluster >= fat_eoc(fat)))
+			return -ENOENT;
+		/* Track location, only recalculate at sector boundary */
+		if(off >= FAT_BPS(fat))
+			_fat_file_sector_offset(dir, &sec, &off);
+
+		ret = _fat_read(dir, fatent, sizeof(*fatent));
+		if(ret < 0)
+			return ret;
+		if(ret != sizeof(*fatent))
+			return -ENOENT;
+		off += sizeof(*fatent);
+
+		if(fatent->name[0] == 0) 
+			return -ENOENT;	/* Empty entry, end of directory */
+
+		ret = fat_match_entry(&m, fatent);
+		if(ret > 0) {
+			*sector = sec;
+			*offset = off - sizeof(*fatent);
+			return 0;
+		}
+
+		if(!ret && count && !--count)
+			return -ENOENT;
+	}
+}
+
+/* Scan a whole directory before creating name in it.  In the same pass,
+ * looks for an existing entry for name, records which of the ncand
+ * candidate short names in cand are already taken, and finds the first
+ * run of free entries that can hold entries new entries.  Candidates all
+ * start with the first character of the basis, but a one character basis
+ * is followed by the tail in some and a hash in others.  Returns 0 unless
+ * there was an error reading the directory. */
+int _fat_dir_scan(struct fat_file_handle *dir, const char *name,
+		const uint8_t (*cand)[11], int ncand, int entries,
+		struct fat_dir_scan *scan)
+{
+	const struct fat_vol_handle *fat = dir->fat;
+	struct fat_name_match m;
+	struct fat_sdirent fatent;
+	uint32_t sec = 0, pos = 0, cluster = dir->first_cluster;
+	uint32_t run_pos = 0, run_cluster = 0;
+	uint16_t off = FAT_BPS(fat);
+	int run = 0, ret, n;
+
+	memset(scan, 0, sizeof(*scan));
+	fat_match_init(&m, name);
+	_fat_lseek(dir, 0, SEEK_SET);
+
+	for(;;) {
+		if(!dir->root_flag && (dir->cur_cluster >= fat_eoc(fat))) {
+			/* Directory is full, it must be extended */
+			pos = dir->position;
+			cluster = 0;
+			break;
+		}
+		if(off >= FAT_BPS(fat))
+			_fat_file_sector_offset(dir, &sec, &off);
+
+		pos = dir->position;
+		cluster = dir->cur_cluster;
+		ret = _fat_read(dir, &fatent, sizeof(fatent));
+		if(ret < 0)
+			return ret;
+		if(ret != sizeof(fatent)) {
+			/* End of FAT12/16 root directory */
+			pos = dir->position;
+			break;
+		}
+		off += sizeof(fatent);
+		scan->last_cluster = cluster;
+
+		if(fatent.name[0] == 0) 
+			break;	/* End of directory, everything after is free */
+
+		if(fatent.name[0] == (char)0xe5) {
+			if(!run++) {
+				run_pos = pos;
+				run_cluster = cluster;
+			}
+			if((run == entries) && !scan->free_cluster) {
+				scan->free_pos = run_pos;
+				scan->free_cluster = run_cluster;
+			}
+		} else {
+			run = 0;
+		}
+
+		ret = fat_match_entry(&m, &fatent);
+		if(ret > 0) {
+			scan->found = 1;
+			memcpy(&scan->fatent, &fatent, sizeof(fatent));
+			scan->sector = sec;
+			scan->offset = off - sizeof(fatent);
+			return 0;
+		}
+		if(ret || !ncand || (fatent.name[0] != cand[0][0]))
+			continue;
+		for(n = 0; n < ncand; n++)
+			if(!memcmp(fatent.name, cand[n], 11))
+				scan->taken |= 1 << n;
+	}
+
+	if(!scan->free_cluster) {
+		/* No gap big enough, use the end of the directory */
+		scan->free_pos = run ? run_pos : pos;
+		scan->free_cluster = run ? run_cluster : cluster;
+	}
+	return 0;
+}
+
+/* Initialise a file handle from its short directory entry */
+void _fat_dir_open_entry(struct fat_vol_handle *vol, 
+		const struct fat_sdirent *fatent, uint32_t sector, 
+		uint16_t offset, struct fat_file_handle *file)
+{
+	_fat_file_init(vol, fatent, file);
+	if(!(fatent->attr & FAT_ATTR_DIRECTORY)) {
+		file->dirent_sector = sector;
+		file->dirent_offset = offset;
+	} else if(!file->first_cluster) {
+		/* Check for special case of root dir */
+		_fat_file_root(vol, file);
+	}
 }
 
 int fat_open(struct fat_vol_handle *vol, const char *name, int flags,
 		struct fat_file_handle *file)
+{
+	int ret;
+	FAT_TRACE_START();
+
+	_fat_lock(vol->meta_lock);
+	ret = _fat_open(vol, name, flags, file);
+	_fat_unlock(vol->meta_lock);
+	FAT_TRACE(OPEN, vol, file, name, flags, 0, ret);
+
+	return ret;
+}
+
+int _fat_open(struct fat_vol_handle *vol, const char *name, int flags,
+		struct fat_file_handle *file)
 {
 	struct fat_file_handle *dir = (struct fat_file_handle*)&vol->cwd;
-	struct dirent dirent;
+	struct fat_dir_index *idx;
+	struct fat_sdirent fatent;
+	uint32_t sector;
+	uint16_t offset;
+	int ret = -1;
 
 	/* FIXME: Implement flags O_RDONLY, O_WRONLY, O_RDWR. */
 
 	if(strcmp(name, ".") == 0) {
 		/* Special case needed for root dir with no '.' entry */
 		memcpy(file, &vol->cwd, sizeof(*file));
+		_fat_lseek(file, 0, SEEK_SET);
 		return 0;
 	}
 
-	fat_lseek(dir, 0, SEEK_SET);
-	while(fat_readdir(dir, &dirent) == 0) {
-
-		/* Check for name match */
-		if((strcmp(name, dirent.d_name) == 0) ||
-		   fat_comparesfn(name, dirent.fat_sname)) {
-			/* reread on-disk directory entry */
-			struct fat_sdirent fatent;
-			uint32_t sector;
-			uint16_t offset;
-			/* Rewind directory one entry */
-			fat_lseek(dir, -sizeof(fatent), SEEK_CUR);
-			_fat_file_sector_offset(dir, &sector, &offset);
-			if(fat_read(dir, &fatent, sizeof(fatent)) != 32)
-				return -EIO;
-
-			_fat_file_init(dir->fat, &fatent, file);
-			file->flags = flags;
-			if(!(fatent.attr & FAT_ATTR_DIRECTORY)) {
-				file->dirent_sector = sector;
-				file->dirent_offset = offset;
-			} else if(!file->first_cluster) {
-				/* Check for special case of root dir */
-				_fat_file_root(dir->fat, file);
-			}
-			return 0;
-		}
+	idx = _fat_dir_index_get(dir);
+	if(idx)
+		ret = _fat_dir_index_lookup(idx, dir, name, 
+					&fatent, &sector, &offset);
+
+	if((ret == -1) && !(flags & O_CREAT)) {
+		/* No index, or index is incomplete, scan directory */
+		_fat_lseek(dir, 0, SEEK_SET);
+		ret = _fat_dir_lookup(dir, name, 0, &fatent, &sector, &offset);
+	}
+
+	if(ret >= 0) {
+		if((flags & O_CREAT) && (flags & O_EXCL))
+			return -EEXIST;
+		_fat_dir_open_entry(vol, &fatent, sector, offset, file);
+	} else if((flags & O_CREAT) && ((ret == -ENOENT) || (ret == -1))) {
+		/* Creating scans the directory for name anyway */
+		ret = _fat_dir_create_file(vol, name, FAT_ATTR_ARCHIVE, file);
+		if((ret == -EEXIST) && !(flags & O_EXCL))
+			ret = 0;
+		if(ret)
+			return ret;
+	} else {
+		return ret;
 	}
-	return -ENOENT;
+
+	file->flags = flags;
+	if((flags & O_TRUNC) && file->dirent_sector && 
+	   (file->size || file->first_cluster))
+		return _fat_file_truncate(file);
+
+	return 0;
 }
 
 int fat_chdir(struct fat_vol_handle *vol, const char *name)
 {
-	return fat_open(vol, name, 0, &vol->cwd);
+	int ret;
+	FAT_TRACE_START();
+
+	_fat_lock(vol->meta_lock);
+	ret = _fat_open(vol, name, 0, &vol->cwd);
+	_fat_unlock(vol->meta_lock);
+	FAT_TRACE(CHDIR, vol, NULL, name, 0, 0, ret);
+
+	return ret;
 }
 
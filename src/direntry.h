@@ -56,7 +56,42 @@ struct fat_ldirent {
 } __attribute__((packed));
 
 uint8_t _fat_dirent_chksum(uint8_t *dosname);
-int _fat_dir_seek_empty(struct fat_file_handle *dir, int entries);
+int _fat_canon_sname(const char *name, char *canonname);
+int _fat_dir_lookup(struct fat_file_handle *dir, const char *name, int count,
+		struct fat_sdirent *fatent, uint32_t *sector, uint16_t *offset);
+void _fat_dir_open_entry(struct fat_vol_handle *vol, 
+		const struct fat_sdirent *fatent, uint32_t sector, 
+		uint16_t offset, struct fat_file_handle *file);
+
+/* Result of scanning a directory before creating a file in it */
+struct fat_dir_scan {
+	/* Existing entry for the name, if found */
+	uint8_t found;
+	struct fat_sdirent fatent;
+	uint32_t sector;
+	uint16_t offset;
+	/* Where to put the new entries.  free_cluster is 0 if the
+	 * directory must be extended past last_cluster first. */
+	uint32_t free_pos;
+	uint32_t free_cluster;
+	uint32_t last_cluster;
+	/* Bitmap of candidate short names already in use */
+	uint16_t taken;
+};
+int _fat_dir_scan(struct fat_file_handle *dir, const char *name,
+		const uint8_t (*cand)[11], int ncand, int entries,
+		struct fat_dir_scan *scan);
+
+/* Directory name index, in dirindex.c */
+uint32_t _fat_name_hash(const char *name);
+struct fat_dir_index *_fat_dir_index_get(struct fat_file_handle *dir);
+int _fat_dir_index_lookup(struct fat_dir_index *idx, 
+		struct fat_file_handle *dir, const char *name, 
+		struct fat_sdirent *fatent, uint32_t *sector, uint16_t *offset);
+void _fat_dir_index_insert(struct fat_file_handle *dir, const char *name,
+		const uint8_t *sname, uint32_t pos, uint32_t cluster);
+void _fat_dir_index_remove(struct fat_file_handle *dir, const char *name);
+void _fat_dir_index_drop(struct fat_vol_handle *vol, uint32_t cluster);
 
 #endif
 
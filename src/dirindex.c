@@ -0,0 +1,327 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* FAT Directory name index.
+ * Maps hashes of the names in a directory to the position of their
+ * entries, so lookups don't have to scan the whole directory.  Entries
+ * are chained in buckets by the hash of their long and short names, with
+ * as many buckets as the index has entries.  Hash matches are always
+ * confirmed by reading the directory entry.
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "openfat.h"
+
+#include "fat_core.h"
+#include "direntry.h"
+
+#define FNV_OFFSET_BASIS	2166136261u
+#define FNV_PRIME		16777619u
+
+/* Hash of case-folded name, up to end of string or path separator */
+uint32_t _fat_name_hash(const char *name)
+{
+	uint32_t hash = FNV_OFFSET_BASIS;
+
+	while(*name && (*name != '/')) {
+		hash ^= (uint8_t)tolower(*name++);
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+/* Hash of DOS 8.3 name */
+static uint32_t hash_sname(const char *sname)
+{
+	uint32_t hash = FNV_OFFSET_BASIS;
+
+	for(int i = 0; i < 11; i++) {
+		hash ^= (uint8_t)sname[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+/* End of a bucket chain */
+#define DIR_INDEX_NONE		0xFFFF
+
+static struct fat_dir_index *
+dir_index_find(struct fat_file_handle *dir)
+{
+	struct fat_dir_index *idx;
+	uint32_t key = fat_dir_key(dir);
+
+	for(idx = dir->fat->dir_index; idx; idx = idx->next)
+		if(idx->valid && (idx->dir == key))
+			return idx;
+
+	return NULL;
+}
+
+/* Chains are walked by long name hash, or by short name hash if s is set */
+static uint16_t *dir_index_head(struct fat_dir_index *idx, int s,
+		uint32_t hash)
+{
+	struct fat_dir_index_entry *b = &idx->ent[hash % idx->size];
+
+	return s ? &b->shead : &b->head;
+}
+
+static uint16_t *dir_index_next(struct fat_dir_index_entry *e, int s)
+{
+	return s ? &e->snext : &e->next;
+}
+
+/* Find the link in its bucket that refers to entry i */
+static uint16_t *dir_index_link(struct fat_dir_index *idx, int s, uint16_t i)
+{
+	struct fat_dir_index_entry *e = &idx->ent[i];
+	uint16_t *link = dir_index_head(idx, s, s ? e->shash : e->hash);
+
+	while(*link != i)
+		link = dir_index_next(&idx->ent[*link], s);
+	return link;
+}
+
+static void dir_index_add_entry(struct fat_dir_index *idx, const char *name,
+		const char *sname, uint32_t pos, uint32_t cluster)
+{
+	struct fat_dir_index_entry *e;
+	uint16_t *head;
+
+	if(idx->count == idx->size) {
+		/* Out of space, lookups must fall back to scanning */
+		idx->complete = 0;
+		return;
+	}
+
+	e = &idx->ent[idx->count];
+	e->hash = _fat_name_hash(name);
+	e->shash = hash_sname(sname);
+	e->pos = pos;
+	e->cluster = cluster;
+
+	head = dir_index_head(idx, 0, e->hash);
+	e->next = *head;
+	*head = idx->count;
+	head = dir_index_head(idx, 1, e->shash);
+	e->snext = *head;
+	*head = idx->count++;
+}
+
+/* Take entry i out of its buckets, and move the last entry into its
+ * place. */
+static void dir_index_remove_entry(struct fat_dir_index *idx, uint16_t i)
+{
+	struct fat_dir_index_entry *e = &idx->ent[i];
+	struct fat_dir_index_entry *last;
+
+	*dir_index_link(idx, 0, i) = e->next;
+	*dir_index_link(idx, 1, i) = e->snext;
+
+	if(i == --idx->count)
+		return;
+
+	last = &idx->ent[idx->count];
+	*dir_index_link(idx, 0, idx->count) = i;
+	*dir_index_link(idx, 1, idx->count) = i;
+	/* Bucket heads stay with the slot */
+	e->hash = last->hash;
+	e->shash = last->shash;
+	e->pos = last->pos;
+	e->cluster = last->cluster;
+	e->next = last->next;
+	e->snext = last->snext;
+}
+
+static void dir_index_build(struct fat_dir_index *idx,
+		struct fat_file_handle *dir)
+{
+	struct dirent ent;
+
+	idx->dir = fat_dir_key(dir);
+	idx->count = 0;
+	idx->valid = 1;
+	idx->complete = 1;
+	for(int i = 0; i < idx->size; i++) {
+		idx->ent[i].head = DIR_INDEX_NONE;
+		idx->ent[i].shead = DIR_INDEX_NONE;
+	}
+
+	_fat_lseek(dir, 0, SEEK_SET);
+	for(;;) {
+		struct fat_sdirent fatent;
+		uint32_t pos = dir->position;
+		uint32_t cluster = dir->cur_cluster;
+
+		/* Skip deleted entries, so the position recorded is that of
+		 * the first entry read for the name.  A file created in the
+		 * free entries would otherwise sit between the two. */
+		if(!dir->root_flag && (cluster >= fat_eoc(dir->fat)))
+			break;
+		if(_fat_read(dir, &fatent, sizeof(fatent)) != sizeof(fatent))
+			break;
+		if((fatent.name[0] == (char)0xe5) ||
+		   (fatent.attr == FAT_ATTR_VOLUME_ID))
+			continue;
+		dir->position = pos;
+		dir->cur_cluster = cluster;
+
+		if(_fat_readdir(dir, &ent))
+			break;
+		dir_index_add_entry(idx, ent.d_name, ent.fat_sname,
+				pos, cluster);
+	}
+}
+
+static void dir_index_seek(struct fat_file_handle *dir,
+		const struct fat_dir_index_entry *e)
+{
+	if(!e->cluster) {
+		_fat_lseek(dir, e->pos, SEEK_SET);
+		return;
+	}
+	dir->position = e->pos;
+	dir->cur_cluster = e->cluster;
+}
+
+void fat_dir_index_add(struct fat_vol_handle *vol, struct fat_dir_index *idx,
+		struct fat_dir_index_entry *ent, uint16_t size)
+{
+	memset(idx, 0, sizeof(*idx));
+	idx->ent = ent;
+	idx->size = size;
+	idx->next = vol->dir_index;
+	vol->dir_index = idx;
+}
+
+/* Return the index for a directory, building it if the directory isn't
+ * indexed yet.  Returns NULL if the volume has no indexes. */
+struct fat_dir_index *_fat_dir_index_get(struct fat_file_handle *dir)
+{
+	struct fat_vol_handle *vol = dir->fat;
+	struct fat_dir_index *idx, *lru = NULL;
+
+	if(!vol->dir_index)
+		return NULL;
+
+	idx = dir_index_find(dir);
+	if(!idx) {
+		/* Reuse an unused or the least recently used index */
+		for(idx = vol->dir_index; idx; idx = idx->next)
+			if(!lru || (lru->valid &&
+			   (!idx->valid || (idx->stamp < lru->stamp))))
+				lru = idx;
+		idx = lru;
+		dir_index_build(idx, dir);
+	}
+	idx->stamp = ++vol->dir_index_stamp;
+
+	return idx;
+}
+
+/* Look up name in a directory index.  On success returns the index entry
+ * number, with the short directory entry copied to fatent and its location
+ * stored in sector and offset.  Returns -ENOENT if the name is not in the
+ * directory, or -1 if the index is incomplete or stale and the directory
+ * must be scanned. */
+int _fat_dir_index_lookup(struct fat_dir_index *idx,
+		struct fat_file_handle *dir, const char *name,
+		struct fat_sdirent *fatent, uint32_t *sector, uint16_t *offset)
+{
+	char canonname[11];
+	int sname_ok = _fat_canon_sname(name, canonname);
+	uint32_t hash[2];
+	int missed = 0;
+
+	hash[0] = _fat_name_hash(name);
+	hash[1] = hash_sname(canonname);
+
+	/* Look for the long name, then for the name as a short name */
+	for(int s = 0; idx->size && (s < 1 + sname_ok); s++) {
+		uint16_t i = *dir_index_head(idx, s, hash[s]);
+		while(i != DIR_INDEX_NONE) {
+			struct fat_dir_index_entry *e = &idx->ent[i];
+			if((s ? e->shash : e->hash) == hash[s]) {
+				dir_index_seek(dir, e);
+				if(_fat_dir_lookup(dir, name, 1, fatent,
+						sector, offset) == 0)
+					return i;
+				missed = 1;
+			}
+			i = *dir_index_next(e, s);
+		}
+	}
+
+	if(missed) {
+		/* The index is stale, or the hash collided.  Rebuild it and
+		 * have the caller scan the directory to be sure. */
+		dir_index_build(idx, dir);
+		return -1;
+	}
+
+	return idx->complete ? -ENOENT : -1;
+}
+
+/* Add a new entry to a directory's index, if it has one. */
+void _fat_dir_index_insert(struct fat_file_handle *dir, const char *name,
+		const uint8_t *sname, uint32_t pos, uint32_t cluster)
+{
+	struct fat_dir_index *idx = dir_index_find(dir);
+
+	if(idx)
+		dir_index_add_entry(idx, name, (const char *)sname,
+				pos, cluster);
+}
+
+/* Remove an entry from a directory's index, if it has one. */
+void _fat_dir_index_remove(struct fat_file_handle *dir, const char *name)
+{
+	struct fat_dir_index *idx = dir_index_find(dir);
+	struct fat_sdirent fatent;
+	uint32_t sector;
+	uint16_t offset;
+	int i;
+
+	if(!idx)
+		return;
+
+	i = _fat_dir_index_lookup(idx, dir, name, &fatent, &sector, &offset);
+	if(i < 0)
+		return;
+
+	dir_index_remove_entry(idx, i);
+}
+
+/* Forget any index for the directory starting at cluster.  Used when a
+ * directory's clusters are reused or its entries are moved. */
+void _fat_dir_index_drop(struct fat_vol_handle *vol, uint32_t cluster)
+{
+	struct fat_dir_index *idx;
+
+	for(idx = vol->dir_index; idx; idx = idx->next)
+		if(idx->dir == cluster)
+			idx->valid = 0;
+}
+
@@ -33,19 +33,152 @@
 #include "bpb.h"
 #include "fat_core.h"
 
-/* Build time configuration */
+/* Build time configuration, see also fat_core.h */
+#ifdef OPENFAT_SECTOR_SIZE
+#define MAX_SECTOR_SIZE OPENFAT_SECTOR_SIZE
+#else
 #define MAX_SECTOR_SIZE 512
+#endif
 
 uint8_t _fat_sector_buf[MAX_SECTOR_SIZE];
 struct _fat_cache _fat_cache;
+const struct fat_lock_ops *_fat_lock_ops;
+
+void fat_lock_init(const struct fat_lock_ops *ops, void *cache_lock)
+{
+	_fat_lock_ops = ops;
+	_fat_cache.lock = ops ? cache_lock : NULL;
+}
+
+void fat_vol_set_locks(struct fat_vol_handle *vol, void *meta_lock, 
+			void *alloc_lock)
+{
+	vol->meta_lock = _fat_lock_ops ? meta_lock : NULL;
+	vol->alloc_lock = _fat_lock_ops ? alloc_lock : NULL;
+}
+
+void fat_file_set_lock(struct fat_file_handle *file, void *lock)
+{
+	file->lock = _fat_lock_ops ? lock : NULL;
+}
+
+void fat_file_set_buffer(struct fat_file_handle *file, void *buf)
+{
+	file->buf = buf;
+	file->buf_sector = 0;
+}
+
+/* log2 of n, or -1 if n is not a power of two */
+static int fat_log2(uint32_t n)
+{
+	int i;
+
+	if(!n || (n & (n - 1)))
+		return -1;
+	for(i = 0; n > 1; i++)
+		n >>= 1;
+	return i;
+}
+
+/* Check a volume can be used with the build time configuration */
+static int fat_vol_supported(const struct fat_vol_handle *h)
+{
+	if(h->bytes_per_sector > MAX_SECTOR_SIZE)
+		return 0;
+#ifdef OPENFAT_FAT_TYPE
+	if(h->type != OPENFAT_FAT_TYPE)
+		return 0;
+#endif
+#ifdef OPENFAT_SECTOR_SIZE
+	if(h->bytes_per_sector != OPENFAT_SECTOR_SIZE)
+		return 0;
+#endif
+#ifdef OPENFAT_CLUSTER_SECTORS
+	if(h->sectors_per_cluster != OPENFAT_CLUSTER_SECTORS)
+		return 0;
+#endif
+	return 1;
+}
+
+/* Read the flags in FAT[1].  Only if the volume was unmounted cleanly
+ * are the FAT32 free cluster count and next free hint trusted, which
+ * saves scanning the FAT for them. */
+static int fat_vol_read_state(struct fat_vol_handle *h)
+{
+	const struct fat_fsinfo *fsi;
+	const uint8_t *p;
+	uint32_t flags;
+
+	h->free_count = FSINFO_UNKNOWN;
+
+	switch(FAT_TYPE(h)) {
+	case FAT_TYPE_FAT16:
+		flags = _fat_get_next_cluster(h, 1);
+		if(!(flags & FAT16_CLN_SHUT))
+			h->state |= FAT_VOL_DIRTY;
+		if(!(flags & FAT16_HRD_ERR))
+			h->state |= FAT_VOL_HARD_ERROR;
+		break;
+	case FAT_TYPE_FAT32:
+		flags = _fat_get_next_cluster(h, 1);
+		if(!(flags & FAT32_CLN_SHUT))
+			h->state |= FAT_VOL_DIRTY;
+		if(!(flags & FAT32_HRD_ERR))
+			h->state |= FAT_VOL_HARD_ERROR;
+		break;
+	default: /* FAT12 has no flags */
+		h->state |= FAT_VOL_DIRTY;
+		break;
+	}
+
+	/* Already dirty, so there is no need to mark it */
+	if(h->state & FAT_VOL_DIRTY) {
+		h->written = 1;
+		return 0;
+	}
+	if(!h->fsinfo_sector)
+		return 0;
+
+	FAT_CACHE_LOCK();
+	FAT_MAP_SECTOR(h, h->fsinfo_sector, p);
+	fsi = (const void *)p;
+	if((__get_le32(&fsi->lead_sig) == FSINFO_LEAD_SIG) &&
+	   (__get_le32(&fsi->struc_sig) == FSINFO_STRUC_SIG) &&
+	   (__get_le32(&fsi->trail_sig) == FSINFO_TRAIL_SIG)) {
+		uint32_t count = __get_le32(&fsi->free_count);
+		uint32_t next = __get_le32(&fsi->nxt_free);
+		if(count <= h->cluster_count)
+			h->free_count = count;
+		if((next >= 2) && (next < h->cluster_count + 2))
+			h->last_cluster_alloc = next;
+	}
+	FAT_CACHE_UNLOCK();
+
+	return 0;
+}
 
 int fat_vol_init(const struct block_device *dev, struct fat_vol_handle *h) 
+{
+	return fat_vol_mount(dev, h, 0);
+}
+
+static int fat_vol_load(const struct block_device *dev, 
+		struct fat_vol_handle *h, int flags)
 {
 	struct bpb_common *bpb = (void *)&_fat_sector_buf;
 
+	/* The boot sector is read into the sector buffer */
+	if(block_get_sector_size(dev) > MAX_SECTOR_SIZE)
+		return -EINVAL;
+
 	memset(h, 0, sizeof(*h));
 	h->dev = dev;
+	h->state = flags & FAT_VOL_RDONLY;
+#ifdef OPENFAT_READ_ONLY
+	h->state |= FAT_VOL_RDONLY;
+#endif
 	
+	FAT_CACHE_LOCK();
 	FAT_GET_SECTOR(h, 0);
 
 	h->type = fat_type(bpb);
@@ -57,57 +190,128 @@ int fat_vol_init(const struct block_device *dev, struct fat_vol_handle *h)
 	h->num_fats = bpb->num_fats;
 	h->fat_size = _bpb_fat_size(bpb);
 	h->last_cluster_alloc = 2;
+	if((fat_log2(h->bytes_per_sector) > 0) && 
+	   (fat_log2(h->sectors_per_cluster) >= 0)) {
+		h->sector_shift = fat_log2(h->bytes_per_sector);
+		h->cluster_shift = fat_log2(h->sectors_per_cluster);
+	}
 	if(h->type == FAT_TYPE_FAT32) {
 		struct bpb_fat32 *bpb32 = (void *)&_fat_sector_buf;
 		h->fat32.root_cluster = __get_le32(&bpb32->root_cluster);
+		h->fsinfo_sector = __get_le16(&bpb32->fs_info);
+		if(h->fsinfo_sector >= h->reserved_sector_count)
+			h->fsinfo_sector = 0;
 	} else {
 		h->fat12_16.root_sector_count = _bpb_root_dir_sectors(bpb);
 		h->fat12_16.root_first_sector = _bpb_first_data_sector(bpb) - 
 					h->fat12_16.root_sector_count;
 	}
+	FAT_CACHE_UNLOCK();
+
+	if(!fat_vol_supported(h))
+		return -EINVAL;
+
 	_fat_file_root(h, &h->cwd);
 
-	return 0;
+	return fat_vol_read_state(h);
+}
+
+int fat_vol_mount(const struct block_device *dev, struct fat_vol_handle *h,
+		int flags)
+{
+	int ret;
+	FAT_TRACE_START();
+
+	ret = fat_vol_load(dev, h, flags);
+	FAT_TRACE(MOUNT, h, NULL, NULL, flags, 0, ret);
+	return ret;
+}
+
+int fat_vol_state(const struct fat_vol_handle *vol)
+{
+	return vol->state;
+}
+
+uint32_t fat_vol_free_clusters(struct fat_vol_handle *vol)
+{
+	uint32_t count;
+
+	_fat_lock(vol->alloc_lock);
+	if(vol->free_count == FSINFO_UNKNOWN) {
+		count = 0;
+		for(uint32_t i = 2; i < vol->cluster_count + 2; i++)
+			if(_fat_get_next_cluster(vol, i) == 0)
+				count++;
+		vol->free_count = count;
+	}
+	count = vol->free_count;
+	_fat_unlock(vol->alloc_lock);
+
+	return count;
+}
+
+/* Decode a FAT entry that is all in one sector */
+static inline uint32_t fat_decode_entry(const struct fat_vol_handle *h,
+		uint32_t cluster, const uint8_t *p)
+{
+	uint32_t next = 0;
+
+	if(FAT_TYPE(h) == FAT_TYPE_FAT12) {
+		next = __get_le16((const uint16_t*)p);
+		if(cluster & 1) 
+			next >>= 4;
+		else
+			next &= 0xFFF;
+	} else if(FAT_TYPE(h) == FAT_TYPE_FAT16) {
+		next = __get_le16((const uint16_t*)p);
+	} else if(FAT_TYPE(h) == FAT_TYPE_FAT32) {
+		next = __get_le32((const uint32_t*)p) & 0x0FFFFFFF;
+	}
+	return next;
 }
 
 uint32_t _fat_get_next_cluster(const struct fat_vol_handle *h, uint32_t cluster)
 {
 	uint32_t offset;
 	uint32_t sector;
+	uint32_t next = 0;
+	const uint8_t *p;
 
-	if(h->type == FAT_TYPE_FAT12)
+	if(FAT_TYPE(h) == FAT_TYPE_FAT12)
 		offset = cluster + (cluster / 2);
-	else if(h->type == FAT_TYPE_FAT16)
+	else if(FAT_TYPE(h) == FAT_TYPE_FAT16)
 		offset = cluster * 2;
-	else if(h->type == FAT_TYPE_FAT32)
+	else if(FAT_TYPE(h) == FAT_TYPE_FAT32)
 		offset = cluster * 4;
 
-	sector = h->reserved_sector_count + (offset / h->bytes_per_sector);
-	offset %= h->bytes_per_sector;
+	sector = h->reserved_sector_count + fat_bytes_to_sectors(h, offset);
+	offset = fat_sector_offset(h, offset);
 
-	FAT_GET_SECTOR(h, sector);
+	/* Only FAT12 entries can be over a sector boundary */
+	if(offset != (uint32_t)FAT_BPS(h) - 1) {
+		p = _fat_sector_ptr_unlocked(h, sector);
+		if(p)
+			return fat_decode_entry(h, cluster, p + offset);
+	}
 
-	if(h->type == FAT_TYPE_FAT12) {
-		uint32_t next;
-		if(offset == (uint32_t)h->bytes_per_sector - 1) {
-			/* Fat entry is over sector boundary */
-			next = _fat_sector_buf[offset];
-			FAT_GET_SECTOR(h, sector + 1);
-			next += _fat_sector_buf[0] << 8;
-		} else {
-			next = __get_le16((uint16_t*)(_fat_sector_buf + offset));
-		}
+	FAT_CACHE_LOCK();
+	FAT_MAP_SECTOR(h, sector, p);
+
+	if(offset == (uint32_t)FAT_BPS(h) - 1) {
+		/* Fat entry is over sector boundary */
+		next = p[offset];
+		FAT_MAP_SECTOR(h, sector + 1, p);
+		next += p[0] << 8;
 		if(cluster & 1) 
-			return next >> 4;
+			next >>= 4;
 		else
-			return next & 0xFFF;
-	} else if(h->type == FAT_TYPE_FAT16) {
-		return __get_le16((uint16_t*)(_fat_sector_buf + offset));
-	} else if(h->type == FAT_TYPE_FAT32) {
-		return __get_le32((uint32_t*)(_fat_sector_buf + offset)) & 0x0FFFFFFF;
+			next &= 0xFFF;
+	} else {
+		next = fat_decode_entry(h, cluster, p + offset);
 	}
-	/* We shouldn't get here... */
-	return 0;
+	FAT_CACHE_UNLOCK();
+
+	return next;
 }
 
 void _fat_file_root(struct fat_vol_handle *fat, 
@@ -116,13 +320,13 @@ void _fat_file_root(struct fat_vol_handle *fat,
 	memset(h, 0, sizeof(*h));
 	h->fat = fat;
 
-	if(fat->type == FAT_TYPE_FAT32) {
+	if(FAT_TYPE(fat) == FAT_TYPE_FAT32) {
 		h->first_cluster = fat->fat32.root_cluster;
 	} else {
 		/* FAT12/FAT16 root directory */
 		h->root_flag = 1;
 		h->first_cluster = fat->fat12_16.root_first_sector;
-		h->size = h->fat->fat12_16.root_sector_count * h->fat->bytes_per_sector;
+		h->size = h->fat->fat12_16.root_sector_count * FAT_BPS(h->fat);
 	}
 	h->cur_cluster = h->first_cluster;
 }
@@ -137,9 +341,26 @@ void _fat_file_init(struct fat_vol_handle *fat,
 			__get_le16(&dirent->cluster_lo);
 	h->size = __get_le32(&dirent->size);
 	h->cur_cluster = h->first_cluster;
+	h->synced_size = h->size;
+	if(fat->sync_policy.clock)
+		h->synced_time = fat->sync_policy.clock();
 }
 
 off_t fat_lseek(struct fat_file_handle *h, off_t offset, int whence)
+{
+	off_t ret;
+	FAT_TRACE_START();
+
+	_fat_lock(h->lock);
+	ret = _fat_lseek(h, offset, whence);
+	_fat_unlock(h->lock);
+	FAT_TRACE(LSEEK, h->fat, h, NULL, (int32_t)offset,
+			whence | ((offset < 0) ? FAT_TRACE_SEEK_ARG_NEG : 0) |
+			((ret < 0) ? FAT_TRACE_SEEK_RET_NEG : 0), (int32_t)ret);
+	return ret;
+}
+
+off_t _fat_lseek(struct fat_file_handle *h, off_t offset, int whence)
 {
 	h->cur_cluster = h->first_cluster;
 
@@ -165,11 +386,15 @@ off_t fat_lseek(struct fat_file_handle *h, off_t offset, int whence)
 		return h->position;
 	}
 
+	if(h->tail_sector && (h->position == h->size)) {
+		/* End of file is known, no need to walk the chain */
+		h->cur_cluster = h->tail_cluster;
+		return h->position;
+	}
+
 	/* Iterate over cluster chain to find cluster */
-	while(offset >= (h->fat->sectors_per_cluster * h->fat->bytes_per_sector)) {
+	for(uint32_t n = fat_bytes_to_clusters(h->fat, offset); n; n--)
 		h->cur_cluster = _fat_get_next_cluster(h->fat, h->cur_cluster);
-		offset -= h->fat->sectors_per_cluster * h->fat->bytes_per_sector;
-	}
 
 	return h->position;
 }
@@ -177,22 +402,95 @@ off_t fat_lseek(struct fat_file_handle *h, off_t offset, int whence)
 void _fat_file_sector_offset(struct fat_file_handle *h, uint32_t *sector,
 			uint16_t *offset)
 {
+	uint32_t n = fat_bytes_to_sectors(h->fat, h->position);
+
 	if(h->root_flag) {
 		/* FAT12/FAT16 root directory */
-		*sector = h->cur_cluster +
-				(h->position / h->fat->bytes_per_sector);
+		*sector = h->cur_cluster + n;
 	} else {
 		*sector = fat_first_sector_of_cluster(h->fat, h->cur_cluster);
-		*sector += (h->position / h->fat->bytes_per_sector) % 
-					h->fat->sectors_per_cluster;
+		*sector += fat_cluster_sector(h->fat, n);
 	}
-	*offset = h->position % h->fat->bytes_per_sector;
+	*offset = fat_sector_offset(h->fat, h->position);
 }
 
 #define MIN(x, y) (((x) < (y))?(x):(y))
 int fat_read(struct fat_file_handle *h, void *buf, int size)
 {
-	int i;
+	int ret;
+	FAT_TRACE_START();
+
+	_fat_lock(h->lock);
+	ret = _fat_read(h, buf, size);
+	_fat_unlock(h->lock);
+	FAT_TRACE(READ, h->fat, h, NULL, size, 0, ret);
+	return ret;
+}
+
+/* Read whole sectors straight into buf, bypassing the sector buffer.
+ * A dirty copy in the buffer is written back first, which can't exist 
+ * on a read only volume. */
+static int fat_read_direct(struct fat_vol_handle *fat, uint32_t sector,
+		uint32_t count, void *buf)
+{
+	if(!FAT_RDONLY(fat)) {
+		FAT_CACHE_LOCK();
+		if((_fat_cache.bldev == fat->dev) && 
+		   (_fat_cache.sector >= sector) &&
+		   (_fat_cache.sector < sector + count))
+			FAT_FLUSH_SECTOR();
+		FAT_CACHE_UNLOCK();
+	}
+
+	if(fat_block_read(fat->dev, sector, count, buf) != (int)count)
+		return -EIO;
+	return 0;
+}
+
+/* Read part of a sector, in place if the block device allows.  Files
+ * with their own buffer only use the shared sector buffer if it already
+ * holds the sector. */
+static int fat_read_partial(struct fat_file_handle *h, uint32_t sector,
+		uint16_t offset, void *buf, uint16_t len)
+{
+	struct fat_vol_handle *fat = h->fat;
+	const uint8_t *p;
+	uint32_t gen;
+
+	p = _fat_sector_ptr_unlocked(fat, sector);
+	if(p) {
+		memcpy(buf, p + offset, len);
+		return 0;
+	}
+
+	FAT_CACHE_LOCK();
+	p = _fat_sector_ptr(fat, sector);
+	if(p || !h->buf || ((_fat_cache.bldev == fat->dev) && 
+			    (_fat_cache.sector == sector))) {
+		FAT_MAP_SECTOR(fat, sector, p);
+		memcpy(buf, p + offset, len);
+		FAT_CACHE_UNLOCK();
+		return 0;
+	}
+	gen = _fat_cache.gen;
+	FAT_CACHE_UNLOCK();
+
+	if((h->buf_sector != sector) || (h->buf_gen != gen)) {
+		h->buf_sector = 0;
+		if(fat_block_read(fat->dev, sector, 1, h->buf) != 1)
+			return -EIO;
+		h->buf_sector = sector;
+		h->buf_gen = gen;
+	}
+	memcpy(buf, h->buf + offset, len);
+	return 0;
+}
+
+int _fat_read(struct fat_file_handle *h, void *buf, int size)
+{
+	struct fat_vol_handle *fat = h->fat;
+	uint16_t bps = FAT_BPS(fat);
+	int i, ret;
 	uint32_t sector;
 	uint16_t offset;
 
@@ -203,29 +501,38 @@ int fat_read(struct fat_file_handle *h, void *buf, int size)
 		size = h->size - h->position;
 
 	for(i = 0; i < size; ) {
-		uint16_t chunk = MIN(h->fat->bytes_per_sector - offset, size - i);
-		FAT_GET_SECTOR(h->fat, sector);
-		memcpy(buf + i, _fat_sector_buf + offset, chunk);
+		uint32_t count = fat_bytes_to_sectors(fat, size - i);
+		uint32_t chunk;
+		if(!offset && count) {
+			/* Whole sectors, up to the end of the cluster */
+			if(!h->root_flag)
+				count = MIN(count, FAT_SPC(fat) - 
+					fat_cluster_sector(fat, 
+					fat_bytes_to_sectors(fat, h->position)));
+			chunk = count * bps;
+			ret = fat_read_direct(fat, sector, count, buf + i);
+		} else {
+			chunk = MIN(bps - offset, size - i);
+			ret = fat_read_partial(h, sector, offset, 
+					buf + i, chunk);
+		}
+		if(ret)
+			return ret;
 		h->position += chunk;
 		i += chunk;
-		if((h->position % h->fat->bytes_per_sector) != 0) 
+		if(fat_sector_offset(fat, h->position) != 0) 
 			/* we didn't read until the end of the sector... */
 			break;
-		offset = 0;
-		sector++;
-		if(h->root_flag) /* FAT12/16 isn't a cluster chain */
-			continue;
-		if((sector % h->fat->sectors_per_cluster) == 0) {
+		if(!h->root_flag && 
+		   (fat_cluster_offset(fat, h->position) == 0)) {
 			/* Go to next cluster... */
-			h->cur_cluster = _fat_get_next_cluster(h->fat, 
+			h->cur_cluster = _fat_get_next_cluster(fat, 
 						h->cur_cluster);
-			if(h->cur_cluster == fat_eoc(h->fat)) 
+			if(h->cur_cluster == fat_eoc(fat)) 
 				return i;
-			sector = fat_first_sector_of_cluster(h->fat, 
-						h->cur_cluster);
 		}
+		_fat_file_sector_offset(h, &sector, &offset);
 	}
 
 	return i;
 }
-
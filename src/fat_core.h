@@ -23,9 +23,95 @@
 #ifndef __FAT_CORE_H
 #define __FAT_CORE_H
 
+#include "openfat/trace.h"
+
 #include "bpb.h"
 #include "direntry.h"
 
+/* Build time specialisation.  Any of these may be defined, normally
+ * through the variables in src/Makefile, to fix a property of every
+ * volume so that code for the other cases compiles away.  fat_vol_init()
+ * refuses volumes that don't match.
+ *   OPENFAT_FAT_TYPE		12, 16 or 32
+ *   OPENFAT_SECTOR_SIZE	Bytes per sector, a power of two
+ *   OPENFAT_CLUSTER_SECTORS	Sectors per cluster, a power of two
+ *   OPENFAT_BLOCK_READ		Functions called directly instead of the
+ *   OPENFAT_BLOCK_WRITE	block device's read and write methods
+ *   OPENFAT_BLOCK_SECTOR_PTR	Same for get_sector_ptr, in place reads
+ *				are disabled if the others are bound 
+ *				without this
+ *   OPENFAT_READ_ONLY		Every volume is mounted read only, and 
+ *				the sector buffer is never written back
+ */
+#ifdef OPENFAT_FAT_TYPE
+# define FAT_TYPE(fat)		((void)(fat), OPENFAT_FAT_TYPE)
+#else
+# define FAT_TYPE(fat)		((fat)->type)
+#endif
+
+#ifdef OPENFAT_SECTOR_SIZE
+# if OPENFAT_SECTOR_SIZE & (OPENFAT_SECTOR_SIZE - 1)
+#  error "OPENFAT_SECTOR_SIZE must be a power of two"
+# endif
+# define FAT_BPS(fat)		((void)(fat), (uint16_t)OPENFAT_SECTOR_SIZE)
+# define FAT_SECTOR_SHIFT(fat)	\
+		((void)(fat), __builtin_ctz(OPENFAT_SECTOR_SIZE))
+#else
+# define FAT_BPS(fat)		((fat)->bytes_per_sector)
+# define FAT_SECTOR_SHIFT(fat)	((fat)->sector_shift)
+#endif
+
+#ifdef OPENFAT_CLUSTER_SECTORS
+# if OPENFAT_CLUSTER_SECTORS & (OPENFAT_CLUSTER_SECTORS - 1)
+#  error "OPENFAT_CLUSTER_SECTORS must be a power of two"
+# endif
+# define FAT_SPC(fat)		((void)(fat), (uint8_t)OPENFAT_CLUSTER_SECTORS)
+# define FAT_CLUSTER_SHIFT(fat)	\
+		((void)(fat), __builtin_ctz(OPENFAT_CLUSTER_SECTORS))
+#else
+# define FAT_SPC(fat)		((fat)->sectors_per_cluster)
+# define FAT_CLUSTER_SHIFT(fat)	((fat)->cluster_shift)
+#endif
+
+/* Non-zero if geometry can use shifts and masks */
+#if defined(OPENFAT_SECTOR_SIZE) && defined(OPENFAT_CLUSTER_SECTORS)
+# define FAT_POW2(fat)		((void)(fat), 1)
+#else
+# define FAT_POW2(fat)		((fat)->sector_shift != 0)
+#endif
+
+#ifdef OPENFAT_READ_ONLY
+# define FAT_RDONLY(fat)	((void)(fat), 1)
+#else
+# define FAT_RDONLY(fat)	((fat)->state & FAT_VOL_RDONLY)
+#endif
+
+#ifdef OPENFAT_BLOCK_READ
+int OPENFAT_BLOCK_READ(const struct block_device *dev, 
+		uint32_t sector, uint32_t count, void *buf);
+# define fat_block_read		OPENFAT_BLOCK_READ
+#else
+# define fat_block_read		block_read_sectors
+#endif
+
+#ifdef OPENFAT_BLOCK_WRITE
+int OPENFAT_BLOCK_WRITE(const struct block_device *dev, 
+		uint32_t sector, uint32_t count, const void *buf);
+# define fat_block_write	OPENFAT_BLOCK_WRITE
+#else
+# define fat_block_write	block_write_sectors
+#endif
+
+#if defined(OPENFAT_BLOCK_SECTOR_PTR)
+const void *OPENFAT_BLOCK_SECTOR_PTR(const struct block_device *dev, 
+		uint32_t sector);
+# define fat_block_sector_ptr	OPENFAT_BLOCK_SECTOR_PTR
+#elif defined(OPENFAT_BLOCK_READ) || defined(OPENFAT_BLOCK_WRITE)
+# define fat_block_sector_ptr(dev, sector)	((void)(dev), (void)(sector), NULL)
+#else
+# define fat_block_sector_ptr	block_get_sector_ptr
+#endif
+
 extern uint8_t _fat_sector_buf[];
 
 extern struct _fat_cache {
@@ -38,12 +124,57 @@ extern struct _fat_cache {
 
 	/* Non-zero if buffer is out-of-sync with the physical medium. */
 	uint8_t dirty;
+
+	/* Incremented whenever a sector is changed, so copies of sectors
+	 * outside buf can tell if they may be stale. */
+	uint32_t gen;
+
+	/* Application lock guarding the buffer, NULL if not locking. */
+	void *lock;
 } _fat_cache;
 
+extern const struct fat_lock_ops *_fat_lock_ops;
+
+static inline void _fat_lock(void *lock)
+{
+	if(lock)
+		_fat_lock_ops->lock(lock);
+}
+
+static inline void _fat_unlock(void *lock)
+{
+	if(lock)
+		_fat_lock_ops->unlock(lock);
+}
+
+/* The sector buffer macros below must only be used between
+ * FAT_CACHE_LOCK() and FAT_CACHE_UNLOCK().  On error they release the
+ * lock before returning. */
+#define FAT_CACHE_LOCK()	_fat_lock(_fat_cache.lock)
+#define FAT_CACHE_UNLOCK()	_fat_unlock(_fat_cache.lock)
+
+/* Recording of public calls, see openfat/trace.h.  FAT_TRACE_START()
+ * follows the declarations of a public function and FAT_TRACE() comes
+ * just before it returns.  Both compile away unless OPENFAT_TRACE is
+ * defined. */
+#ifdef OPENFAT_TRACE
+uint32_t _fat_trace_clock(void);
+void _fat_trace(uint8_t op, const void *vol, const void *file, 
+		const char *name, int32_t arg, uint8_t aux, int32_t ret, 
+		uint32_t start);
+# define FAT_TRACE_START()	uint32_t _trace_start = _fat_trace_clock()
+# define FAT_TRACE(op, vol, file, name, arg, aux, ret) \
+		_fat_trace(FAT_TRACE_##op, vol, file, name, arg, aux, ret, \
+				_trace_start)
+#else
+# define FAT_TRACE_START()	do { } while(0)
+# define FAT_TRACE(op, vol, file, name, arg, aux, ret)	do { } while(0)
+#endif
+
 static inline uint32_t
 fat_eoc(const struct fat_vol_handle *fat) 
 {
-	switch (fat->type) {
+	switch (FAT_TYPE(fat)) {
 	case FAT_TYPE_FAT12:
 		return 0x0FF8;
 	case FAT_TYPE_FAT16:
@@ -54,10 +185,81 @@ fat_eoc(const struct fat_vol_handle *fat)
 	return -1;
 }
 
+/* Geometry arithmetic.  Sector and cluster sizes are powers of two on
+ * any valid volume, so these are shifts and masks.  Division is kept for
+ * anything else. */
+static inline uint32_t
+fat_bytes_to_sectors(const struct fat_vol_handle *fat, uint32_t n)
+{
+	if(FAT_POW2(fat))
+		return n >> FAT_SECTOR_SHIFT(fat);
+	return n / FAT_BPS(fat);
+}
+
+static inline uint16_t
+fat_sector_offset(const struct fat_vol_handle *fat, uint32_t n)
+{
+	if(FAT_POW2(fat))
+		return n & (FAT_BPS(fat) - 1);
+	return n % FAT_BPS(fat);
+}
+
+static inline uint32_t
+fat_sectors_to_clusters(const struct fat_vol_handle *fat, uint32_t n)
+{
+	if(FAT_POW2(fat))
+		return n >> FAT_CLUSTER_SHIFT(fat);
+	return n / FAT_SPC(fat);
+}
+
+/* Sector within its cluster */
+static inline uint32_t
+fat_cluster_sector(const struct fat_vol_handle *fat, uint32_t n)
+{
+	if(FAT_POW2(fat))
+		return n & (FAT_SPC(fat) - 1);
+	return n % FAT_SPC(fat);
+}
+
+static inline uint32_t
+fat_cluster_size(const struct fat_vol_handle *fat)
+{
+	if(FAT_POW2(fat))
+		return (uint32_t)FAT_BPS(fat) << FAT_CLUSTER_SHIFT(fat);
+	return (uint32_t)FAT_BPS(fat) * FAT_SPC(fat);
+}
+
+static inline uint32_t
+fat_bytes_to_clusters(const struct fat_vol_handle *fat, uint32_t n)
+{
+	if(FAT_POW2(fat))
+		return n >> (FAT_SECTOR_SHIFT(fat) + FAT_CLUSTER_SHIFT(fat));
+	return n / fat_cluster_size(fat);
+}
+
+/* Byte offset within its cluster */
+static inline uint32_t
+fat_cluster_offset(const struct fat_vol_handle *fat, uint32_t n)
+{
+	if(FAT_POW2(fat))
+		return n & (fat_cluster_size(fat) - 1);
+	return n % fat_cluster_size(fat);
+}
+
 static inline uint32_t 
 fat_first_sector_of_cluster(const struct fat_vol_handle *fat, uint32_t n)
 {
-	return ((n - 2) * fat->sectors_per_cluster) + fat->first_data_sector;
+	if(FAT_POW2(fat))
+		return ((n - 2) << FAT_CLUSTER_SHIFT(fat)) + fat->first_data_sector;
+	return ((n - 2) * FAT_SPC(fat)) + fat->first_data_sector;
+}
+
+/* Key identifying a directory.  FAT12/16 root directory isn't a cluster
+ * chain, so it uses 0. */
+static inline uint32_t
+fat_dir_key(const struct fat_file_handle *dir)
+{
+	return dir->root_flag ? 0 : dir->first_cluster;
 }
 
 uint32_t 
@@ -70,16 +272,44 @@ void _fat_file_init(struct fat_vol_handle *fat, const struct fat_sdirent *,
 void _fat_file_sector_offset(struct fat_file_handle *h, uint32_t *sector,
 			uint16_t *offset);
 
+/* Versions of public calls for use with locks already held */
+int _fat_open(struct fat_vol_handle *vol, const char *name, int flags,
+		struct fat_file_handle *file);
+int _fat_read(struct fat_file_handle *h, void *buf, int size);
+int _fat_write(struct fat_file_handle *h, const void *buf, int size);
+int _fat_readdir(struct fat_file_handle *h, struct dirent *ent);
+off_t _fat_lseek(struct fat_file_handle *h, off_t offset, int whence);
+int _fat_file_sync(struct fat_file_handle *h);
+
 int _fat_dir_create_file(struct fat_vol_handle *vol, const char *name,
 		uint8_t attr, struct fat_file_handle *file);
+int _fat_file_truncate(struct fat_file_handle *h);
+
+/* Path component cache, in dcache.c */
+int _fat_dcache_lookup(struct fat_vol_handle *vol, uint32_t parent,
+		const char *name, struct fat_file_handle *file);
+void _fat_dcache_insert(struct fat_vol_handle *vol, uint32_t parent,
+		const char *name, int result, 
+		const struct fat_file_handle *file);
+void _fat_dcache_update(const struct fat_file_handle *file);
+void _fat_dcache_drop_file(const struct fat_file_handle *file);
+void _fat_dcache_drop_negative(struct fat_vol_handle *vol, uint32_t parent);
+void _fat_dcache_drop_dir(struct fat_vol_handle *vol, uint32_t parent);
 
+#ifdef OPENFAT_READ_ONLY
+/* Nothing is ever written, so the buffer is never dirty */
+#define FAT_FLUSH_SECTOR() do { } while(0)
+#else
 #define FAT_FLUSH_SECTOR() do {\
 	if(_fat_cache.dirty) \
-		if(block_write_sectors(_fat_cache.bldev, _fat_cache.sector, \
-					1, _fat_sector_buf) != 1) \
+		if(fat_block_write(_fat_cache.bldev, _fat_cache.sector, \
+					1, _fat_sector_buf) != 1) { \
+			FAT_CACHE_UNLOCK(); \
 			return -EIO; \
+		} \
 	_fat_cache.dirty = 0; \
 } while(0)
+#endif
 
 #define FAT_GET_SECTOR(fat, sectorn)	do {\
 	if((_fat_cache.bldev==(fat)->dev) && (_fat_cache.sector==(sectorn)))\
@@ -90,8 +320,11 @@ int _fat_dir_create_file(struct fat_vol_handle *vol, const char *name,
 	_fat_cache.bldev = (fat)->dev; \
 	_fat_cache.sector = (sectorn); \
 \
-	if(block_read_sectors((fat)->dev, (sectorn), 1, _fat_sector_buf) != 1)\
+	if(fat_block_read((fat)->dev, (sectorn), 1, _fat_sector_buf) != 1){\
+		_fat_cache.bldev = NULL; \
+		FAT_CACHE_UNLOCK(); \
 		return -EIO; \
+	} \
 } while(0)
 
 #define FAT_PUT_SECTOR(fat, sectorn)	do {\
@@ -101,6 +334,39 @@ int _fat_dir_create_file(struct fat_vol_handle *vol, const char *name,
 	_fat_cache.bldev = (fat)->dev; \
 	_fat_cache.sector = (sectorn); \
 	_fat_cache.dirty = 1; \
+	_fat_cache.gen++; \
+} while(0)
+
+/* Contents of a sector for reading in place, or NULL if the block device
+ * can't provide it or the sector buffer has a newer copy. */
+static inline const uint8_t *
+_fat_sector_ptr(const struct fat_vol_handle *fat, uint32_t sector)
+{
+	if(!FAT_RDONLY(fat) && _fat_cache.dirty && 
+	   (_fat_cache.bldev == fat->dev) && (_fat_cache.sector == sector))
+		return NULL;
+	return fat_block_sector_ptr(fat->dev, sector);
+}
+
+/* Contents of a sector for reading in place without the cache lock, or
+ * NULL.  Only for read only volumes, whose sectors the buffer never has
+ * a newer copy of. */
+static inline const uint8_t *
+_fat_sector_ptr_unlocked(const struct fat_vol_handle *fat, uint32_t sector)
+{
+	if(!FAT_RDONLY(fat))
+		return NULL;
+	return fat_block_sector_ptr(fat->dev, sector);
+}
+
+/* Point p at the contents of a sector, in place if possible, otherwise
+ * in the sector buffer.  For reading only, with the cache lock held. */
+#define FAT_MAP_SECTOR(fat, sectorn, p) do {\
+	(p) = _fat_sector_ptr((fat), (sectorn)); \
+	if(!(p)) { \
+		FAT_GET_SECTOR((fat), (sectorn)); \
+		(p) = _fat_sector_buf; \
+	} \
 } while(0)
 
 
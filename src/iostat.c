@@ -0,0 +1,203 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* I/O accounting block device.
+ * Requests are passed straight to the lower device and counted.  The
+ * volume layout is picked up from the boot sector as it is read.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "openfat.h"
+#include "openfat/iostat.h"
+
+#include "fat_core.h"
+
+static uint16_t iostat_get_sector_size(const struct block_device *dev)
+{
+	struct block_iostat *stat = (void*)dev;
+
+	return stat->sector_size;
+}
+
+static int iostat_get_info(const struct block_device *dev,
+			struct block_device_info *info)
+{
+	struct block_iostat *stat = (void*)dev;
+
+	return block_get_info(stat->lower, info);
+}
+
+/* Take the region boundaries from a boot sector, if it looks like one */
+static void iostat_boot_sector(struct block_iostat *stat, const void *buf)
+{
+	struct bpb_common *bpb = (void*)buf;
+
+	if((__get_le16(&bpb->bytes_per_sector) != stat->sector_size) ||
+	   !bpb->sectors_per_cluster || !bpb->num_fats ||
+	   !__get_le16(&bpb->reserved_sector_count) || !_bpb_fat_size(bpb))
+		return;
+
+	stat->fat_start = __get_le16(&bpb->reserved_sector_count);
+	stat->root_start = stat->fat_start + bpb->num_fats * _bpb_fat_size(bpb);
+	stat->data_start = stat->root_start + _bpb_root_dir_sectors(bpb);
+}
+
+static uint8_t iostat_region(const struct block_iostat *stat, uint32_t sector)
+{
+	if(sector >= stat->data_start)
+		return BLOCK_IOSTAT_DATA;
+	if(sector >= stat->root_start)
+		return BLOCK_IOSTAT_ROOT;
+	if(sector >= stat->fat_start)
+		return BLOCK_IOSTAT_FAT;
+	return BLOCK_IOSTAT_BOOT;
+}
+
+/* Sectors of sector..end falling in from..to */
+static uint32_t overlap(uint32_t sector, uint32_t end, uint32_t from,
+		uint32_t to)
+{
+	if(sector < from)
+		sector = from;
+	if(end > to)
+		end = to;
+	return (end > sector) ? end - sector : 0;
+}
+
+static void iostat_count(struct block_iostat *stat,
+		struct block_iostat_counts *c, uint32_t sector, uint32_t count,
+		int ret, uint8_t write)
+{
+	struct block_iostat_req req;
+	uint32_t end = sector + count;
+	int size = 0;
+
+	req.sector = sector;
+	req.count = count;
+	req.seek = sector - stat->next;
+	req.ret = ret;
+	req.write = write;
+	req.region = iostat_region(stat, sector);
+
+	c->calls++;
+	c->sectors += count;
+	c->bytes += (uint64_t)count * stat->sector_size;
+	if(count > c->max_sectors)
+		c->max_sectors = count;
+	while((count >> (size + 1)) && (size < BLOCK_IOSTAT_SIZES - 1))
+		size++;
+	c->sizes[size]++;
+
+	c->region[BLOCK_IOSTAT_BOOT] += overlap(sector, end, 0, stat->fat_start);
+	c->region[BLOCK_IOSTAT_FAT] += overlap(sector, end, stat->fat_start,
+			stat->root_start);
+	c->region[BLOCK_IOSTAT_ROOT] += overlap(sector, end, stat->root_start,
+			stat->data_start);
+	c->region[BLOCK_IOSTAT_DATA] += overlap(sector, end, stat->data_start,
+			UINT32_MAX);
+
+	if(req.seek) {
+		c->seeks++;
+		c->seek_sectors += (req.seek < 0) ? -(int64_t)req.seek : req.seek;
+	}
+	stat->next = end;
+
+	if(stat->trace)
+		stat->trace(stat->trace_priv, &req);
+}
+
+static int iostat_read_sectors(const struct block_device *dev,
+			uint32_t sector, uint32_t count, void *buf)
+{
+	struct block_iostat *stat = (void*)dev;
+	int ret;
+
+	ret = block_read_sectors(stat->lower, sector, count, buf);
+
+	_fat_lock(stat->lock);
+	if((sector == 0) && (ret > 0))
+		iostat_boot_sector(stat, buf);
+	iostat_count(stat, &stat->read, sector, count, ret, 0);
+	_fat_unlock(stat->lock);
+
+	return ret;
+}
+
+static int iostat_write_sectors(const struct block_device *dev,
+			uint32_t sector, uint32_t count, const void *buf)
+{
+	struct block_iostat *stat = (void*)dev;
+	int ret;
+
+	ret = block_write_sectors(stat->lower, sector, count, buf);
+
+	_fat_lock(stat->lock);
+	iostat_count(stat, &stat->write, sector, count, ret, 1);
+	_fat_unlock(stat->lock);
+
+	return ret;
+}
+
+int block_iostat_init(struct block_iostat *stat, struct block_device *lower)
+{
+	memset(stat, 0, sizeof(*stat));
+	stat->lower = lower;
+	stat->sector_size = block_get_sector_size(lower);
+
+	stat->bldev.get_sector_size = iostat_get_sector_size;
+	stat->bldev.get_info = iostat_get_info;
+	stat->bldev.read_sectors = iostat_read_sectors;
+	stat->bldev.write_sectors = iostat_write_sectors;
+	/* No get_sector_ptr, in place reads would go uncounted */
+
+	return 0;
+}
+
+void block_iostat_set_lock(struct block_iostat *stat, void *lock)
+{
+	stat->lock = lock;
+}
+
+void block_iostat_set_trace(struct block_iostat *stat,
+		block_iostat_trace_t trace, void *priv)
+{
+	_fat_lock(stat->lock);
+	stat->trace = trace;
+	stat->trace_priv = priv;
+	_fat_unlock(stat->lock);
+}
+
+void block_iostat_add_user(struct block_iostat *stat, uint32_t bytes)
+{
+	_fat_lock(stat->lock);
+	stat->user_bytes += bytes;
+	_fat_unlock(stat->lock);
+}
+
+void block_iostat_reset(struct block_iostat *stat)
+{
+	_fat_lock(stat->lock);
+	memset(&stat->read, 0, sizeof(stat->read));
+	memset(&stat->write, 0, sizeof(stat->write));
+	stat->user_bytes = 0;
+	_fat_unlock(stat->lock);
+}
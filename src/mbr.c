@@ -39,6 +39,14 @@ static int mbr_read_sectors(const struct block_device *dev,
 				part->first_lba + sector, count, buf);
 }
 
+static const void *mbr_get_sector_ptr(const struct block_device *dev, 
+			uint32_t sector)
+{
+	struct block_mbr_partition *part = (void*)dev;
+
+	return block_get_sector_ptr(part->whole, part->first_lba + sector);
+}
+
 static int mbr_write_sectors(const struct block_device *dev, 
 			uint32_t sector, uint32_t count, const void *buf)
 {
@@ -48,6 +56,19 @@ static int mbr_write_sectors(const struct block_device *dev,
 				part->first_lba + sector, count, buf);
 }
 
+static int mbr_get_info(const struct block_device *dev, 
+			struct block_device_info *info)
+{
+	struct block_mbr_partition *part = (void*)dev;
+
+	/* Transfer and erase sizes are those of the whole disk */
+	block_get_info(part->whole, info);
+	info->sector_count = part->sector_count;
+	info->offset += part->first_lba;
+
+	return 0;
+}
+
 int mbr_partition_init(struct block_mbr_partition *part, 
 			struct block_device *whole, uint8_t part_index)
 {
@@ -62,8 +83,10 @@ int mbr_partition_init(struct block_mbr_partition *part,
 	part->sector_count = __get_le32(&part_table[part_index].sector_count);
 
 	part->bldev.get_sector_size = whole->get_sector_size;
+	part->bldev.get_info = mbr_get_info;
 	part->bldev.read_sectors = mbr_read_sectors;
 	part->bldev.write_sectors = mbr_write_sectors;
+	part->bldev.get_sector_ptr = mbr_get_sector_ptr;
 
 	return 0;
 }
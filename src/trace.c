@@ -0,0 +1,94 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Recording of calls to the filesystem.
+ * The public functions call FAT_TRACE() as they return, which compiles
+ * away unless OPENFAT_TRACE is defined.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "openfat.h"
+#include "openfat/trace.h"
+
+#include "fat_core.h"
+
+#ifdef OPENFAT_TRACE
+
+static const struct fat_trace_ops *trace_ops;
+static void *trace_priv;
+
+int fat_trace_init(const struct fat_trace_ops *ops, void *priv)
+{
+	trace_priv = priv;
+	trace_ops = ops;
+	return 0;
+}
+
+uint32_t _fat_trace_clock(void)
+{
+	const struct fat_trace_ops *ops = trace_ops;
+
+	return ops ? ops->clock(trace_priv) : 0;
+}
+
+void _fat_trace(uint8_t op, const void *vol, const void *file, 
+		const char *name, int32_t arg, uint8_t aux, int32_t ret, 
+		uint32_t start)
+{
+	const struct fat_trace_ops *ops = trace_ops;
+	uint8_t rec[FAT_TRACE_HEADER + FAT_TRACE_NAME_MAX];
+	uint16_t len = 0;
+
+	if(!ops)
+		return;
+
+	if(name) {
+		len = strlen(name);
+		if(len > FAT_TRACE_NAME_MAX)
+			len = FAT_TRACE_NAME_MAX;
+		memcpy(rec + FAT_TRACE_HEADER, name, len);
+	}
+
+	rec[0] = op;
+	rec[1] = aux;
+	__put_le16((uint16_t*)(rec + 2), len);
+	__put_le32((uint32_t*)(rec + 4), (uintptr_t)vol);
+	__put_le32((uint32_t*)(rec + 8), (uintptr_t)file);
+	__put_le32((uint32_t*)(rec + 12), arg);
+	__put_le32((uint32_t*)(rec + 16), ret);
+	__put_le32((uint32_t*)(rec + 20), start);
+	__put_le32((uint32_t*)(rec + 24), ops->clock(trace_priv) - start);
+
+	ops->write(trace_priv, rec, FAT_TRACE_HEADER + len);
+}
+
+#else
+
+int fat_trace_init(const struct fat_trace_ops *ops, void *priv)
+{
+	(void)ops;
+	(void)priv;
+	return -ENOSYS;
+}
+
+#endif
@@ -22,27 +22,37 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include "openfat/blockdev.h"
 #include "fat_core.h"
 #include "direntry.h"
 
+/* Number of path components remembered by ufat_open() */
+#define UFAT_DCACHE_SIZE 64
+
 struct fat_vol_handle *
 ufat_mount(struct block_device *dev)
 {
-	struct fat_vol_handle *vol = malloc(sizeof(*vol));
+	/* Path component cache is allocated with the volume, so
+	 * ufat_umount() frees both. */
+	struct fat_vol_handle *vol = malloc(sizeof(*vol) + 
+			UFAT_DCACHE_SIZE * sizeof(struct fat_dcache_entry));
 	
 	if(fat_vol_init(dev, vol)) {
 		free(vol);
 		return NULL;
 	}
+	fat_dcache_init(vol, (struct fat_dcache_entry *)(vol + 1), 
+			UFAT_DCACHE_SIZE);
 
 	return vol;
 }
 
-struct fat_file_handle *
-ufat_open(struct fat_vol_handle *fat, const char *path, int flags)
+static struct fat_file_handle *
+ufat_open_path(struct fat_vol_handle *fat, const char *path, int flags)
 {
 	struct fat_file_handle oldcwd;
 	
@@ -55,23 +65,51 @@ ufat_open(struct fat_vol_handle *fat, const char *path, int flags)
 		_fat_file_root(fat, h);
 		path++;
 	} else {
+		_fat_lock(fat->meta_lock);
 		memcpy(h, &fat->cwd, sizeof(*h));
+		_fat_unlock(fat->meta_lock);
 	}
 
-	memcpy(&oldcwd, &fat->cwd, sizeof(oldcwd));
 	while(path && *path) {
-		memcpy(&fat->cwd, h, sizeof(*h));
-		if(fat_open(fat, path, flags, h)) {
-			free(h);
+		uint32_t parent = fat_dir_key(h);
+		const char *next = strchr(path, '/');
+		/* Only the last component may be created or truncated */
+		int cflags = (next && next[1]) ? 
+				flags & ~(O_CREAT | O_EXCL | O_TRUNC) : flags;
+		int ret = -1;
+		if(!(cflags & (O_CREAT | O_TRUNC)))
+			ret = _fat_dcache_lookup(fat, parent, path, h);
+		if(ret == -1) {
+			/* Not cached, search directory.  Cached names are
+			 * found without the metadata lock. */
+			_fat_lock(fat->meta_lock);
+			memcpy(&oldcwd, &fat->cwd, sizeof(oldcwd));
+			memcpy(&fat->cwd, h, sizeof(*h));
+			ret = _fat_open(fat, path, cflags, h);
+			_fat_dcache_insert(fat, parent, path, ret, h);
 			memcpy(&fat->cwd, &oldcwd, sizeof(oldcwd));
+			_fat_unlock(fat->meta_lock);
+		}
+		if(ret) {
+			free(h);
 			return NULL;
 		}
-		path = strchr(path, '/');
+		h->flags = flags;
+		path = next;
 		if(path) path++;
 	};
 
-	memcpy(&fat->cwd, &oldcwd, sizeof(oldcwd));
+	return h;
+}
+
+struct fat_file_handle *
+ufat_open(struct fat_vol_handle *fat, const char *path, int flags)
+{
+	struct fat_file_handle *h;
+	FAT_TRACE_START();
 
+	h = ufat_open_path(fat, path, flags);
+	FAT_TRACE(UFAT_OPEN, fat, h, path, flags, 0, h ? 0 : -1);
 	return h;
 }
 
@@ -87,9 +125,10 @@ int ufat_stat(struct fat_file_handle *h, struct stat *st)
 		return 0;
 	}
 
-	/* Read direntry sector */
-	if(block_read_sectors(h->fat->dev, h->dirent_sector, 1, _fat_sector_buf) != 1)
-		return -1;
+	/* Read direntry sector through the cache, so a dirty sector isn't
+	 * overwritten */
+	FAT_CACHE_LOCK();
+	FAT_GET_SECTOR(h->fat, h->dirent_sector);
 	fatent = (void*)&_fat_sector_buf[h->dirent_offset];
 	
 	/* TODO: Fill in timestamps */
@@ -99,6 +138,7 @@ int ufat_stat(struct fat_file_handle *h, struct stat *st)
 	} else {
 		st->st_size = __get_le32(&fatent->size);
 	}
+	FAT_CACHE_UNLOCK();
 
 	return 0;
 }
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "openfat.h"
 
@@ -57,9 +58,10 @@ fat32_set_next_cluster(const struct fat_vol_handle *h, uint8_t fat,
 	uint32_t sector;
 
 	sector = h->reserved_sector_count + (fat * h->fat_size) +
-		(offset / h->bytes_per_sector);
-	offset %= h->bytes_per_sector;
+		fat_bytes_to_sectors(h, offset);
+	offset = fat_sector_offset(h, offset);
 
+	FAT_CACHE_LOCK();
 	FAT_GET_SECTOR(h, sector);
 
 	/* Preserve high nybble */
@@ -68,6 +70,7 @@ fat32_set_next_cluster(const struct fat_vol_handle *h, uint8_t fat,
 	__put_le32((uint32_t*)(_fat_sector_buf + offset), next);
 
 	FAT_PUT_SECTOR(h, sector);
+	FAT_CACHE_UNLOCK();
 
 	return 0;
 }
@@ -80,12 +83,14 @@ fat16_set_next_cluster(const struct fat_vol_handle *h, uint8_t fat,
 	uint32_t sector;
 
 	sector = h->reserved_sector_count + (fat * h->fat_size) + 
-		(offset / h->bytes_per_sector);
-	offset %= h->bytes_per_sector;
+		fat_bytes_to_sectors(h, offset);
+	offset = fat_sector_offset(h, offset);
 
+	FAT_CACHE_LOCK();
 	FAT_GET_SECTOR(h, sector);
 	__put_le16((uint16_t*)(_fat_sector_buf + offset), next);
 	FAT_PUT_SECTOR(h, sector);
+	FAT_CACHE_UNLOCK();
 
 	return 0;
 }
@@ -97,11 +102,12 @@ fat12_set_next_cluster(const struct fat_vol_handle *h, uint8_t fat,
 	uint32_t offset = cluster + (cluster / 2);
 	uint32_t sector;
 	sector = h->reserved_sector_count + (fat * h->fat_size) + 
-		(offset / h->bytes_per_sector);
-	offset %= h->bytes_per_sector;
+		fat_bytes_to_sectors(h, offset);
+	offset = fat_sector_offset(h, offset);
 
+	FAT_CACHE_LOCK();
 	FAT_GET_SECTOR(h, sector);
-	if(offset == (uint32_t)h->bytes_per_sector - 1) {
+	if(offset == (uint32_t)FAT_BPS(h) - 1) {
 		if(cluster & 1) {
 			next <<= 4;
 			_fat_sector_buf[offset] &= 0x0F;
@@ -129,74 +135,259 @@ fat12_set_next_cluster(const struct fat_vol_handle *h, uint8_t fat,
 		__put_le16((uint16_t*)(_fat_sector_buf + offset), next);
 	}
 	FAT_PUT_SECTOR(h, sector);
+	FAT_CACHE_UNLOCK();
 
 	return 0;
 }
 
 static int 
-fat_set_next_cluster(const struct fat_vol_handle *h, 
+fat_set_fat_entry(const struct fat_vol_handle *h, uint8_t fat,
+			uint32_t cluster, uint32_t next)
+{
+	switch(FAT_TYPE(h)) {
+	case FAT_TYPE_FAT12:
+		return fat12_set_next_cluster(h, fat, cluster, next);
+	case FAT_TYPE_FAT16:
+		return fat16_set_next_cluster(h, fat, cluster, next);
+	case FAT_TYPE_FAT32:
+		return fat32_set_next_cluster(h, fat, cluster, next);
+	}
+	return 0;
+}
+
+/* Keep the free cluster count, if known, up to date with a change */
+static void fat_count_free(struct fat_vol_handle *h, 
+			uint32_t cluster, uint32_t next)
+{
+	uint32_t old;
+
+	if(h->free_count == FSINFO_UNKNOWN)
+		return;
+	old = _fat_get_next_cluster(h, cluster);
+	if(!old && next)
+		h->free_count--;
+	else if(old && !next)
+		h->free_count++;
+}
+
+static int 
+fat_set_next_cluster(struct fat_vol_handle *h, 
 			uint32_t cluster, uint32_t next)
 {
+	int ret = 0;
+	fat_count_free(h, cluster, next);
+	for(int i = 0; i < h->num_fats; i++)
+		ret |= fat_set_fat_entry(h, i, cluster, next);
+	return ret;
+}
+
+/* Chain count consecutive clusters together, ending with next, or free
+ * them all if next is 0.  One FAT copy is done at a time, so entries in
+ * the same sector are written together. */
+static int 
+fat_set_cluster_run(struct fat_vol_handle *h, 
+			uint32_t cluster, uint32_t count, uint32_t next)
+{
+	uint32_t last = cluster + count - 1;
 	int ret = 0;
 	for(int i = 0; i < h->num_fats; i++) {
-		switch(h->type) {
-		case FAT_TYPE_FAT12:
-			ret |= fat12_set_next_cluster(h, i, cluster, next);
-			break;
-		case FAT_TYPE_FAT16:
-			ret |= fat16_set_next_cluster(h, i, cluster, next);
-			break;
-		case FAT_TYPE_FAT32:
-			ret |= fat32_set_next_cluster(h, i, cluster, next);
-			break;
+		for(uint32_t c = cluster; c < last; c++) {
+			if(!i)
+				fat_count_free(h, c, next);
+			ret |= fat_set_fat_entry(h, i, c, next ? c + 1 : 0);
 		}
+		if(!i)
+			fat_count_free(h, last, next);
+		ret |= fat_set_fat_entry(h, i, last, next);
 	}
 	return ret;
 }
 
+/* Allocate a free cluster and mark it as the end of a chain */
+static uint32_t fat_alloc_cluster(struct fat_vol_handle *h)
+{
+	uint32_t cluster;
+
+	_fat_lock(h->alloc_lock);
+	cluster = fat_find_free_cluster(h);
+	if(cluster) /* Write end of chain marker in new cluster */
+		fat_set_next_cluster(h, cluster, fat_eoc(h));
+	_fat_unlock(h->alloc_lock);
+
+	return cluster;
+}
+
+static int fat_clear_cluster(struct fat_vol_handle *h, uint32_t cluster)
+{
+	uint32_t sector = fat_first_sector_of_cluster(h, cluster);
+
+	FAT_CACHE_LOCK();
+	FAT_FLUSH_SECTOR();
+	memset(_fat_sector_buf, 0, FAT_BPS(h));
+	for(int i = 0; i < FAT_SPC(h); i++) {
+		/* How do we report failure here?
+		 * The cluster has already been allocated.
+		 */
+		int discard = fat_block_write(h->dev, sector + i, 1, 
+					_fat_sector_buf); 
+		(void)discard;
+	}
+	/* Buffer now holds the last cleared sector */
+	_fat_cache.bldev = h->dev;
+	_fat_cache.sector = sector + FAT_SPC(h) - 1;
+	_fat_cache.gen++;
+	FAT_CACHE_UNLOCK();
+
+	return 0;
+}
+
 static int32_t fat_alloc_next_cluster(struct fat_vol_handle *h, 
 				uint32_t cluster, int clear)
 {
-	/* Return next if already allocated */
-	uint32_t next = _fat_get_next_cluster(h, cluster);
+	uint32_t next;
 
-	if(next != fat_eoc(h)) 
+	_fat_lock(h->alloc_lock);
+
+	/* Return next if already allocated */
+	next = _fat_get_next_cluster(h, cluster);
+	if(next < fat_eoc(h)) {
+		_fat_unlock(h->alloc_lock);
 		return next;
+	}
 	
 	/* Find free cluster to link to */
 	next = fat_find_free_cluster(h);
+	if(next) {
+		/* Write end of chain marker in new cluster */
+		fat_set_next_cluster(h, next, fat_eoc(h));
+		/* Add new cluster to chain */
+		fat_set_next_cluster(h, cluster, next);
+	}
+
+	_fat_unlock(h->alloc_lock);
 
 	if(!next) /* No more free clusters */
 		return 0;
 
-	/* Write end of chain marker in new cluster */
-	fat_set_next_cluster(h, next, fat_eoc(h));
-	/* Add new cluster to chain */
-	fat_set_next_cluster(h, cluster, next);
+	if(clear) /* Zero new cluster */
+		fat_clear_cluster(h, next);
 
-	if(clear) {
-		/* Zero new cluster */
-		uint32_t sector = fat_first_sector_of_cluster(
-				h, next);
-		FAT_FLUSH_SECTOR();
-		memset(_fat_sector_buf, 0, h->bytes_per_sector);
-		for(int i = 0; i < h->sectors_per_cluster; i++) {
-			/* How do we report failure here?
-			 * The cluster has already been allocated.
-			 */
-			int discard = block_write_sectors(h->dev, sector + i, 1, 
-						_fat_sector_buf); 
-			(void)discard;
-		}
+	return next;
+}
+
+/* Set or clear the clean shutdown flag in FAT[1], and write it out */
+static int fat_set_clean_flag(struct fat_vol_handle *vol, int clean)
+{
+	uint32_t flags = _fat_get_next_cluster(vol, 1);
+	uint32_t mask = (FAT_TYPE(vol) == FAT_TYPE_FAT32) ? 
+			FAT32_CLN_SHUT : FAT16_CLN_SHUT;
+	int ret;
+
+	ret = fat_set_next_cluster(vol, 1, clean ? flags | mask : 
+						flags & ~mask);
+	FAT_CACHE_LOCK();
+	FAT_FLUSH_SECTOR();
+	FAT_CACHE_UNLOCK();
+	return ret ? -EIO : 0;
+}
+
+/* Mark the volume dirty on the medium before its first change, so it
+ * stays marked if it isn't unmounted.  Fails with -EROFS if the volume
+ * may not be changed.  Must be called without the allocation lock held. */
+static int fat_vol_dirty(struct fat_vol_handle *vol)
+{
+	int ret = 0;
+
+	if(FAT_RDONLY(vol))
+		return -EROFS;
+	if(vol->written)
+		return 0;
+
+	_fat_lock(vol->alloc_lock);
+	if(!vol->written) {
+		ret = fat_set_clean_flag(vol, 0);
+		vol->written = 1;
+	}
+	_fat_unlock(vol->alloc_lock);
+	return ret;
+}
+
+/* Store the free cluster count and next free hint in FSInfo */
+static int fat_fsinfo_update(struct fat_vol_handle *vol)
+{
+	struct fat_fsinfo *fsi;
+
+	FAT_CACHE_LOCK();
+	FAT_GET_SECTOR(vol, vol->fsinfo_sector);
+	fsi = (void *)_fat_sector_buf;
+	if((__get_le32(&fsi->lead_sig) == FSINFO_LEAD_SIG) &&
+	   (__get_le32(&fsi->struc_sig) == FSINFO_STRUC_SIG) &&
+	   (__get_le32(&fsi->trail_sig) == FSINFO_TRAIL_SIG)) {
+		__put_le32(&fsi->free_count, vol->free_count);
+		__put_le32(&fsi->nxt_free, vol->last_cluster_alloc);
+		FAT_PUT_SECTOR(vol, vol->fsinfo_sector);
 	}
+	FAT_CACHE_UNLOCK();
+	return 0;
+}
 
-	return next;
+int fat_vol_umount(struct fat_vol_handle *vol)
+{
+	int ret = 0;
+	FAT_TRACE_START();
+
+	_fat_lock(vol->meta_lock);
+	_fat_lock(vol->alloc_lock);
+	/* A volume that was dirty when mounted stays dirty */
+	if(vol->written && !(vol->state & FAT_VOL_DIRTY)) {
+		if(vol->fsinfo_sector)
+			ret = fat_fsinfo_update(vol);
+		if(!ret)
+			ret = fat_set_clean_flag(vol, 1);
+		if(!ret)
+			vol->written = 0;
+	}
+	FAT_CACHE_LOCK();
+	if(_fat_cache.bldev == vol->dev)
+		FAT_FLUSH_SECTOR();
+	FAT_CACHE_UNLOCK();
+	_fat_unlock(vol->alloc_lock);
+	_fat_unlock(vol->meta_lock);
+	FAT_TRACE(UMOUNT, vol, NULL, NULL, 0, 0, ret);
+
+	return ret;
 }
 
+static int fat_file_write(struct fat_file_handle *h, const void *buf,
+		int size);
+static int fat_stream_flush(struct fat_file_handle *h);
+static int fat_stream_write(struct fat_file_handle *h, const uint8_t *buf,
+		int size);
+
 int fat_file_sync(struct fat_file_handle *h)
+{
+	int ret = 0;
+	FAT_TRACE_START();
+
+	_fat_lock(h->lock);
+	/* A file can only have changes to write once the volume is marked
+	 * dirty, so a clean or read only volume is left alone */
+	if(!FAT_RDONLY(h->fat) && h->fat->written) {
+		if(h->stream)
+			ret = fat_stream_flush(h);
+		if(!ret)
+			ret = _fat_file_sync(h);
+	}
+	_fat_unlock(h->lock);
+	FAT_TRACE(SYNC, h->fat, h, NULL, 0, 0, ret);
+	return ret;
+}
+
+int _fat_file_sync(struct fat_file_handle *h)
 {
 	struct fat_sdirent *dirent;
 	/* Update directory entry with new size */
+	FAT_CACHE_LOCK();
 	FAT_GET_SECTOR(h->fat, h->dirent_sector);
 	dirent = (void*)&_fat_sector_buf[h->dirent_offset];
 	__put_le32(&dirent->size, h->size);
@@ -204,24 +395,103 @@ int fat_file_sync(struct fat_file_handle *h)
 	__put_le16(&dirent->cluster_lo, h->first_cluster & 0xFFFF);
 	FAT_PUT_SECTOR(h->fat, h->dirent_sector);
 	FAT_FLUSH_SECTOR();
+	FAT_CACHE_UNLOCK();
+	_fat_dcache_update(h);
+
+	h->synced_size = h->size;
+	if(h->sync_policy && h->sync_policy->clock)
+		h->synced_time = h->sync_policy->clock();
+	else if(h->fat->sync_policy.clock)
+		h->synced_time = h->fat->sync_policy.clock();
+	return 0;
+}
+
+void fat_vol_set_sync_policy(struct fat_vol_handle *vol, 
+			const struct fat_sync_policy *policy)
+{
+	if(policy)
+		memcpy(&vol->sync_policy, policy, sizeof(*policy));
+	else
+		memset(&vol->sync_policy, 0, sizeof(vol->sync_policy));
+}
+
+void fat_file_set_sync_policy(struct fat_file_handle *h, 
+			const struct fat_sync_policy *policy)
+{
+	h->sync_policy = policy;
+	if(policy && policy->clock)
+		h->synced_time = policy->clock();
+}
+
+/* Decide if a growing file's directory entry is due to be updated */
+static int fat_file_sync_due(const struct fat_file_handle *h)
+{
+	const struct fat_sync_policy *p = h->sync_policy;
+
+	if(h->flags & O_ASYNC)
+		return 0;
+
+	if(!p)
+		p = &h->fat->sync_policy;
+
+	if(!p->bytes && !p->clusters && !p->interval)
+		return 1; /* No policy, sync on every write */
+
+	if(p->bytes && ((h->size - h->synced_size) >= p->bytes))
+		return 1;
+
+	if(p->clusters && ((fat_bytes_to_clusters(h->fat, h->size) - 
+			fat_bytes_to_clusters(h->fat, h->synced_size)) >= 
+			p->clusters))
+		return 1;
+
+	if(p->interval && p->clock && 
+	   ((uint32_t)(p->clock() - h->synced_time) >= p->interval))
+		return 1;
+
 	return 0;
 }
 
 #define MIN(x, y) (((x) < (y))?(x):(y))
 int fat_write(struct fat_file_handle *h, const void *buf, int size)
+{
+	int ret;
+	FAT_TRACE_START();
+
+	_fat_lock(h->lock);
+	ret = _fat_write(h, buf, size);
+	_fat_unlock(h->lock);
+	FAT_TRACE(WRITE, h->fat, h, NULL, size, 0, ret);
+	return ret;
+}
+
+int _fat_write(struct fat_file_handle *h, const void *buf, int size)
+{
+	if(size > 0) {
+		int ret = fat_vol_dirty(h->fat);
+		if(ret)
+			return ret;
+	}
+	if(h->stream)
+		return fat_stream_write(h, buf, size);
+	return fat_file_write(h, buf, size);
+}
+
+static int fat_file_write(struct fat_file_handle *h, const void *buf, int size)
 {
 	int i;
 	uint32_t sector;
 	uint16_t offset;
 
+	if((h->flags & O_APPEND) && (h->position != h->size))
+		_fat_lseek(h, 0, SEEK_END);
+
 	if(!h->cur_cluster && size) {
 		/* File was empty, allocate first cluster. */
-		h->first_cluster = fat_find_free_cluster(h->fat);
+		h->first_cluster = fat_alloc_cluster(h->fat);
 		if(!h->first_cluster) 
 			return 0;
 		h->cur_cluster = h->first_cluster;
-		/* Write end of chain marker in new cluster */
-		fat_set_next_cluster(h->fat, h->cur_cluster, fat_eoc(h->fat));
 		/* Directory entry will be updated with size after the
 		 * file write is done. 
 		 */
@@ -231,66 +501,535 @@ int fat_write(struct fat_file_handle *h, const void *buf, int size)
 	if(h->root_flag && ((h->position + size) > h->size))
 		size = h->size - h->position;
 
-	_fat_file_sector_offset(h, &sector, &offset);
+	if(h->tail_sector && (h->position == h->size)) {
+		/* Appending, we already know where the file ends. */
+		h->cur_cluster = h->tail_cluster;
+		sector = h->tail_sector;
+		offset = fat_sector_offset(h->fat, h->position);
+	} else {
+		_fat_file_sector_offset(h, &sector, &offset);
+	}
 
 	for(i = 0; i < size; ) {
-		uint16_t chunk = MIN(h->fat->bytes_per_sector - offset, 
+		uint16_t chunk = MIN(FAT_BPS(h->fat) - offset, 
 					size - i);
-		if(chunk < h->fat->bytes_per_sector)
-			FAT_GET_SECTOR(h->fat, sector);
-		else
+		FAT_CACHE_LOCK();
+		if(chunk == FAT_BPS(h->fat)) {
 			FAT_FLUSH_SECTOR();
+		} else if(!offset && h->dirent_sector && 
+			  (h->position >= h->size)) {
+			/* Sector is past end of file, don't read it. */
+			FAT_FLUSH_SECTOR();
+			memset(_fat_sector_buf + chunk, 0, 
+				FAT_BPS(h->fat) - chunk);
+		} else {
+			FAT_GET_SECTOR(h->fat, sector);
+		}
 
 		memcpy(_fat_sector_buf + offset, buf + i, chunk);
 		FAT_PUT_SECTOR(h->fat, sector);
+		FAT_CACHE_UNLOCK();
 		h->position += chunk;
 		i += chunk;
-		if((h->position % h->fat->bytes_per_sector) != 0) 
+		if(fat_sector_offset(h->fat, h->position) != 0) 
 			/* we didn't write until the end of the sector... */
 			break;
 		offset = 0;
 		sector++;
 		if(h->root_flag) /* FAT12/16 isn't a cluster chain */
 			continue;
-		if((sector % h->fat->sectors_per_cluster) == 0) {
+		if(fat_cluster_sector(h->fat, 
+				sector - h->fat->first_data_sector) == 0) {
 			/* Go to next cluster... */
 			uint32_t next_cluster = fat_alloc_next_cluster(h->fat, 
 						h->cur_cluster, h->size == 0);
-			if(!next_cluster)
+			if(!next_cluster) {
+				sector = 0;
 				break;
+			}
 			h->cur_cluster = next_cluster;
 			sector = fat_first_sector_of_cluster(h->fat, 
 						h->cur_cluster);
 		}
 	}
 
-	if(h->dirent_sector && (h->position > h->size)) {
-		/* Update directory entry with new size */
-		h->size = h->position;
-		if(!(h->flags & O_ASYNC))
-			fat_file_sync(h);
+	if(i && h->dirent_sector && (h->position >= h->size)) {
+		/* Remember end of file for next append */
+		h->tail_cluster = h->cur_cluster;
+		h->tail_sector = sector;
+		if(h->position > h->size) {
+			/* Update directory entry with new size */
+			h->size = h->position;
+			if(fat_file_sync_due(h))
+				_fat_file_sync(h);
+		}
 	}
 
 	return i;
 }
 
-static int fat_chain_unlink(const struct fat_vol_handle *vol, uint32_t cluster)
+static int fat_chain_unlink(struct fat_vol_handle *vol, uint32_t cluster)
 {
 	int ret = 0;
-	while(cluster && (cluster != fat_eoc(vol))) {
+
+	_fat_lock(vol->alloc_lock);
+	while(cluster && (cluster < fat_eoc(vol))) {
 		uint32_t next = _fat_get_next_cluster(vol, cluster); 
 		ret |= fat_set_next_cluster(vol, cluster, 0);
 		cluster = next;
 	}
+	_fat_unlock(vol->alloc_lock);
 	return ret;
 }
 
-int fat_unlink(struct fat_vol_handle *vol, const char *name)
+/* Find the directory sector before sector, returns 0 at the start of the
+ * directory.  Going back over a cluster boundary walks the chain. */
+static uint32_t fat_dir_prev_sector(const struct fat_vol_handle *vol,
+		const struct fat_file_handle *dir, uint32_t sector)
+{
+	uint32_t cluster, prev, next;
+
+	if(dir->root_flag) /* FAT12/16 root directory is contiguous */
+		return (sector > dir->first_cluster) ? sector - 1 : 0;
+
+	if(fat_cluster_sector(vol, sector - vol->first_data_sector))
+		return sector - 1;
+
+	cluster = fat_sectors_to_clusters(vol, 
+			sector - vol->first_data_sector) + 2;
+	for(prev = dir->first_cluster; prev && (prev < fat_eoc(vol)); 
+	    prev = next) {
+		next = _fat_get_next_cluster(vol, prev);
+		if(next == cluster)
+			return fat_first_sector_of_cluster(vol, prev) + 
+				FAT_SPC(vol) - 1;
+	}
+	return 0;
+}
+
+/* Mark a short directory entry deleted, along with the long name entries
+ * before it.  These are found by walking back from the short entry. */
+static int fat_dir_delete_entry(struct fat_vol_handle *vol, 
+		const struct fat_file_handle *dir, 
+		uint32_t sector, uint16_t offset)
+{
+	struct fat_ldirent *ld;
+	uint8_t csum, ord;
+
+	FAT_CACHE_LOCK();
+	FAT_GET_SECTOR(vol, sector);
+	csum = _fat_dirent_chksum(_fat_sector_buf + offset);
+	_fat_sector_buf[offset] = 0xE5;
+	FAT_PUT_SECTOR(vol, sector);
+	FAT_CACHE_UNLOCK();
+
+	for(int i = 1; ; i++) {
+		if(!offset) {
+			sector = fat_dir_prev_sector(vol, dir, sector);
+			if(!sector)
+				return 0;
+			offset = FAT_BPS(vol);
+		}
+		offset -= sizeof(*ld);
+		FAT_CACHE_LOCK();
+		FAT_GET_SECTOR(vol, sector);
+		ld = (void*)(_fat_sector_buf + offset);
+		ord = ld->ord;
+		if((ld->attr != FAT_ATTR_LONG_NAME) || 
+		   ((ord & 0x3f) != i) || (ld->checksum != csum)) {
+			FAT_CACHE_UNLOCK();
+			return 0;
+		}
+		_fat_sector_buf[offset] = 0xE5;
+		FAT_PUT_SECTOR(vol, sector);
+		FAT_CACHE_UNLOCK();
+		if(ord & FAT_LAST_LONG_ENTRY)
+			return 0;
+	}
+}
+
+/* Discard a file's contents, for O_TRUNC */
+int _fat_file_truncate(struct fat_file_handle *h)
+{
+	int ret = fat_vol_dirty(h->fat);
+
+	if(ret)
+		return ret;
+	fat_chain_unlink(h->fat, h->first_cluster);
+	h->first_cluster = h->cur_cluster = 0;
+	h->size = h->position = 0;
+	h->tail_cluster = h->tail_sector = 0;
+	return _fat_file_sync(h);
+}
+
+/* Streaming writes.  Clusters are reserved a run at a time and linked
+ * into the chain as soon as they are reserved.  Data collects in the
+ * stream buffer and is written straight to the run's sectors, so a file
+ * fills each run in a few long sequential writes. */
+
+/* Write out the stream buffer.  A partial last sector is kept in the
+ * buffer, to be written again once it is filled. */
+static int fat_stream_flush(struct fat_file_handle *h)
+{
+	struct fat_vol_handle *vol = h->fat;
+	struct fat_stream *s = h->stream;
+	uint32_t sector, count, tail;
+
+	if(!s->fill)
+		return 0;
+
+	sector = fat_first_sector_of_cluster(vol, s->run_cluster) +
+		fat_bytes_to_sectors(vol, s->buf_pos - s->run_pos);
+	count = fat_bytes_to_sectors(vol, s->fill + FAT_BPS(vol) - 1);
+	tail = fat_sector_offset(vol, s->fill);
+	if(tail) /* Don't write stale data past the end of file */
+		memset(s->buf + s->fill, 0, FAT_BPS(vol) - tail);
+
+	/* Sectors are written whole, drop any older copy in the buffer */
+	FAT_CACHE_LOCK();
+	if((_fat_cache.bldev == vol->dev) && (_fat_cache.sector >= sector) &&
+	   (_fat_cache.sector < sector + count)) {
+		_fat_cache.bldev = NULL;
+		_fat_cache.dirty = 0;
+		_fat_cache.gen++;
+	}
+	FAT_CACHE_UNLOCK();
+
+	if(fat_block_write(vol->dev, sector, count, s->buf) != (int)count)
+		return -EIO;
+
+	if(tail)
+		memmove(s->buf, s->buf + s->fill - tail, tail);
+	s->buf_pos += s->fill - tail;
+	s->fill = tail;
+	return 0;
+}
+
+/* Find *n free clusters in a row, starting at multiples of *n from first,
+ * or anywhere if first is 0.  The search starts after the last
+ * allocation and wraps around.  If there is no such run and first is 0,
+ * the longest shorter run is returned, with its length in *n. */
+static uint32_t fat_find_free_run(struct fat_vol_handle *vol, uint32_t *n,
+		uint32_t first)
+{
+	uint32_t end = vol->cluster_count + 2;
+	uint32_t start = vol->last_cluster_alloc;
+	uint32_t want = *n, best = 0, best_len = 0;
+	int aligned = (first != 0);
+	uint32_t c, i;
+
+	if(!aligned)
+		first = 2;
+	if(start < first)
+		start = first;
+	else if(aligned)
+		start += (want - (start - first) % want) % want;
+
+	/* Up to the end, then from the start up to where the search began */
+	for(int pass = 0; pass < 2; pass++) {
+		uint32_t stop = pass ? start : end;
+		for(c = pass ? first : start;
+		    (c < stop) && (c + (aligned ? want : 1) <= end); ) {
+			for(i = 0; (i < want) && (c + i < end) &&
+			    !_fat_get_next_cluster(vol, c + i); i++)
+				;
+			if(i == want)
+				return c;
+			if(!aligned && (i > best_len)) {
+				best = c;
+				best_len = i;
+			}
+			c += aligned ? want : i + 1;
+		}
+	}
+	*n = best_len;
+	return best;
+}
+
+/* Find clusters for the next run: a whole allocation unit if the device
+ * has them, or else enough clusters to fill the buffer.  Failed searches
+ * aren't repeated, as each reads the whole FAT.  Without a run of the
+ * buffer's size, the free clusters following the last allocation are
+ * used. */
+static uint32_t fat_stream_find(struct fat_vol_handle *vol,
+		struct fat_stream *s, uint32_t *count)
+{
+	uint32_t want = fat_bytes_to_clusters(vol, s->buf_size);
+	uint32_t n, cluster;
+
+	if(s->au_clusters && !s->no_au) {
+		n = s->au_clusters;
+		cluster = fat_find_free_run(vol, &n, s->au_first);
+		if(cluster) {
+			*count = n;
+			return cluster;
+		}
+		s->no_au = 1;
+	}
+
+	if((want > 1) && !s->no_run) {
+		n = want;
+		cluster = fat_find_free_run(vol, &n, 0);
+		if(n < want)
+			s->no_run = 1;
+		*count = n;
+		return cluster;
+	}
+
+	cluster = fat_find_free_cluster(vol);
+	for(n = 1; cluster && (n < want) && 
+	    (cluster + n < vol->cluster_count + 2) &&
+	    !_fat_get_next_cluster(vol, cluster + n); n++)
+		;
+	*count = n;
+	return cluster;
+}
+
+/* Reserve the next run and link it to the end of the file */
+static int fat_stream_reserve(struct fat_file_handle *h)
+{
+	struct fat_vol_handle *vol = h->fat;
+	struct fat_stream *s = h->stream;
+	uint32_t last, cluster, count;
+	int ret = 0;
+
+	last = s->run_count ? s->run_cluster + s->run_count - 1 :
+			s->prev_cluster;
+
+	_fat_lock(vol->alloc_lock);
+	cluster = fat_stream_find(vol, s, &count);
+	if(cluster) {
+		ret |= fat_set_cluster_run(vol, cluster, count, fat_eoc(vol));
+		if(last)
+			ret |= fat_set_next_cluster(vol, last, cluster);
+		vol->last_cluster_alloc = cluster + count - 1;
+	}
+	_fat_unlock(vol->alloc_lock);
+
+	if(!cluster)
+		return -ENOSPC;
+	if(ret)
+		return -EIO;
+
+	if(!last)
+		h->first_cluster = cluster;
+	s->run_pos += s->run_count * fat_cluster_size(vol);
+	s->prev_cluster = last;
+	s->run_cluster = cluster;
+	s->run_count = count;
+
+	/* Everything before the new run is written, so this is the time
+	 * to bring the directory entry up to date. */
+	return _fat_file_sync(h);
+}
+
+/* Start streaming at the end of file, which is on a cluster boundary.
+ * A cluster already allocated past the end is used as the first run. */
+static int fat_stream_attach(struct fat_file_handle *h)
+{
+	struct fat_vol_handle *vol = h->fat;
+	struct fat_stream *s = h->stream;
+	uint32_t prev = 0, cluster = h->first_cluster;
+	uint32_t next;
+
+	for(uint32_t n = fat_bytes_to_clusters(vol, h->size);
+	    n && cluster && (cluster < fat_eoc(vol)); n--) {
+		prev = cluster;
+		cluster = _fat_get_next_cluster(vol, cluster);
+	}
+
+	s->prev_cluster = prev;
+	s->run_pos = s->buf_pos = h->position;
+	s->fill = 0;
+	if(!cluster || (cluster >= fat_eoc(vol))) {
+		s->run_cluster = s->run_count = 0;
+		return 0;
+	}
+
+	next = _fat_get_next_cluster(vol, cluster);
+	if(next && (next < fat_eoc(vol))) {
+		/* Anything further isn't needed */
+		_fat_lock(vol->alloc_lock);
+		fat_set_next_cluster(vol, cluster, fat_eoc(vol));
+		_fat_unlock(vol->alloc_lock);
+		fat_chain_unlink(vol, next);
+	}
+	s->run_cluster = cluster;
+	s->run_count = 1;
+	return 0;
+}
+
+static int fat_stream_write(struct fat_file_handle *h, const uint8_t *buf,
+		int size)
+{
+	struct fat_vol_handle *vol = h->fat;
+	struct fat_stream *s = h->stream;
+	uint32_t offset = fat_cluster_offset(vol, h->position);
+	int i = 0;
+
+	if(!s->run_count && offset) {
+		/* Finish the cluster the file ends in the usual way */
+		int chunk = MIN((uint32_t)size,
+				fat_cluster_size(vol) - offset);
+		i = fat_file_write(h, buf, chunk);
+		if(i < chunk)
+			return i;
+	}
+
+	if(!s->run_count && (i < size))
+		fat_stream_attach(h);
+
+	while(i < size) {
+		uint32_t pos = s->buf_pos + s->fill;
+		uint32_t end = s->run_pos + s->run_count * fat_cluster_size(vol);
+		uint32_t chunk;
+
+		if(pos == end) {
+			int ret = fat_stream_flush(h);
+			if(ret)
+				return ret;
+			if(fat_stream_reserve(h))
+				break;
+			continue;
+		}
+
+		chunk = MIN((uint32_t)(size - i),
+				MIN(s->buf_size - s->fill, end - pos));
+		memcpy(s->buf + s->fill, buf + i, chunk);
+		s->fill += chunk;
+		i += chunk;
+		h->position = h->size = pos + chunk;
+
+		if(s->fill == s->buf_size) {
+			int ret = fat_stream_flush(h);
+			if(ret)
+				return ret;
+		}
+	}
+
+	return i;
+}
+
+static int fat_stream_begin(struct fat_file_handle *h, struct fat_stream *s,
+		void *buf, uint32_t size)
+{
+	struct fat_vol_handle *vol = h->fat;
+	struct block_device_info info;
+	uint32_t spc = FAT_SPC(vol);
+
+	size -= fat_sector_offset(vol, size);
+	if(h->root_flag || !size)
+		return -EINVAL;
+	if(FAT_RDONLY(vol))
+		return -EROFS;
+
+	_fat_lock(h->lock);
+	if(h->stream) {
+		_fat_unlock(h->lock);
+		return -EBUSY;
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->buf = buf;
+	s->buf_size = size;
+	/* Use allocation units if clusters fit evenly into them */
+	if(!block_get_info(vol->dev, &info) && info.erase_size &&
+	   !(info.erase_size % spc)) {
+		uint32_t base = (vol->first_data_sector + info.offset) %
+				info.erase_size;
+		uint32_t skip = (info.erase_size - base) % info.erase_size;
+		if(!(skip % spc)) {
+			s->au_clusters = info.erase_size / spc;
+			s->au_first = 2 + skip / spc;
+		}
+	}
+
+	_fat_lseek(h, 0, SEEK_END);
+	s->run_pos = s->buf_pos = h->position;
+	h->stream = s;
+	_fat_unlock(h->lock);
+
+	return 0;
+}
+
+static int fat_stream_end(struct fat_file_handle *h)
+{
+	struct fat_vol_handle *vol = h->fat;
+	struct fat_stream *s;
+	uint32_t used, last;
+	int ret;
+
+	_fat_lock(h->lock);
+	s = h->stream;
+	if(!s) {
+		_fat_unlock(h->lock);
+		return 0;
+	}
+
+	ret = fat_stream_flush(h);
+
+	/* Keep the clusters holding data, and like other writes one more
+	 * if the file ends on a cluster boundary.  Free the rest. */
+	used = 0;
+	if(h->size)
+		used = fat_bytes_to_clusters(vol, h->size - s->run_pos) + 1;
+	last = s->run_cluster + s->run_count - 1;
+	if(used < s->run_count) {
+		_fat_lock(vol->alloc_lock);
+		if(used)
+			fat_set_next_cluster(vol, s->run_cluster + used - 1,
+					fat_eoc(vol));
+		else if(s->prev_cluster)
+			fat_set_next_cluster(vol, s->prev_cluster,
+					fat_eoc(vol));
+		fat_set_cluster_run(vol, s->run_cluster + used, 
+				s->run_count - used, 0);
+		if(vol->last_cluster_alloc > s->run_cluster + used)
+			vol->last_cluster_alloc = s->run_cluster + used;
+		_fat_unlock(vol->alloc_lock);
+		if(!used && !s->prev_cluster)
+			h->first_cluster = 0;
+	} else if(s->run_count && (used > s->run_count)) {
+		fat_alloc_next_cluster(vol, last, 0);
+	}
+
+	h->stream = NULL;
+	h->tail_sector = 0;
+	_fat_lseek(h, 0, SEEK_END);
+	if(!ret)
+		ret = _fat_file_sync(h);
+	_fat_unlock(h->lock);
+
+	return ret;
+}
+
+int fat_file_stream(struct fat_file_handle *h, struct fat_stream *s,
+		void *buf, uint32_t size)
+{
+	int ret;
+	FAT_TRACE_START();
+
+	ret = fat_stream_begin(h, s, buf, size);
+	FAT_TRACE(STREAM, h->fat, h, NULL, size, 0, ret);
+	return ret;
+}
+
+int fat_file_stream_end(struct fat_file_handle *h)
+{
+	int ret;
+	FAT_TRACE_START();
+
+	ret = fat_stream_end(h);
+	FAT_TRACE(STREAM_END, h->fat, h, NULL, 0, 0, ret);
+	return ret;
+}
+
+static int fat_unlink_locked(struct fat_vol_handle *vol, const char *name)
 {
 	struct fat_file_handle h;
 	int ret;
 
-	ret = fat_open(vol, name, 0, &h);
+	ret = _fat_open(vol, name, 0, &h);
 	if(ret)
 		return ret;
 
@@ -298,110 +1037,268 @@ int fat_unlink(struct fat_vol_handle *vol, const char *name)
 	if(!h.dirent_sector)
 		return -EISDIR;
 
+	ret = fat_vol_dirty(vol);
+	if(ret)
+		return ret;
+
 	/* Free up cluster chain */
 	fat_chain_unlink(vol, h.first_cluster); 
 
-	/* Mark directory entry as deleted */
-	FAT_GET_SECTOR(vol, h.dirent_sector);
-	_fat_sector_buf[h.dirent_offset] = 0xE5;
-	FAT_PUT_SECTOR(vol, h.dirent_sector);
+	_fat_dir_index_remove(&vol->cwd, name);
+	_fat_dcache_drop_file(&h);
 
-	/* FIXME: Remove long name entries. */
+	/* Mark directory entries as deleted */
+	return fat_dir_delete_entry(vol, &vol->cwd, 
+				h.dirent_sector, h.dirent_offset);
+}
 
-	return 0;
+int fat_unlink(struct fat_vol_handle *vol, const char *name)
+{
+	int ret;
+	FAT_TRACE_START();
+
+	_fat_lock(vol->meta_lock);
+	ret = fat_unlink_locked(vol, name);
+	_fat_unlock(vol->meta_lock);
+	FAT_TRACE(UNLINK, vol, NULL, name, 0, 0, ret);
+
+	return ret;
 }
 
-/* Build a short name for a long name.  n is used if name is too long. */
-static void build_short_name(uint8_t *sname, const char *name, int n)
+/* Build the basis of a short name for a long name: upper case, without
+ * spaces or extra periods, with invalid characters replaced, and cut to
+ * 8.3.  Returns 1 if anything was lost, so a numeric tail is needed, 0 if
+ * the name fits exactly, or -EINVAL if nothing is left. */
+static int build_short_basis(uint8_t *basis, const char *name)
 {
-	int i, j;
+	const char *ext = strrchr(name, '.');
+	int lossy = 0, i = 0;
 
-	memset(sname, ' ', 11);
-	for(i = 0; (i < 8) && name[i] && (name[i] != '.'); i++) 
-		sname[i] = toupper(name[i]);
-	
-	char *suffix = strrchr(name, '.');
-	if(suffix) for(j = 1; (j < 4) && suffix[j]; j++) 
-		sname[j+7] = toupper(suffix[j]);
+	memset(basis, ' ', 11);
+	while(*name == '.') {
+		/* Leading periods are dropped */
+		name++;
+		lossy = 1;
+	}
+	if(ext < name)
+		ext = NULL;
+
+	for(const char *c = name; *c; c++) {
+		if(c == ext) {
+			i = 8;
+			continue;
+		}
+		if((*c == ' ') || (*c == '.')) {
+			lossy = 1;
+			continue;
+		}
+		if(((i == 8) && !ext) || (i == 11)) {
+			lossy = 1;	/* Truncated */
+			continue;
+		}
+		if(((uint8_t)*c < 0x20) || strchr("\"*+,/:;<=>?[\\]|", *c)) {
+			basis[i++] = '_';
+			lossy = 1;
+		} else {
+			basis[i++] = toupper((uint8_t)*c);
+		}
+		if((i == 8) && ext && (c + 1 != ext)) {
+			/* Skip rest of base name */
+			c = ext - 1;
+			lossy = 1;
+		}
+	}
+	if(basis[0] == ' ')
+		return -EINVAL;
+	return lossy;
+}
+
+/* Short name candidates for a basis that needs a tail.  The first few
+ * are the basis cut to 6 characters followed by ~1 to ~4.  After that, a
+ * hash of the long name is used, so names with a common prefix don't
+ * keep colliding: 2 characters, 4 hex digits and ~1 to ~9. */
+#define SNAME_SIMPLE_TAILS	4
+#define SNAME_CANDIDATES	(SNAME_SIMPLE_TAILS + 9)
+static void build_short_candidate(uint8_t *sname, const uint8_t *basis,
+		int k, uint16_t hash)
+{
+	int len, i;
 
-	if(((i == 8) && (name[i] != '.')) ||
-	   ((suffix - name) != i)) {
-		if(i > 6) 
-			i = 6;
-		sname[i] = '~';
-		sname[i+1] = '0' + (n % 10);
+	for(len = 0; (len < 8) && (basis[len] != ' '); len++)
+		;
+	memset(sname, ' ', 8);
+	memcpy(sname + 8, basis + 8, 3);
+	if(k < SNAME_SIMPLE_TAILS) {
+		i = (len > 6) ? 6 : len;
+		memcpy(sname, basis, i);
+		k++;
+	} else {
+		i = (len > 2) ? 2 : len;
+		memcpy(sname, basis, i);
+		for(int j = 12; j >= 0; j -= 4)
+			sname[i++] = "0123456789ABCDEF"[(hash >> j) & 0xF];
+		k -= SNAME_SIMPLE_TAILS - 1;
 	}
+	sname[i++] = '~';
+	sname[i] = '0' + k;
 }
 
-/* Create a new zero-length file */
+/* Fill in long name entry ord for name.  Characters after the terminating
+ * null are padded with 0xFFFF. */
+static void build_long_entry(struct fat_ldirent *ld, const char *name, 
+		int len, int ord, int last, uint8_t csum)
+{
+	memset(ld, 0, sizeof(*ld));
+	ld->ord = ord | (last ? FAT_LAST_LONG_ENTRY : 0);
+	ld->attr = FAT_ATTR_LONG_NAME;
+	ld->checksum = csum;
+	for(int j = 0; j < 13; j++) {
+		int i = (ord - 1) * 13 + j;
+		uint16_t c = (i < len) ? (uint8_t)name[i] : 
+				(i == len) ? 0 : 0xFFFF;
+		if(j < 5)
+			__put_le16(&ld->name1[j], c);
+		else if(j < 11)
+			__put_le16(&ld->name2[j - 5], c);
+		else
+			__put_le16(&ld->name3[j - 11], c);
+	}
+}
+
+/* Create a new zero-length file.  The directory is scanned once to check
+ * that name doesn't exist, see which short name candidates are taken and
+ * find space for the new entries, which are then written a sector at a
+ * time.  If name already exists, file is opened and -EEXIST returned. */
 int _fat_dir_create_file(struct fat_vol_handle *vol, const char *name,
 		uint8_t attr, struct fat_file_handle *file)
 {
-	/* Check if file already exists */
-	if(!fat_open(vol, name, 0, file)) 
-		return -1; /* File exists */
-
-	/* Attempt to construct a short name for the file */
-	uint8_t sname[12];
-	sname[11] = 0; /* fat_open() needs terminating null */
-	for(int i = 1; i < 10; i++) {
-		build_short_name(sname, name, i);
-		if(fat_open(vol, (char*)sname, 0, file)) 
-			break; /* We have a winner */
-		sname[0] = ' ';
-	}
-
-	if(sname[0] == ' ')
-		return -1; /* Couldn't find a short name */
-
-	/* Find usable space in parent directory */
-	_fat_dir_seek_empty(&vol->cwd, (strlen(name) / 13) + 2);
-
-	/* Create long name directory entries */
-	struct fat_ldirent ld;
-	int last = 1;
-	memset(&ld, 0, sizeof(ld));
-	ld.attr = FAT_ATTR_LONG_NAME;
-	for(int i = strlen(name) / 13; i >= 0; i--) {
-		ld.ord = i + 1;
-		if(last) {
-			ld.ord |= FAT_LAST_LONG_ENTRY;
-			last = 0;
-		}
-		int j;
-		for(j = 0; j < 5; j++) 
-			__put_le16(&ld.name1[j], name[i*13 + j]);
-		for(j = 0; j < 6; j++) 
-			__put_le16(&ld.name2[j], name[i*13 + j + 5]);
-		for(j = 0; j < 2; j++) 
-			__put_le16(&ld.name3[j], name[i*13 + j + 11]);
-		ld.checksum = _fat_dirent_chksum(sname);
-		if(fat_write(&vol->cwd, &ld, sizeof(ld)) != sizeof(ld))
-			return -1;
+	struct fat_file_handle *dir = &vol->cwd;
+	struct fat_dir_scan scan;
+	struct fat_sdirent fatent;
+	uint8_t cand[SNAME_CANDIDATES][11];
+	uint8_t *sname;
+	uint8_t csum;
+	uint32_t sector, pos_cluster, dirent_sector = 0;
+	uint16_t offset, dirent_offset = 0;
+	int len = strlen(name);
+	int entries = (len + 12) / 13 + 1;
+	int ncand = 0, ret, i;
+
+	if(!len || strchr(name, '/'))
+		return -EINVAL;
+	if(len > 255)
+		return -ENAMETOOLONG;
+
+	ret = build_short_basis(cand[0], name);
+	if(ret < 0)
+		return ret;
+	if(ret) {
+		uint32_t hash = _fat_name_hash(name);
+		uint8_t basis[11];
+		memcpy(basis, cand[0], 11);
+		for(ncand = 0; ncand < SNAME_CANDIDATES; ncand++)
+			build_short_candidate(cand[ncand], basis, ncand, 
+					hash ^ (hash >> 16));
+	}
+
+	ret = _fat_dir_scan(dir, name, 
+			(const uint8_t (*)[11])cand, ncand, entries, &scan);
+	if(ret)
+		return ret;
+
+	if(scan.found) {
+		_fat_dir_open_entry(vol, &scan.fatent, scan.sector, 
+					scan.offset, file);
+		return -EEXIST;
+	}
+
+	/* Use the first candidate not taken by another short name */
+	sname = cand[0];
+	if(ncand) {
+		for(i = 0; (i < ncand) && (scan.taken & (1 << i)); i++)
+			;
+		if(i == ncand)
+			return -ENOSPC; /* Couldn't find a short name */
+		sname = cand[i];
+	}
+
+	/* Don't write past end of FAT12/FAT16 root directory! */
+	if(dir->root_flag && 
+	   ((scan.free_pos + entries * sizeof(fatent)) > dir->size))
+		return -ENOSPC;
+
+	ret = fat_vol_dirty(vol);
+	if(ret)
+		return ret;
+
+	dir->position = scan.free_pos;
+	dir->cur_cluster = scan.free_cluster;
+	if(!dir->cur_cluster) {
+		/* Directory is full, add a cluster */
+		dir->cur_cluster = fat_alloc_next_cluster(vol, 
+					scan.last_cluster, 1);
+		if(!dir->cur_cluster)
+			return -ENOSPC;
 	}
+	pos_cluster = dir->cur_cluster;
 
 	/* Create short name entry */
-	struct fat_sdirent fatent;
 	memset(&fatent, 0, sizeof(fatent));
 	fatent.attr = attr;
 	memcpy(&fatent.name, sname, 11);
 	/* TODO: Insert timestamp */
 	if(attr == FAT_ATTR_DIRECTORY) {
 		/* Allocate a cluster for directories */
-		uint32_t cluster = fat_find_free_cluster(vol);
+		uint32_t cluster = fat_alloc_cluster(vol);
 		if(!cluster) 
-			return -1;
-		fat_set_next_cluster(vol, cluster, fat_eoc(vol));
+			return -ENOSPC;
 		__put_le16(&fatent.cluster_hi, cluster >> 16);
 		__put_le16(&fatent.cluster_lo, cluster & 0xFFFF);
+		_fat_dir_index_drop(vol, cluster);
+		_fat_dcache_drop_dir(vol, cluster);
+	}
+
+	/* Write long name entries followed by the short entry, filling
+	 * each sector in the buffer before it is written back. */
+	csum = _fat_dirent_chksum(sname);
+	for(i = 0; i < entries; ) {
+		if(i && !dir->root_flag && 
+		   !fat_cluster_offset(vol, dir->position)) {
+			/* Go to next cluster, extending directory */
+			uint32_t next = fat_alloc_next_cluster(vol, 
+						dir->cur_cluster, 1);
+			if(!next)
+				return -ENOSPC;
+			dir->cur_cluster = next;
+		}
+		_fat_file_sector_offset(dir, &sector, &offset);
+		FAT_CACHE_LOCK();
+		FAT_GET_SECTOR(vol, sector);
+		do {
+			void *ent = _fat_sector_buf + offset;
+			if(i == entries - 1) {
+				memcpy(ent, &fatent, sizeof(fatent));
+				dirent_sector = sector;
+				dirent_offset = offset;
+			} else {
+				build_long_entry(ent, name, len, 
+					entries - 1 - i, i == 0, csum);
+			}
+			offset += sizeof(fatent);
+			dir->position += sizeof(fatent);
+		} while((++i < entries) && (offset < FAT_BPS(vol)));
+		FAT_PUT_SECTOR(vol, sector);
+		FAT_CACHE_UNLOCK();
 	}
-	if(fat_write(&vol->cwd, &fatent, sizeof(fatent)) != sizeof(fatent))
-		return -1;
 
-	return fat_open(vol, name, 0, file);
+	_fat_dir_index_insert(dir, name, sname, scan.free_pos, pos_cluster);
+	_fat_dcache_drop_negative(vol, fat_dir_key(dir));
+
+	_fat_dir_open_entry(vol, &fatent, dirent_sector, dirent_offset, file);
+	return 0;
 }
 
-int fat_mkdir(struct fat_vol_handle *vol, const char *name)
+static int fat_mkdir_locked(struct fat_vol_handle *vol, const char *name)
 {
 	int ret;
 	struct fat_file_handle dir;
@@ -410,12 +1307,14 @@ int fat_mkdir(struct fat_vol_handle *vol, const char *name)
 	if(ret) 
 		return ret;
 
+	FAT_CACHE_LOCK();
 	FAT_FLUSH_SECTOR();
 	/* Clear out cluster */
-	memset(_fat_sector_buf, 0, vol->bytes_per_sector);
+	memset(_fat_sector_buf, 0, FAT_BPS(vol));
 	uint32_t sector = fat_first_sector_of_cluster(vol, dir.first_cluster);
-	for(int i = 0; i < vol->sectors_per_cluster; i++) 
+	for(int i = 0; i < FAT_SPC(vol); i++) 
 		FAT_PUT_SECTOR(vol, sector + i);
+	FAT_CACHE_UNLOCK();
 
 	memset(&fatent, 0, sizeof(fatent));
 	fatent.attr = FAT_ATTR_DIRECTORY;
@@ -425,7 +1324,7 @@ int fat_mkdir(struct fat_vol_handle *vol, const char *name)
 	fatent.name[0] = '.';
 	__put_le16(&fatent.cluster_hi, dir.first_cluster >> 16);
 	__put_le16(&fatent.cluster_lo, dir.first_cluster & 0xFFFF);
-	ret = fat_write(&dir, &fatent, sizeof(fatent));
+	ret = _fat_write(&dir, &fatent, sizeof(fatent));
 	if(ret < 0) 
 		return ret;
 
@@ -439,15 +1338,210 @@ int fat_mkdir(struct fat_vol_handle *vol, const char *name)
 		fatent.cluster_hi = 0;
 		fatent.cluster_lo = 0;
 	}
-	ret = fat_write(&dir, &fatent, sizeof(fatent));
+	ret = _fat_write(&dir, &fatent, sizeof(fatent));
 	return (ret < 0) ? ret : 0;
 }
 
+int fat_mkdir(struct fat_vol_handle *vol, const char *name)
+{
+	int ret;
+	FAT_TRACE_START();
+
+	_fat_lock(vol->meta_lock);
+	ret = fat_mkdir_locked(vol, name);
+	_fat_unlock(vol->meta_lock);
+	FAT_TRACE(MKDIR, vol, NULL, name, 0, 0, ret);
+
+	return ret;
+}
+
 int fat_create(struct fat_vol_handle *vol, const char *name, int flags,
 		  struct fat_file_handle *file)
 {
-	int ret = _fat_dir_create_file(vol, name, FAT_ATTR_ARCHIVE, file);
-	file->flags = flags;
+	int ret;
+	FAT_TRACE_START();
+
+	_fat_lock(vol->meta_lock);
+	ret = _fat_open(vol, name, flags | O_CREAT | O_EXCL, file);
+	_fat_unlock(vol->meta_lock);
+	FAT_TRACE(CREATE, vol, file, name, flags, 0, ret);
+
 	return ret;
 }
 
+
+/* Check that the long name entry just read from rd starts a complete long
+ * name followed by its short entry.  Returns the number of entries in the
+ * group, or 0 if the entry is orphaned, in which case rd is left at the
+ * entry that broke the group. */
+static int fat_dir_check_group(struct fat_file_handle *rd, 
+		const struct fat_sdirent *first)
+{
+	const struct fat_ldirent *ld = (const void*)first;
+	struct fat_file_handle save;
+	struct fat_sdirent ent;
+	uint8_t csum = ld->checksum;
+	int n = ld->ord & 0x3f;
+
+	if(!(ld->ord & FAT_LAST_LONG_ENTRY) || !n)
+		return 0;
+
+	for(int i = n - 1; i >= 0; i--) {
+		if(!rd->root_flag && (rd->cur_cluster >= fat_eoc(rd->fat)))
+			return 0;
+		memcpy(&save, rd, sizeof(save));
+		if(_fat_read(rd, &ent, sizeof(ent)) != sizeof(ent))
+			return 0;
+		ld = (const void*)&ent;
+		if(i ? ((ent.attr != FAT_ATTR_LONG_NAME) || 
+			(ld->ord != i) || (ld->checksum != csum)) :
+		       ((ent.attr == FAT_ATTR_LONG_NAME) || 
+			(ent.name[0] == 0) || (ent.name[0] == (char)0xE5) ||
+			(_fat_dirent_chksum((uint8_t*)ent.name) != csum))) {
+			memcpy(rd, &save, sizeof(save));
+			return 0;
+		}
+	}
+	return n + 1;
+}
+
+/* Move the directory entry at rd to wr, updating any of the open files 
+ * that refer to it. */
+static int fat_dir_move_entry(struct fat_file_handle *rd, 
+		struct fat_file_handle *wr, 
+		struct fat_file_handle **files, int nfiles)
+{
+	struct fat_sdirent ent;
+	uint32_t rsector, wsector;
+	uint16_t roffset, woffset;
+
+	_fat_file_sector_offset(rd, &rsector, &roffset);
+	if(_fat_read(rd, &ent, sizeof(ent)) != sizeof(ent))
+		return -EIO;
+	_fat_file_sector_offset(wr, &wsector, &woffset);
+	if(_fat_write(wr, &ent, sizeof(ent)) != sizeof(ent))
+		return -EIO;
+
+	for(int i = 0; i < nfiles; i++) {
+		if((files[i]->dirent_sector == rsector) && 
+		   (files[i]->dirent_offset == roffset)) {
+			files[i]->dirent_sector = wsector;
+			files[i]->dirent_offset = woffset;
+		}
+	}
+	return 0;
+}
+
+static int fat_dir_compact_locked(struct fat_vol_handle *vol, 
+		const char *name, struct fat_file_handle **files, int nfiles)
+{
+	uint32_t cluster_size = fat_cluster_size(vol);
+	struct fat_file_handle dir, rd, wr, grp;
+	struct fat_sdirent ent;
+	uint32_t end, cluster;
+	int ret, n;
+
+	ret = _fat_open(vol, name, 0, &dir);
+	if(ret)
+		return ret;
+	if(dir.dirent_sector)
+		return -ENOTDIR;
+
+	ret = fat_vol_dirty(vol);
+	if(ret)
+		return ret;
+
+	memcpy(&rd, &dir, sizeof(dir));
+	memcpy(&wr, &dir, sizeof(dir));
+
+	/* Move live entries down over deleted ones.  Long name entries are
+	 * only moved together with their short entry, orphans are dropped. */
+	for(;;) {
+		if(!rd.root_flag && (rd.cur_cluster >= fat_eoc(vol)))
+			break;
+		memcpy(&grp, &rd, sizeof(grp));
+		ret = _fat_read(&rd, &ent, sizeof(ent));
+		if(ret < 0)
+			return ret;
+		if((ret != sizeof(ent)) || (ent.name[0] == 0))
+			break;	/* End of directory */
+		if(ent.name[0] == (char)0xE5)
+			continue;
+		n = 1;
+		if(ent.attr == FAT_ATTR_LONG_NAME) {
+			n = fat_dir_check_group(&rd, &ent);
+			if(!n)
+				continue;
+		}
+		if(grp.position == wr.position) {
+			/* Nothing deleted yet, leave in place */
+			memcpy(&wr, &rd, sizeof(wr));
+			continue;
+		}
+		while(n--) {
+			ret = fat_dir_move_entry(&grp, &wr, files, nfiles);
+			if(ret)
+				return ret;
+		}
+	}
+	end = rd.position;
+
+	_fat_dir_index_drop(vol, fat_dir_key(&dir));
+	_fat_dcache_drop_dir(vol, fat_dir_key(&dir));
+
+	if(!wr.root_flag && (wr.cur_cluster >= fat_eoc(vol)))
+		return 0; /* Directory was full */
+
+	/* Clear old entries up to the end of the last cluster kept.  The
+	 * sectors are written directly, writing the last entry of the
+	 * cluster through the file would extend the directory. */
+	cluster = wr.cur_cluster;
+	if(!wr.root_flag) {
+		uint32_t cluster_end = wr.position - 
+			fat_cluster_offset(vol, wr.position) + cluster_size;
+		if(end > cluster_end)
+			end = cluster_end;
+	}
+	while(wr.position < end) {
+		uint32_t sector;
+		uint16_t offset, len;
+		_fat_file_sector_offset(&wr, &sector, &offset);
+		len = FAT_BPS(vol) - offset;
+		if(len > end - wr.position)
+			len = end - wr.position;
+		FAT_CACHE_LOCK();
+		FAT_GET_SECTOR(vol, sector);
+		memset(_fat_sector_buf + offset, 0, len);
+		FAT_PUT_SECTOR(vol, sector);
+		FAT_CACHE_UNLOCK();
+		wr.position += len;
+	}
+
+	if(wr.root_flag) 
+		return 0;
+
+	/* Free clusters after the last one kept */
+	uint32_t next = _fat_get_next_cluster(vol, cluster);
+	if((next >= 2) && (next < fat_eoc(vol))) {
+		fat_set_next_cluster(vol, cluster, fat_eoc(vol));
+		fat_chain_unlink(vol, next);
+	}
+	FAT_CACHE_LOCK();
+	FAT_FLUSH_SECTOR();
+	FAT_CACHE_UNLOCK();
+	return 0;
+}
+
+int fat_dir_compact(struct fat_vol_handle *vol, const char *name,
+		struct fat_file_handle **files, int nfiles)
+{
+	int ret;
+	FAT_TRACE_START();
+
+	_fat_lock(vol->meta_lock);
+	ret = fat_dir_compact_locked(vol, name, files, nfiles);
+	_fat_unlock(vol->meta_lock);
+	FAT_TRACE(COMPACT, vol, NULL, name, nfiles, 0, ret);
+
+	return ret;
+}
@@ -19,100 +19,133 @@
  */
 
 /* MMC Card interface implementation.
+ * The card protocol in SPI mode.  The SPI port itself is reached through
+ * struct mmc_spi_ops, so this also runs against a simulated card.
  */
 
-#include <libopencm3/stm32/gpio.h>
-#include <libopencm3/stm32/spi.h>
-
 #include <stdint.h>
 #include <string.h>
 
 #include "mmc.h"
-#include "openfat/leaccess.h"
 
 #define MMC_SECTOR_SIZE		512
 
-static uint8_t spi_readwrite(uint32_t spi, uint8_t data)
+/* Polling limits, in bytes clocked */
+#define MMC_NCR_MAX		16	/* Command response */
+#define MMC_TOKEN_TIMEOUT	100000	/* Start of read data */
+#define MMC_BUSY_TIMEOUT	1000000	/* Programming or erasing */
+#define MMC_INIT_RETRIES	10000
+
+#define R1_IDLE			0x01
+#define R1_ILLEGAL_COMMAND	0x04
+
+#define TOKEN_START_BLOCK	0xFE	/* Reads and single block write */
+#define TOKEN_START_MULTI_WRITE	0xFC
+#define TOKEN_STOP_MULTI_WRITE	0xFD
+
+#define DATA_RESPONSE_MASK	0x1F
+#define DATA_ACCEPTED		0x05
+
+static inline uint8_t mmc_xfer(const struct mmc_port *mmc, uint8_t data)
 {
-	while(SPI_SR(spi) & SPI_SR_BSY);
-	SPI_DR(spi) = data;
-	while(!(SPI_SR(spi) & SPI_SR_RXNE));
-	return SPI_DR(spi);
+	return mmc->ops->xfer(mmc, data);
+}
+
+/* Wait for the card to stop holding the data line low.
+ * Returns 0 when ready, or -1 on timeout. */
+static int mmc_wait_ready(const struct mmc_port *mmc)
+{
+	for(uint32_t i = 0; i < MMC_BUSY_TIMEOUT; i++)
+		if(mmc_xfer(mmc, 0xFF) == 0xFF)
+			return 0;
+	return -1;
 }
 
 static void mmc_select(const struct mmc_port *mmc)
 {
-	gpio_clear(mmc->cs_port, mmc->cs_pin);
-	/* Wait for not busy */
-	while(spi_readwrite(mmc->spi, 0xFF) == 0);
+	mmc->ops->chip_select(mmc, 1);
+	mmc_wait_ready(mmc);
 }
 
 static void mmc_release(const struct mmc_port *mmc)
 {
-	gpio_set(mmc->cs_port, mmc->cs_pin);
+	mmc->ops->chip_select(mmc, 0);
 	/* Must cycle clock 8 times after CS is released */
-	spi_readwrite(mmc->spi, 0xFF);
+	mmc_xfer(mmc, 0xFF);
 }
 
 static void 
 mmc_write_buffer(const struct mmc_port *mmc, const uint8_t *buf, int len)
 {
+	if(mmc->ops->write_buf) {
+		mmc->ops->write_buf(mmc, buf, len);
+		return;
+	}
 	while(len--)
-		spi_readwrite(mmc->spi, *buf++);
+		mmc_xfer(mmc, *buf++);
 }
 
 static void 
 mmc_read_buffer(const struct mmc_port *mmc, uint8_t *buf, int len)
 {
+	if(mmc->ops->read_buf) {
+		mmc->ops->read_buf(mmc, buf, len);
+		return;
+	}
 	while(len--)
-		*buf++ = spi_readwrite(mmc->spi, 0xFF);
+		*buf++ = mmc_xfer(mmc, 0xFF);
 }
 
-#define TOKEN_START_SINGLE_READ		0xFE
-#define TOKEN_START_MULTI_READ		0xFE
-#define TOKEN_START_SINGLE_WRITE	0xFE
-#define TOKEN_START_MULTI_WRITE		0xFD
-#define TOKEN_STOP_MULTI_WRITE		0xFC
-
 static int
 mmc_receive_block(const struct mmc_port *mmc, uint8_t *buf, int len)
 {
+	uint8_t token;
+	uint32_t i = 0;
+
 	/* wait for token */
-	while((*buf = spi_readwrite(mmc->spi, 0xFF)) == 0xFF);
+	while((token = mmc_xfer(mmc, 0xFF)) == 0xFF)
+		if(++i == MMC_TOKEN_TIMEOUT)
+			return -1;
 
-	if(*buf != TOKEN_START_SINGLE_READ) /* Start data token */
+	if(token != TOKEN_START_BLOCK) /* Error token */
 		return -1;
 
 	mmc_read_buffer(mmc, buf, len);
 
 	/* Discard CRC bytes */
-	spi_readwrite(mmc->spi, 0xFF);
-	spi_readwrite(mmc->spi, 0xFF);
+	mmc_xfer(mmc, 0xFF);
+	mmc_xfer(mmc, 0xFF);
 	
 	return 0;
-
 }
 
+/* Send a data block and wait for it to be programmed.  Returns 0 if the
+ * card accepted the data. */
 static int
-mmc_transmit_block(const struct mmc_port *mmc, const uint8_t *buf, int len)
+mmc_transmit_block(const struct mmc_port *mmc, uint8_t token, 
+		const uint8_t *buf, int len)
 {
-	/* wait for not busy */
-	while(spi_readwrite(mmc->spi, 0xFF) != 0xFF);
+	uint8_t resp;
 
 	/* Send token */
-	spi_readwrite(mmc->spi, TOKEN_START_SINGLE_WRITE);
+	mmc_xfer(mmc, token);
 
 	/* Sent data frame */
 	mmc_write_buffer(mmc, buf, len);
 
 	/* Send dummy CRC bytes */
-	spi_readwrite(mmc->spi, 0xFF);
-	spi_readwrite(mmc->spi, 0xFF);
+	mmc_xfer(mmc, 0xFF);
+	mmc_xfer(mmc, 0xFF);
+
+	resp = mmc_xfer(mmc, 0xFF);
+	if((resp & DATA_RESPONSE_MASK) != DATA_ACCEPTED)
+		return -1;
 
-	/* Return response code, zero on no error */
-	return spi_readwrite(mmc->spi, 0xFF);
+	return mmc_wait_ready(mmc);
 }
 
+/* Send a command to a selected card.  Returns the R1 response, or 0xFF
+ * if there was none. */
 static uint8_t
 mmc_command(const struct mmc_port *mmc, uint8_t cmd, uint32_t arg)
 {
@@ -125,16 +158,38 @@ mmc_command(const struct mmc_port *mmc, uint8_t cmd, uint32_t arg)
 	buf[2] = (arg >> 16) & 0xFF;
 	buf[3] = (arg >> 8) & 0xFF;
 	buf[4] = arg & 0xFF;
-	buf[5] = (cmd == MMC_GO_IDLE_STATE) ? 0x95 : 1; /* CRC here */
+	/* CRC is only checked for these before SPI mode is entered */
+	buf[5] = (cmd == MMC_GO_IDLE_STATE) ? 0x95 : 
+		 (cmd == MMC_SEND_IF_COND) ? 0x87 : 1;
 
-	mmc_select(mmc);
 	mmc_write_buffer(mmc, buf, sizeof(buf));
 
-	do { /* Wait for response byte */
-		ret = spi_readwrite(mmc->spi, 0xFF);
-	} while(ret & 0x80);
+	if(cmd == MMC_STOP_TRANSMISSION)
+		mmc_xfer(mmc, 0xFF); /* Discard stuff byte */
 
-	return ret;
+	for(int i = 0; i < MMC_NCR_MAX; i++) { /* Wait for response byte */
+		ret = mmc_xfer(mmc, 0xFF);
+		if(!(ret & 0x80))
+			return ret;
+	}
+
+	return 0xFF;
+}
+
+static uint8_t
+mmc_app_command(const struct mmc_port *mmc, uint8_t cmd, uint32_t arg)
+{
+	uint8_t ret = mmc_command(mmc, MMC_APP_CMD, 0);
+
+	if(ret & ~R1_IDLE)
+		return ret;
+	return mmc_command(mmc, cmd, arg);
+}
+
+/* Card address of a sector, SDHC cards are addressed in blocks */
+static inline uint32_t mmc_addr(const struct mmc_port *mmc, uint32_t sector)
+{
+	return mmc->block_addr ? sector : sector * MMC_SECTOR_SIZE;
 }
 
 static uint16_t mmc_get_sector_size(const struct block_device *dev)
@@ -143,115 +198,213 @@ static uint16_t mmc_get_sector_size(const struct block_device *dev)
 	return MMC_SECTOR_SIZE;
 }
 
+static int mmc_get_info(const struct block_device *dev,
+		struct block_device_info *info)
+{
+	const struct mmc_port *mmc = (void*)dev;
+
+	info->sector_count = mmc->sector_count;
+	info->erase_size = mmc->au_sectors;
+
+	return 0;
+}
+
 static int mmc_read_sectors(const struct block_device *bldev,
 		uint32_t sector, uint32_t count, void *buf)
 {
 	const struct mmc_port *mmc = (void*)bldev;
-	uint32_t i;
+	uint32_t i = 0;
  
 	mmc_select(mmc);
-	for(i = 0; i < count; i++) {
-		mmc_command(mmc, MMC_READ_SINGLE_BLOCK, 
-				(sector + i) * MMC_SECTOR_SIZE);
-		mmc_receive_block(mmc, buf, MMC_SECTOR_SIZE);
-		buf += MMC_SECTOR_SIZE;
+	if(count == 1) {
+		if((mmc_command(mmc, MMC_READ_SINGLE_BLOCK, 
+				mmc_addr(mmc, sector)) == 0) &&
+		   (mmc_receive_block(mmc, buf, MMC_SECTOR_SIZE) == 0))
+			i = 1;
+	} else if(mmc_command(mmc, MMC_READ_MULTIPLE_BLOCK, 
+				mmc_addr(mmc, sector)) == 0) {
+		for(i = 0; i < count; i++) {
+			if(mmc_receive_block(mmc, buf, MMC_SECTOR_SIZE))
+				break;
+			buf += MMC_SECTOR_SIZE;
+		}
+		mmc_command(mmc, MMC_STOP_TRANSMISSION, 0);
+		mmc_wait_ready(mmc);
 	}
 	mmc_release(mmc);
 
-	return i;
+	return (i || !count) ? (int)i : -1;
 }
 
 static int mmc_write_sectors(const struct block_device *bldev,
 		uint32_t sector, uint32_t count, const void *buf)
 {
 	const struct mmc_port *mmc = (void*)bldev;
-	uint32_t i;
+	uint32_t i = 0;
  
 	mmc_select(mmc);
-	for(i = 0; i < count; i++) {
-		mmc_command(mmc, MMC_WRITE_BLOCK, 
-				(sector + i) * MMC_SECTOR_SIZE);
-		mmc_transmit_block(mmc, buf, MMC_SECTOR_SIZE);
-		buf += MMC_SECTOR_SIZE;
+	if(count == 1) {
+		if((mmc_command(mmc, MMC_WRITE_BLOCK, 
+				mmc_addr(mmc, sector)) == 0) &&
+		   (mmc_transmit_block(mmc, TOKEN_START_BLOCK, 
+				buf, MMC_SECTOR_SIZE) == 0))
+			i = 1;
+	} else {
+		/* Let SD cards erase the whole range in advance */
+		if(mmc->type != MMC_TYPE_MMC)
+			mmc_app_command(mmc, SD_SET_WR_BLK_ERASE_COUNT, count);
+		if(mmc_command(mmc, MMC_WRITE_MULTIPLE_BLOCK, 
+				mmc_addr(mmc, sector)) == 0) {
+			for(i = 0; i < count; i++) {
+				if(mmc_transmit_block(mmc, 
+						TOKEN_START_MULTI_WRITE, 
+						buf, MMC_SECTOR_SIZE))
+					break;
+				buf += MMC_SECTOR_SIZE;
+			}
+			mmc_xfer(mmc, TOKEN_STOP_MULTI_WRITE);
+			mmc_xfer(mmc, 0xFF);
+			mmc_wait_ready(mmc);
+		}
 	}
 	mmc_release(mmc);
 
-	return i;
+	return (i || !count) ? (int)i : -1;
 }
 
-int 
-mmc_init(uint32_t spi, uint32_t cs_port, uint16_t cs_pin, struct mmc_port *mmc)
+/* Number of 512 byte sectors on the card, from the CSD register */
+static uint32_t mmc_csd_sectors(const uint8_t *csd)
 {
-	uint8_t ocr[4];
-
-	/* Intialise structure */
-	memset(mmc, 0, sizeof(*mmc));
-
-	/* Block device methods */
-	mmc->bldev.get_sector_size = mmc_get_sector_size;
-	mmc->bldev.read_sectors = mmc_read_sectors;
-	mmc->bldev.write_sectors = mmc_write_sectors;
+	if((csd[0] >> 6) == 1) { /* CSD version 2.0, SDHC/SDXC */
+		uint32_t c_size = ((csd[7] & 0x3F) << 16) | 
+				(csd[8] << 8) | csd[9];
+		return (c_size + 1) << 10;
+	} else {
+		uint32_t read_bl_len = csd[5] & 0x0F;
+		uint32_t c_size = (csd[8] >> 6) + (csd[7] << 2) + 
+				((csd[6] & 0x03) << 10);
+		uint32_t c_size_mult = ((csd[10] & 0x80) >> 7) + 
+				((csd[9] & 0x03) << 1);
+		return (c_size + 1) << (c_size_mult + 2 + read_bl_len - 9);
+	}
+}
 
-	mmc->spi = spi;
-	mmc->cs_port = cs_port;
-	mmc->cs_pin = cs_pin;
-
-	/* Do hardware init */
-	/* Peripheral clocks must already be enabled.  
-	 * SPI pins must already be configured. */
-	spi_init_master(mmc->spi, 
-			SPI_CR1_BAUDRATE_FPCLK_DIV_2, 
-			SPI_CR1_CPOL_CLK_TO_1_WHEN_IDLE, 
-			SPI_CR1_CPHA_CLK_TRANSITION_2, 
-			SPI_CR1_CRCL_8BIT,
-			SPI_CR1_MSBFIRST);
-	/* Ignore the stupid NSS pin */
-	spi_enable_software_slave_management(mmc->spi);
-	spi_set_nss_high(mmc->spi);
-
-	spi_enable(mmc->spi);
-
-	/* SD nCS pin init */
-	gpio_mode_setup(mmc->cs_port, GPIO_MODE_OUTPUT, 
-			GPIO_PUPD_NONE, mmc->cs_pin);
+/* Allocation unit size in sectors, from the SD status register */
+static uint32_t mmc_sd_au_sectors(const uint8_t *status)
+{
+	static const uint32_t large_au[] = {
+		16384, 24576, 32768, 49152, 65536, 131072,
+	};
+	uint8_t au_size = status[10] >> 4;
+
+	if(!au_size)
+		return 0;
+	if(au_size <= 9)
+		return 32 << (au_size - 1);
+	return large_au[au_size - 10];
+}
 
-	/* Do card init ... */
-	for(int i = 0 ; i < 80; i++) spi_readwrite(mmc->spi, 0xff);
+static int mmc_identify(struct mmc_port *mmc)
+{
+	uint8_t ocr[4];
+	uint8_t csd[16];
+	uint8_t ret;
+	int i;
 
-	if(mmc_command(mmc, MMC_GO_IDLE_STATE, 0) != 1) 
+	if(mmc_command(mmc, MMC_GO_IDLE_STATE, 0) != R1_IDLE) 
 		return -1; /* Can't reset card? */
 
+	/* SD version 2 cards echo the check pattern */
+	ret = mmc_command(mmc, MMC_SEND_IF_COND, 0x1AA);
+	if(ret == R1_IDLE) {
+		mmc_read_buffer(mmc, ocr, sizeof(ocr));
+		if(((ocr[2] & 0x0F) != 0x01) || (ocr[3] != 0xAA))
+			return -1; /* Voltage range not supported */
+		mmc->type = MMC_TYPE_SD2;
+	} else if(ret & R1_ILLEGAL_COMMAND) {
+		mmc->type = MMC_TYPE_SD1;
+	} else {
+		return -1;
+	}
+
 	/* Wait for card to initialize */
-	while(mmc_command(mmc, MMC_SEND_OP_COND, 0) != 0);
+	for(i = 0; i < MMC_INIT_RETRIES; i++) {
+		if(mmc->type == MMC_TYPE_MMC) {
+			ret = mmc_command(mmc, MMC_SEND_OP_COND, 0);
+		} else {
+			/* Tell SD 2 cards high capacity is supported */
+			ret = mmc_app_command(mmc, SD_SEND_OP_COND, 
+				(mmc->type == MMC_TYPE_SD2) ? 0x40000000 : 0);
+			if((ret & R1_ILLEGAL_COMMAND) && 
+			   (mmc->type == MMC_TYPE_SD1)) {
+				/* Not an SD card */
+				mmc->type = MMC_TYPE_MMC;
+				continue;
+			}
+		}
+		if(ret != R1_IDLE)
+			break;
+	}
+	if(ret != 0)
+		return -1;
 
-	if(mmc_command(mmc, MMC_READ_OCR, 0) != 0) 
-		return -1; /* Can't read OCR? */
+	if(mmc->type == MMC_TYPE_SD2) {
+		if(mmc_command(mmc, MMC_READ_OCR, 0) != 0) 
+			return -1; /* Can't read OCR? */
+		mmc_read_buffer(mmc, ocr, sizeof(ocr));
+		/* Card capacity status bit */
+		mmc->block_addr = (ocr[0] & 0x40) ? 1 : 0;
+	}
 
-	mmc_read_buffer(mmc, ocr, sizeof(ocr));
-	/* FIXME: Check OCR for acceptable voltage range... */
+	/* SDHC cards have fixed 512 byte blocks, older cards default to
+	 * this after reset, but set it anyway. */
+	if(!mmc->block_addr && 
+	   (mmc_command(mmc, MMC_SET_BLOCKLEN, MMC_SECTOR_SIZE) != 0))
+		return -1;
 
-	
-	/* All cards support 512 byte block access and this is the default
-	 * after reset.  If disk size or other info is needed this can
-	 * be read from CSD in future.
-	 */
-	if(0) {
-		uint8_t csd[16];
-		if(mmc_command(mmc, MMC_SEND_CSD, 0) != 0) 
-			return -1; /* Can't read CSD? */
-		mmc_receive_block(mmc, csd, sizeof(csd));
+	if((mmc_command(mmc, MMC_SEND_CSD, 0) == 0) &&
+	   (mmc_receive_block(mmc, csd, sizeof(csd)) == 0))
+		mmc->sector_count = mmc_csd_sectors(csd);
 
-		uint32_t read_bl_len = csd[5] & 0x0F;
-		uint32_t c_size = (csd[8] >> 6) + (csd[7] << 3) + 
-				((csd[6] & 0x03) << 10);
-		uint32_t c_size_mult = ((csd[10] & 0x80) >> 7) + 
-				((csd[9] & 0x03) << 1);
-		uint32_t blocknr = (c_size + 1) << (c_size_mult + 2 + read_bl_len);
-		(void)blocknr;
+	if((mmc->type != MMC_TYPE_MMC) && 
+	   (mmc_app_command(mmc, SD_STATUS, 0) == 0)) {
+		uint8_t status[64];
+		mmc_xfer(mmc, 0xFF); /* Second byte of R2 */
+		if(mmc_receive_block(mmc, status, sizeof(status)) == 0)
+			mmc->au_sectors = mmc_sd_au_sectors(status);
 	}
 
-	mmc_release(mmc);
-
 	return 0;
 }
 
+int mmc_card_init(struct mmc_port *mmc, const struct mmc_spi_ops *ops,
+		void *priv)
+{
+	int ret;
+
+	/* Block device methods */
+	mmc->bldev.get_sector_size = mmc_get_sector_size;
+	mmc->bldev.read_sectors = mmc_read_sectors;
+	mmc->bldev.write_sectors = mmc_write_sectors;
+	mmc->bldev.get_sector_ptr = NULL;
+	mmc->bldev.get_info = mmc_get_info;
+
+	mmc->ops = ops;
+	mmc->priv = priv;
+	mmc->type = 0;
+	mmc->block_addr = 0;
+	mmc->sector_count = 0;
+	mmc->au_sectors = 0;
+
+	/* Do card init ... */
+	/* At least 74 clocks with chip select released */
+	mmc->ops->chip_select(mmc, 0);
+	for(int i = 0 ; i < 10; i++) 
+		mmc_xfer(mmc, 0xFF);
+
+	mmc->ops->chip_select(mmc, 1);
+	ret = mmc_identify(mmc);
+	mmc_release(mmc);
+
+	return ret;
+}
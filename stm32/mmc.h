@@ -28,29 +28,57 @@
 
 #include "openfat/blockdev.h"
 
+struct mmc_port;
+
+/* SPI transport used by the card driver. */
+struct mmc_spi_ops {
+	/* Send a byte and return the byte received */
+	uint8_t (*xfer)(const struct mmc_port *mmc, uint8_t data);
+	/* Assert chip select if select is non-zero, else release it */
+	void (*chip_select)(const struct mmc_port *mmc, int select);
+	/* Optional block transfers, clocking out 0xFF when reading.
+	 * Byte transfers are used if NULL. */
+	void (*read_buf)(const struct mmc_port *mmc, uint8_t *buf, int len);
+	void (*write_buf)(const struct mmc_port *mmc, 
+			const uint8_t *buf, int len);
+};
+
+#define MMC_TYPE_MMC	1
+#define MMC_TYPE_SD1	2	/* SD version 1 */
+#define MMC_TYPE_SD2	3	/* SD version 2 or later */
+
 struct mmc_port {
 	struct block_device bldev;
-	/* Physical hardware config */
+	/* SPI transport, with private data for the transport */
+	const struct mmc_spi_ops *ops;
+	void *priv;
+	/* Physical hardware config, for the STM32 transport */
 	uint32_t spi;
 	uint32_t cs_port;
 	uint16_t cs_pin;
-	/* Any state information */
-	/* ... to be added ... */
+	/* Card state */
+	uint8_t type;
+	uint8_t block_addr;	/* SDHC/SDXC, addressed by block not byte */
+	uint32_t sector_count;	/* From CSD, 0 if unknown */
+	uint32_t au_sectors;	/* SD allocation unit, 0 if unknown */
 };
 
 /* MMC command mnemonics in SPI mode */
 #define MMC_GO_IDLE_STATE 	0
 #define MMC_SEND_OP_COND	1
 #define MMC_SWITCH		6
+#define MMC_SEND_IF_COND	8	/* SD */
 #define MMC_SEND_EXT_CSD	8
 #define MMC_SEND_CSD		9
 #define MMC_SEND_CID		10
 #define MMC_STOP_TRANSMISSION	12
 #define MMC_SEND_STATUS		13
+#define SD_STATUS		13	/* ACMD */
 #define MMC_SET_BLOCKLEN	16
 #define MMC_READ_SINGLE_BLOCK	17
 #define MMC_READ_MULTIPLE_BLOCK	18
 #define MMC_SET_BLOCK_COUNT	23
+#define SD_SET_WR_BLK_ERASE_COUNT	23	/* ACMD */
 #define MMC_WRITE_BLOCK		24
 #define MMC_WRITE_MULTIPLE_BLOCK	25
 #define MMC_PROGRAM_CSD		27
@@ -60,12 +88,19 @@ struct mmc_port {
 #define MMC_ERASE_GROUP_START	35
 #define MMC_ERASE_GROUP_END	36
 #define MMC_ERASE		38
+#define SD_SEND_OP_COND		41	/* ACMD */
 #define MMC_LOCK_UNLOCK		42
 #define MMC_APP_CMD		55
 #define MMC_GEN_CMD		56
 #define MMC_READ_OCR		58
 #define MMC_CRC_ON_OFF		59
 
+/* Initialise the card over an SPI transport.  Any of the transport's
+ * fields in mmc must already be set up. */
+int mmc_card_init(struct mmc_port *mmc, const struct mmc_spi_ops *ops,
+		void *priv);
+
+/* Set up an STM32 SPI port and initialise the card, in mmc_stm32.c. */
 int mmc_init(uint32_t spi, uint32_t cs_port, uint16_t cs_pin, struct mmc_port *mmc);
 
 #endif
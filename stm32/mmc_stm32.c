@@ -0,0 +1,103 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* MMC Card SPI transport for STM32.
+ */
+
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/spi.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mmc.h"
+
+static uint8_t spi_readwrite(uint32_t spi, uint8_t data)
+{
+	while(SPI_SR(spi) & SPI_SR_BSY);
+	SPI_DR(spi) = data;
+	while(!(SPI_SR(spi) & SPI_SR_RXNE));
+	return SPI_DR(spi);
+}
+
+static uint8_t stm32_xfer(const struct mmc_port *mmc, uint8_t data)
+{
+	return spi_readwrite(mmc->spi, data);
+}
+
+static void stm32_chip_select(const struct mmc_port *mmc, int select)
+{
+	if(select)
+		gpio_clear(mmc->cs_port, mmc->cs_pin);
+	else
+		gpio_set(mmc->cs_port, mmc->cs_pin);
+}
+
+static void stm32_read_buf(const struct mmc_port *mmc, uint8_t *buf, int len)
+{
+	while(len--)
+		*buf++ = spi_readwrite(mmc->spi, 0xFF);
+}
+
+static void 
+stm32_write_buf(const struct mmc_port *mmc, const uint8_t *buf, int len)
+{
+	while(len--)
+		spi_readwrite(mmc->spi, *buf++);
+}
+
+static const struct mmc_spi_ops stm32_spi_ops = {
+	.xfer = stm32_xfer,
+	.chip_select = stm32_chip_select,
+	.read_buf = stm32_read_buf,
+	.write_buf = stm32_write_buf,
+};
+
+int 
+mmc_init(uint32_t spi, uint32_t cs_port, uint16_t cs_pin, struct mmc_port *mmc)
+{
+	/* Intialise structure */
+	memset(mmc, 0, sizeof(*mmc));
+
+	mmc->spi = spi;
+	mmc->cs_port = cs_port;
+	mmc->cs_pin = cs_pin;
+
+	/* Do hardware init */
+	/* Peripheral clocks must already be enabled.  
+	 * SPI pins must already be configured. */
+	spi_init_master(mmc->spi, 
+			SPI_CR1_BAUDRATE_FPCLK_DIV_2, 
+			SPI_CR1_CPOL_CLK_TO_1_WHEN_IDLE, 
+			SPI_CR1_CPHA_CLK_TRANSITION_2, 
+			SPI_CR1_CRCL_8BIT,
+			SPI_CR1_MSBFIRST);
+	/* Ignore the stupid NSS pin */
+	spi_enable_software_slave_management(mmc->spi);
+	spi_set_nss_high(mmc->spi);
+
+	spi_enable(mmc->spi);
+
+	/* SD nCS pin init */
+	gpio_mode_setup(mmc->cs_port, GPIO_MODE_OUTPUT, 
+			GPIO_PUPD_NONE, mmc->cs_pin);
+
+	return mmc_card_init(mmc, &stm32_spi_ops, NULL);
+}
@@ -22,71 +22,203 @@
  * Implementation of abstract block device over a Unix file
  */
 
+#define _GNU_SOURCE		/* For O_DIRECT */
 #define _FILE_OFFSET_BITS 64
 
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "openfat/blockdev.h"
 
 #define FILE_SECTOR_SIZE 512
 
+/* O_DIRECT needs buffers, offsets and lengths aligned to the logical
+ * block size of the underlying device, which is at most a page. */
+#define DIRECT_ALIGN 4096
+#define DIRECT_BOUNCE_SIZE (64 * 1024)
+
 struct block_device_file {
 	struct block_device bldev;
-	FILE *file;
+	int fd;
+	uint16_t sector_size;
+	/* Bounce buffer for unaligned O_DIRECT transfers, NULL otherwise */
+	uint8_t *bounce;
+	pthread_mutex_t bounce_mutex;
 };
 
-uint16_t file_get_sector_size(const struct block_device *dev)
+uint16_t file_get_sector_size(const struct block_device *bldev)
 {
-	(void)dev;
-	return FILE_SECTOR_SIZE;
+	const struct block_device_file *dev = (void*)bldev;
+
+	return dev->sector_size;
+}
+
+static int file_get_info(const struct block_device *bldev,
+		struct block_device_info *info)
+{
+	const struct block_device_file *dev = (void*)bldev;
+	struct stat st;
+	off_t size;
+
+	/* Seeking works for host block devices too, where st_size is 0 */
+	size = lseek(dev->fd, 0, SEEK_END);
+	if((size < 0) || fstat(dev->fd, &st))
+		return -EIO;
+
+	info->sector_count = size / dev->sector_size;
+	info->opt_transfer = st.st_blksize / dev->sector_size;
+	/* Written data may be in the host's cache until synced */
+	info->flags = BLOCK_CAP_FLUSH;
+
+	return 0;
+}
+
+/* Transfer len bytes, continuing after short transfers.  Returns the
+ * number of bytes transferred, which is only less than len at end of 
+ * file or on error. */
+static ssize_t file_xfer(int fd, void *buf, size_t len, off_t offset, 
+		int write)
+{
+	size_t done = 0;
+
+	while(done < len) {
+		ssize_t ret = write ? 
+			pwrite(fd, (uint8_t*)buf + done, len - done, 
+				offset + done) :
+			pread(fd, (uint8_t*)buf + done, len - done, 
+				offset + done);
+		if((ret < 0) && (errno == EINTR))
+			continue;
+		if(ret <= 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+/* Returns the number of whole sectors transferred, or -1 if none were */
+static int file_xfer_sectors(const struct block_device *bldev,
+		uint32_t sector, uint32_t count, void *buf, int write)
+{
+	struct block_device_file *dev = (void*)bldev;
+	off_t offset = (off_t)sector * dev->sector_size;
+	size_t len = (size_t)count * dev->sector_size;
+	size_t done = 0;
+
+	if(!dev->bounce || !((uintptr_t)buf % DIRECT_ALIGN)) {
+		done = file_xfer(dev->fd, buf, len, offset, write);
+	} else {
+		/* Buffer not aligned for O_DIRECT, go through bounce */
+		pthread_mutex_lock(&dev->bounce_mutex);
+		while(done < len) {
+			size_t chunk = len - done;
+			size_t ret;
+			if(chunk > DIRECT_BOUNCE_SIZE)
+				chunk = DIRECT_BOUNCE_SIZE;
+			if(write)
+				memcpy(dev->bounce, (uint8_t*)buf + done, chunk);
+			ret = file_xfer(dev->fd, dev->bounce, chunk, 
+					offset + done, write);
+			if(!write)
+				memcpy((uint8_t*)buf + done, dev->bounce, ret);
+			done += ret;
+			if(ret < chunk)
+				break;
+		}
+		pthread_mutex_unlock(&dev->bounce_mutex);
+	}
+
+	if(!done && len)
+		return -1;
+	return done / dev->sector_size;
 }
 
 static int file_read_sectors(const struct block_device *bldev,
 		uint32_t sector, uint32_t count, void *buf)
 {
-	const struct block_device_file *dev = (void*)bldev;
- 
-	fseeko(dev->file, (uint64_t)sector * FILE_SECTOR_SIZE, SEEK_SET);
-	return fread(buf, FILE_SECTOR_SIZE, count, dev->file);
+	return file_xfer_sectors(bldev, sector, count, buf, 0);
 }
 
 static int file_write_sectors(const struct block_device *bldev,
 		uint32_t sector, uint32_t count, const void *buf)
 {
-	const struct block_device_file *dev = (void*)bldev;
- 
-	fseeko(dev->file, (uint64_t)sector * FILE_SECTOR_SIZE, SEEK_SET);
-	return fwrite(buf, FILE_SECTOR_SIZE, count, dev->file);
+	return file_xfer_sectors(bldev, sector, count, (void*)buf, 1);
 }
 
-struct block_device * block_device_file_new(const char *filename, const char *mode)
+/* Open a file as a block device.  flags are as for open(2), and may 
+ * include O_DIRECT to bypass the host's page cache.  With O_DIRECT,
+ * sector_size must be a multiple of the device's logical block size. */
+struct block_device *
+block_device_file_open(const char *filename, int flags, uint16_t sector_size)
 {
-	FILE *f;
 	struct block_device_file *dev;
 	struct block_device *bldev;
 
-	f = fopen(filename, mode);
-	if(f == NULL)
-		return NULL; 
+	if(!sector_size || (sector_size % 512))
+		return NULL;
 
-	dev = malloc(sizeof(*dev));
+	dev = calloc(1, sizeof(*dev));
+	if(dev == NULL)
+		return NULL;
 	bldev = (void*)dev;
 
+	if((flags & O_DIRECT) && 
+	   posix_memalign((void**)&dev->bounce, DIRECT_ALIGN, 
+			DIRECT_BOUNCE_SIZE)) {
+		free(dev);
+		return NULL;
+	}
+
+	dev->fd = open(filename, flags, 0666);
+	if(dev->fd < 0) {
+		free(dev->bounce);
+		free(dev);
+		return NULL; 
+	}
+	pthread_mutex_init(&dev->bounce_mutex, NULL);
+
 	bldev->read_sectors = file_read_sectors;
 	bldev->write_sectors = file_write_sectors;
 	bldev->get_sector_size = file_get_sector_size;
-	dev->file = f;
+	bldev->get_info = file_get_info;
+	dev->sector_size = sector_size;
+
+	return bldev;
+}
+
+/* mode is as for fopen(3) */
+struct block_device * block_device_file_new(const char *filename, const char *mode)
+{
+	int flags = (mode[0] == 'r') ? 0 : 
+			(mode[0] == 'w') ? (O_CREAT | O_TRUNC) : O_CREAT;
+
+	flags |= strchr(mode, '+') ? O_RDWR : 
+			(mode[0] == 'r') ? O_RDONLY : O_WRONLY;
+
+	return block_device_file_open(filename, flags, FILE_SECTOR_SIZE);
+}
+
+/* Flush data written to the host's storage, returns 0 or -EIO */
+int block_device_file_sync(struct block_device *bldev)
+{
+	struct block_device_file *dev = (void*)bldev;
 
-	return (struct block_device*)dev;
+	return fsync(dev->fd) ? -EIO : 0;
 }
 
 void block_device_file_destroy(struct block_device *bldev)
 {
 	struct block_device_file *dev = (void*)bldev;
 
-	fclose(dev->file);
+	close(dev->fd);
+	pthread_mutex_destroy(&dev->bounce_mutex);
+	free(dev->bounce);
 	free(dev);
 }
 
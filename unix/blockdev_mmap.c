@@ -0,0 +1,182 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Sample block device implementation:
+ * Block device over a memory mapped image file.  Sectors can be read in
+ * place through get_sector_ptr(), so FAT and directory sectors are
+ * parsed without being copied.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "openfat/blockdev.h"
+
+#define MMAP_SECTOR_SIZE 512
+
+struct block_device_mmap {
+	struct block_device bldev;
+	uint8_t *map;
+	size_t size;
+	uint32_t sector_count;
+	int writable;
+};
+
+static uint16_t mmap_get_sector_size(const struct block_device *dev)
+{
+	(void)dev;
+	return MMAP_SECTOR_SIZE;
+}
+
+static int mmap_get_info(const struct block_device *bldev,
+		struct block_device_info *info)
+{
+	const struct block_device_mmap *dev = (void*)bldev;
+
+	info->sector_count = dev->sector_count;
+	/* Changes reach the file when synced */
+	info->flags = dev->writable ? BLOCK_CAP_FLUSH : 0;
+
+	return 0;
+}
+
+/* Number of sectors from sector that lie inside the image */
+static uint32_t mmap_clip(const struct block_device_mmap *dev,
+		uint32_t sector, uint32_t count)
+{
+	if(sector >= dev->sector_count)
+		return 0;
+	if(count > dev->sector_count - sector)
+		count = dev->sector_count - sector;
+	return count;
+}
+
+static int mmap_read_sectors(const struct block_device *bldev,
+		uint32_t sector, uint32_t count, void *buf)
+{
+	const struct block_device_mmap *dev = (void*)bldev;
+
+	count = mmap_clip(dev, sector, count);
+	if(!count)
+		return -1;
+	memcpy(buf, dev->map + (size_t)sector * MMAP_SECTOR_SIZE,
+			(size_t)count * MMAP_SECTOR_SIZE);
+	return count;
+}
+
+static int mmap_write_sectors(const struct block_device *bldev,
+		uint32_t sector, uint32_t count, const void *buf)
+{
+	const struct block_device_mmap *dev = (void*)bldev;
+
+	count = mmap_clip(dev, sector, count);
+	if(!dev->writable || !count)
+		return -1;
+	memcpy(dev->map + (size_t)sector * MMAP_SECTOR_SIZE, buf,
+			(size_t)count * MMAP_SECTOR_SIZE);
+	return count;
+}
+
+static const void *mmap_get_sector_ptr(const struct block_device *bldev,
+		uint32_t sector)
+{
+	const struct block_device_mmap *dev = (void*)bldev;
+
+	if(sector >= dev->sector_count)
+		return NULL;
+	return dev->map + (size_t)sector * MMAP_SECTOR_SIZE;
+}
+
+/* Map an image file.  The mapping is shared, so writes reach the file,
+ * but only when written back by the host or block_device_mmap_sync().
+ * If writable is zero the image is opened and mapped read only. */
+struct block_device *
+block_device_mmap_new(const char *filename, int writable)
+{
+	struct block_device_mmap *dev;
+	struct block_device *bldev;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, writable ? O_RDWR : O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &st) || (st.st_size < MMAP_SECTOR_SIZE)) {
+		close(fd);
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if(dev == NULL) {
+		close(fd);
+		return NULL;
+	}
+	bldev = (void*)dev;
+
+	dev->size = st.st_size;
+	dev->sector_count = st.st_size / MMAP_SECTOR_SIZE;
+	dev->writable = writable;
+	dev->map = mmap(NULL, dev->size,
+			writable ? PROT_READ | PROT_WRITE : PROT_READ,
+			MAP_SHARED, fd, 0);
+	/* The mapping keeps the file open */
+	close(fd);
+	if(dev->map == MAP_FAILED) {
+		free(dev);
+		return NULL;
+	}
+
+	bldev->read_sectors = mmap_read_sectors;
+	bldev->write_sectors = mmap_write_sectors;
+	bldev->get_sector_size = mmap_get_sector_size;
+	bldev->get_info = mmap_get_info;
+	bldev->get_sector_ptr = mmap_get_sector_ptr;
+
+	return bldev;
+}
+
+/* Write changes back to the image file, returns 0 or -EIO */
+int block_device_mmap_sync(struct block_device *bldev)
+{
+	struct block_device_mmap *dev = (void*)bldev;
+
+	if(!dev->writable)
+		return 0;
+	return msync(dev->map, dev->size, MS_SYNC) ? -EIO : 0;
+}
+
+void block_device_mmap_destroy(struct block_device *bldev)
+{
+	struct block_device_mmap *dev = (void*)bldev;
+
+	block_device_mmap_sync(bldev);
+	munmap(dev->map, dev->size);
+	free(dev);
+}
+
@@ -0,0 +1,429 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Sample block device implementation:
+ * Write-back buffering over another block device, with a background
+ * thread writing dirty sectors back.  Writes return once the data is
+ * copied, the flusher thread writes sectors back in ascending order,
+ * merging adjacent sectors, when too many are dirty or the oldest has
+ * waited too long.
+ */
+
+#define _GNU_SOURCE	/* For qsort_r() */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "openfat/blockdev.h"
+
+/* Largest single write issued to the lower device */
+#define WB_MAX_BATCH 64
+
+struct wb_slot {
+	uint32_t sector;
+	uint8_t valid;		/* Slot holds a sector */
+	uint8_t dirty;		/* Not written back since last change */
+	struct timespec stamp;	/* When the slot became dirty */
+	uint8_t *data;
+};
+
+struct block_device_writeback {
+	struct block_device bldev;
+	struct block_device *lower;
+	uint16_t sector_size;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;	/* Flusher has work to do */
+	pthread_cond_t drained;	/* Slots have been written back */
+	pthread_t thread;
+	int stop;
+	int flushing;		/* Write back in progress, uses order and batch */
+
+	struct wb_slot *slots;
+	uint32_t nslots;
+	uint32_t ndirty;
+
+	/* Tunables */
+	uint32_t dirty_thresh;
+	unsigned max_age_ms;
+
+	uint8_t *batch;
+	uint32_t *order;
+};
+
+static uint16_t wb_get_sector_size(const struct block_device *bldev)
+{
+	const struct block_device_writeback *dev = (void*)bldev;
+
+	return dev->sector_size;
+}
+
+static int wb_get_info(const struct block_device *bldev,
+		struct block_device_info *info)
+{
+	const struct block_device_writeback *dev = (void*)bldev;
+
+	block_get_info(dev->lower, info);
+	/* Writes are held here until flushed */
+	info->flags |= BLOCK_CAP_FLUSH;
+
+	return 0;
+}
+
+static struct wb_slot *
+wb_find(struct block_device_writeback *dev, uint32_t sector)
+{
+	for(uint32_t i = 0; i < dev->nslots; i++)
+		if(dev->slots[i].valid && (dev->slots[i].sector == sector))
+			return &dev->slots[i];
+	return NULL;
+}
+
+static struct wb_slot *wb_find_free(struct block_device_writeback *dev)
+{
+	for(uint32_t i = 0; i < dev->nslots; i++)
+		if(!dev->slots[i].valid)
+			return &dev->slots[i];
+	return NULL;
+}
+
+static long wb_age_ms(const struct timespec *stamp, const struct timespec *now)
+{
+	return (now->tv_sec - stamp->tv_sec) * 1000 +
+		(now->tv_nsec - stamp->tv_nsec) / 1000000;
+}
+
+static int wb_cmp_sector(const void *a, const void *b, void *arg)
+{
+	const struct wb_slot *slots = arg;
+	uint32_t sa = slots[*(const uint32_t *)a].sector;
+	uint32_t sb = slots[*(const uint32_t *)b].sector;
+
+	return (sa > sb) - (sa < sb);
+}
+
+/* Write back all dirty sectors, in ascending order with adjacent sectors
+ * merged.  Called with the mutex held and no write back in progress.  The
+ * mutex is released around writes to the lower device.  Returns the 
+ * number of sectors written back, or -EIO. */
+static int wb_flush_locked(struct block_device_writeback *dev)
+{
+	uint32_t n = 0;
+	int done = 0;
+
+	dev->flushing = 1;
+	for(uint32_t i = 0; i < dev->nslots; i++)
+		if(dev->slots[i].dirty)
+			dev->order[n++] = i;
+	qsort_r(dev->order, n, sizeof(*dev->order), wb_cmp_sector,
+			dev->slots);
+
+	for(uint32_t i = 0; i < n; ) {
+		uint32_t first = dev->slots[dev->order[i]].sector;
+		uint32_t count = 0, start = i;
+		int ret;
+
+		/* Collect a run of consecutive sectors */
+		while((i < n) && (count < WB_MAX_BATCH) &&
+		      (dev->slots[dev->order[i]].sector == first + count)) {
+			struct wb_slot *s = &dev->slots[dev->order[i++]];
+			memcpy(dev->batch + count++ * dev->sector_size,
+					s->data, dev->sector_size);
+			s->dirty = 0;
+		}
+		dev->ndirty -= count;
+
+		pthread_mutex_unlock(&dev->mutex);
+		ret = block_write_sectors(dev->lower, first, count, dev->batch);
+		pthread_mutex_lock(&dev->mutex);
+
+		for(uint32_t j = start; j < i; j++) {
+			struct wb_slot *s = &dev->slots[dev->order[j]];
+			if(ret != (int)count) {
+				/* Keep data to retry later */
+				if(!s->dirty) {
+					s->dirty = 1;
+					dev->ndirty++;
+				}
+			} else if(!s->dirty) {
+				s->valid = 0;
+			}
+		}
+		if(ret != (int)count) {
+			done = -EIO;
+			break;
+		}
+		done += count;
+	}
+	dev->flushing = 0;
+	pthread_cond_broadcast(&dev->drained);
+
+	return done;
+}
+
+static void *wb_flusher(void *arg)
+{
+	struct block_device_writeback *dev = arg;
+
+	pthread_mutex_lock(&dev->mutex);
+	while(!dev->stop) {
+		struct timespec now, oldest, until;
+		int expired = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(dev->ndirty) {
+			oldest = now;
+			for(uint32_t i = 0; i < dev->nslots; i++) {
+				struct wb_slot *s = &dev->slots[i];
+				if(s->dirty && 
+				   (wb_age_ms(&s->stamp, &oldest) > 0))
+					oldest = s->stamp;
+			}
+			expired = wb_age_ms(&oldest, &now) >=
+					(long)dev->max_age_ms;
+		}
+
+		if(dev->flushing) {
+			/* Sync in progress */
+			pthread_cond_wait(&dev->drained, &dev->mutex);
+			continue;
+		}
+		if(expired || (dev->ndirty >= dev->dirty_thresh)) {
+			if(wb_flush_locked(dev) >= 0)
+				continue;
+			/* Lower device failed, retry after the age limit */
+			oldest = now;
+		}
+
+		if(!dev->ndirty) {
+			/* Nothing to do until a sector is written */
+			pthread_cond_wait(&dev->wake, &dev->mutex);
+			continue;
+		}
+
+		/* Sleep until the oldest dirty sector expires */
+		until = oldest;
+		until.tv_sec += dev->max_age_ms / 1000;
+		until.tv_nsec += (dev->max_age_ms % 1000) * 1000000;
+		if(until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&dev->wake, &dev->mutex, &until);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return NULL;
+}
+
+static int wb_read_sectors(const struct block_device *bldev,
+		uint32_t sector, uint32_t count, void *buf)
+{
+	struct block_device_writeback *dev = (void*)bldev;
+	int ret;
+
+	/* Buffered sectors are held until the read is complete, so they
+	 * can't be written back and freed before being copied over data
+	 * read from the lower device. */
+	pthread_mutex_lock(&dev->mutex);
+	ret = block_read_sectors(dev->lower, sector, count, buf);
+	if(ret == (int)count) {
+		for(uint32_t i = 0; i < count; i++) {
+			struct wb_slot *s = wb_find(dev, sector + i);
+			if(s)
+				memcpy((uint8_t*)buf + i * dev->sector_size,
+					s->data, dev->sector_size);
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return ret;
+}
+
+static int wb_write_sectors(const struct block_device *bldev,
+		uint32_t sector, uint32_t count, const void *buf)
+{
+	struct block_device_writeback *dev = (void*)bldev;
+	struct timespec now;
+	uint32_t was_dirty;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&dev->mutex);
+	was_dirty = dev->ndirty;
+	for(uint32_t i = 0; i < count; i++) {
+		struct wb_slot *s = wb_find(dev, sector + i);
+		while(!s && !(s = wb_find_free(dev))) {
+			/* All slots dirty, wait for write back */
+			pthread_cond_signal(&dev->wake);
+			pthread_cond_wait(&dev->drained, &dev->mutex);
+			s = wb_find(dev, sector + i);
+		}
+		memcpy(s->data, (const uint8_t*)buf + i * dev->sector_size,
+				dev->sector_size);
+		s->sector = sector + i;
+		s->valid = 1;
+		if(!s->dirty) {
+			s->dirty = 1;
+			s->stamp = now;
+			dev->ndirty++;
+		}
+	}
+	/* The flusher sleeps without a timeout while nothing is dirty */
+	if(!was_dirty || (dev->ndirty >= dev->dirty_thresh))
+		pthread_cond_signal(&dev->wake);
+	pthread_mutex_unlock(&dev->mutex);
+
+	return count;
+}
+
+static void wb_set_tunables(struct block_device_writeback *dev,
+		unsigned dirty_ratio, unsigned max_age_ms)
+{
+	if(dirty_ratio > 100)
+		dirty_ratio = 100;
+	dev->dirty_thresh = (uint64_t)dev->nslots * dirty_ratio / 100;
+	if(!dev->dirty_thresh)
+		dev->dirty_thresh = 1;
+	dev->max_age_ms = max_age_ms;
+}
+
+static void wb_free(struct block_device_writeback *dev)
+{
+	if(dev->slots)
+		free(dev->slots[0].data);
+	free(dev->slots);
+	free(dev->order);
+	free(dev->batch);
+	free(dev);
+}
+
+/* dirty_ratio is the percentage of buffered sectors that may be dirty
+ * before write back starts, max_age_ms the longest a sector stays dirty. */
+void block_device_writeback_tune(struct block_device *bldev,
+		unsigned dirty_ratio, unsigned max_age_ms)
+{
+	struct block_device_writeback *dev = (void*)bldev;
+
+	pthread_mutex_lock(&dev->mutex);
+	wb_set_tunables(dev, dirty_ratio, max_age_ms);
+	pthread_cond_signal(&dev->wake);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+/* Write back all dirty sectors, returns 0 or -EIO */
+int block_device_writeback_sync(struct block_device *bldev)
+{
+	struct block_device_writeback *dev = (void*)bldev;
+	int ret = 0;
+
+	pthread_mutex_lock(&dev->mutex);
+	while(dev->flushing) /* Let the flusher finish */
+		pthread_cond_wait(&dev->drained, &dev->mutex);
+	if(dev->ndirty && (wb_flush_locked(dev) < 0))
+		ret = -EIO;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return ret;
+}
+
+/* Buffer up to nsectors written to lower, see block_device_writeback_tune()
+ * for the other parameters. */
+struct block_device *
+block_device_writeback_new(struct block_device *lower, uint32_t nsectors,
+		unsigned dirty_ratio, unsigned max_age_ms)
+{
+	struct block_device_writeback *dev;
+	struct block_device *bldev;
+	pthread_condattr_t attr;
+
+	if(!nsectors)
+		return NULL;
+
+	dev = calloc(1, sizeof(*dev));
+	if(dev == NULL)
+		return NULL;
+	bldev = (void*)dev;
+
+	dev->lower = lower;
+	dev->sector_size = block_get_sector_size(lower);
+	dev->nslots = nsectors;
+	dev->slots = calloc(nsectors, sizeof(*dev->slots));
+	dev->order = calloc(nsectors, sizeof(*dev->order));
+	dev->batch = malloc(WB_MAX_BATCH * dev->sector_size);
+	if(dev->slots && dev->order && dev->batch)
+		dev->slots[0].data = malloc(nsectors * dev->sector_size);
+	if(!dev->slots || !dev->slots[0].data) {
+		wb_free(dev);
+		return NULL;
+	}
+	for(uint32_t i = 1; i < nsectors; i++)
+		dev->slots[i].data = dev->slots[0].data + i * dev->sector_size;
+
+	wb_set_tunables(dev, dirty_ratio, max_age_ms);
+
+	/* Ages are measured on the monotonic clock, so the flusher isn't
+	 * upset by changes to the time of day */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&dev->mutex, NULL);
+	pthread_cond_init(&dev->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&dev->drained, NULL);
+
+	bldev->read_sectors = wb_read_sectors;
+	bldev->write_sectors = wb_write_sectors;
+	bldev->get_sector_size = wb_get_sector_size;
+	bldev->get_info = wb_get_info;
+
+	if(pthread_create(&dev->thread, NULL, wb_flusher, dev)) {
+		wb_free(dev);
+		return NULL;
+	}
+
+	return bldev;
+}
+
+/* Stops the flusher and writes back everything still dirty.  The lower
+ * device is left open. */
+int block_device_writeback_destroy(struct block_device *bldev)
+{
+	struct block_device_writeback *dev = (void*)bldev;
+	int ret;
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->stop = 1;
+	pthread_cond_signal(&dev->wake);
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_join(dev->thread, NULL);
+
+	ret = block_device_writeback_sync(bldev);
+
+	pthread_cond_destroy(&dev->drained);
+	pthread_cond_destroy(&dev->wake);
+	pthread_mutex_destroy(&dev->mutex);
+	wb_free(dev);
+
+	return ret;
+}
+
@@ -0,0 +1,838 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Filesystem benchmark.
+ *
+ * Reference images are formatted here, so results don't depend on the
+ * host's mkfs, and held in memory.  Every workload starts from a fresh
+ * copy of its image.  The device counts requests and sectors, and each
+ * result is printed as a JSON object per line, or as CSV.
+ *
+ * Usage: fatbench [-t 12|16|32] [-w workload] [-f json|csv] [-o dir]
+ *                 [-n ops] [-l max_entries] [-s seed]
+ * -t and -w may be repeated, by default everything is run.  With -o the
+ * images are saved in dir, bench-fatNN-VARIANT.img, and for lookup the
+ * same image with its directories of 10 to max_entries files added,
+ * bench-fatNN-VARIANT-dirs.img.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "openfat.h"
+#include "openfat/unixlike.h"
+
+#define SECTOR_SIZE 512
+
+/* Size of the file used by the sequential and random workloads */
+#define SEQ_SIZE (1024 * 1024)
+#define SMALL_FILES 200
+#define SMALL_SIZE 1024
+#define PATH_DEPTH 8
+/* Files per directory when fragmenting an image */
+#define FRAG_DIR_FILES 500
+/* Number of files the image is divided into when fragmenting */
+#define FRAG_FILES 4000
+
+struct ram_dev {
+	struct block_device bldev;
+	uint8_t *data;
+	uint32_t sectors;
+	uint64_t rd_calls, rd_sectors;
+	uint64_t wr_calls, wr_sectors;
+};
+
+static uint16_t ram_get_sector_size(const struct block_device *bldev)
+{
+	(void)bldev;
+	return SECTOR_SIZE;
+}
+
+static int ram_get_info(const struct block_device *bldev,
+		struct block_device_info *info)
+{
+	const struct ram_dev *dev = (void*)bldev;
+
+	info->sector_count = dev->sectors;
+	return 0;
+}
+
+static int ram_read_sectors(const struct block_device *bldev,
+		uint32_t sector, uint32_t count, void *buf)
+{
+	struct ram_dev *dev = (void*)bldev;
+
+	if((sector >= dev->sectors) || (count > dev->sectors - sector))
+		return -1;
+	dev->rd_calls++;
+	dev->rd_sectors += count;
+	memcpy(buf, dev->data + (size_t)sector * SECTOR_SIZE,
+			(size_t)count * SECTOR_SIZE);
+	return count;
+}
+
+static int ram_write_sectors(const struct block_device *bldev,
+		uint32_t sector, uint32_t count, const void *buf)
+{
+	struct ram_dev *dev = (void*)bldev;
+
+	if((sector >= dev->sectors) || (count > dev->sectors - sector))
+		return -1;
+	dev->wr_calls++;
+	dev->wr_sectors += count;
+	memcpy(dev->data + (size_t)sector * SECTOR_SIZE, buf,
+			(size_t)count * SECTOR_SIZE);
+	return count;
+}
+
+/* Reference images.  Cluster counts are well inside the range for each
+ * FAT type. */
+struct image_spec {
+	int type;
+	uint32_t sectors;
+	uint8_t spc;
+};
+
+static const struct image_spec specs[] = {
+	{12, 8000, 4},
+	{16, 65536, 4},
+	{32, 70000, 1},
+};
+
+static const char *variants[] = {"plain", "frag"};
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+/* Format an image with two FATs, marked clean.  Returns the number of
+ * clusters, or 0 if it doesn't suit the FAT type. */
+static uint32_t format_image(uint8_t *img, const struct image_spec *spec)
+{
+	uint16_t rsvd = (spec->type == 32) ? 32 : 1;
+	uint16_t root_ents = (spec->type == 32) ? 0 : 512;
+	uint32_t root_secs = root_ents * 32 / SECTOR_SIZE;
+	uint32_t fatsz = 1, clusters;
+	uint8_t *bs = img;
+
+	for(;;) {
+		uint32_t need;
+		clusters = (spec->sectors - rsvd - 2 * fatsz - root_secs) /
+				spec->spc;
+		need = (spec->type == 12) ? ((clusters + 2) * 3 + 1) / 2 :
+				(clusters + 2) * (spec->type / 8);
+		need = (need + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		if(need <= fatsz)
+			break;
+		fatsz = need;
+	}
+	if(((spec->type == 12) && (clusters >= 4085)) ||
+	   ((spec->type == 16) && ((clusters < 4085) || (clusters >= 65525))) ||
+	   ((spec->type == 32) && (clusters < 65525)))
+		return 0;
+
+	memset(img, 0, (size_t)spec->sectors * SECTOR_SIZE);
+	memcpy(bs, "\xEB\x3C\x90OPENFAT ", 11);
+	put16(bs + 11, SECTOR_SIZE);
+	bs[13] = spec->spc;
+	put16(bs + 14, rsvd);
+	bs[16] = 2;
+	put16(bs + 17, root_ents);
+	if(spec->sectors < 0x10000)
+		put16(bs + 19, spec->sectors);
+	else
+		put32(bs + 32, spec->sectors);
+	bs[21] = 0xF8;
+	put16(bs + 24, 32);
+	put16(bs + 26, 64);
+	if(spec->type == 32) {
+		uint8_t *fsi = img + SECTOR_SIZE;
+		bs[0] = 0xEB; bs[1] = 0x58;
+		put32(bs + 36, fatsz);
+		put32(bs + 44, 2);
+		put16(bs + 48, 1);
+		put16(bs + 50, 6);
+		bs[64] = 0x80;
+		bs[66] = 0x29;
+		put32(bs + 67, 0x12345678);
+		memcpy(bs + 71, "NO NAME    FAT32   ", 19);
+		put32(fsi, 0x41615252);
+		put32(fsi + 484, 0x61417272);
+		put32(fsi + 488, clusters - 1);
+		put32(fsi + 492, 3);
+		put32(fsi + 508, 0xAA550000);
+	} else {
+		put16(bs + 22, fatsz);
+		bs[36] = 0x80;
+		bs[38] = 0x29;
+		put32(bs + 39, 0x12345678);
+		memcpy(bs + 43, (spec->type == 12) ? "NO NAME    FAT12   " :
+				"NO NAME    FAT16   ", 19);
+	}
+	bs[510] = 0x55;
+	bs[511] = 0xAA;
+	if(spec->type == 32)
+		memcpy(img + 6 * SECTOR_SIZE, img, 2 * SECTOR_SIZE);
+
+	for(int i = 0; i < 2; i++) {
+		uint8_t *fat = img + (size_t)(rsvd + i * fatsz) * SECTOR_SIZE;
+		switch(spec->type) {
+		case 12:
+			memcpy(fat, "\xF8\xFF\xFF", 3);
+			break;
+		case 16:
+			memcpy(fat, "\xF8\xFF\xFF\xFF", 4);
+			break;
+		case 32:
+			/* Root directory in cluster 2 */
+			memcpy(fat, "\xF8\xFF\xFF\x0F\xFF\xFF\xFF\x0F"
+					"\xFF\xFF\xFF\x0F", 12);
+			break;
+		}
+	}
+
+	return clusters;
+}
+
+static int fill_file(FatVol *vol, const char *name, uint32_t size)
+{
+	static uint8_t buf[32768];
+	FatFile f;
+	uint32_t done = 0;
+
+	if(fat_create(vol, name, 0, &f))
+		return -1;
+	while(done < size) {
+		int n = (size - done > sizeof(buf)) ? sizeof(buf) : size - done;
+		memset(buf, done / SECTOR_SIZE, n);
+		if(fat_write(&f, buf, n) != n)
+			return -1;
+		done += n;
+	}
+	return fat_file_sync(&f);
+}
+
+/* Fill the volume with equal files and delete every other one, leaving
+ * free space in holes all over the volume. */
+static int fragment_image(FatVol *vol, uint32_t clusters)
+{
+	uint32_t csize = vol->sectors_per_cluster * SECTOR_SIZE;
+	uint32_t per = clusters / FRAG_FILES;
+	uint32_t n;
+	int sub = 0;
+	char name[16];
+
+	if(!per)
+		per = 1;
+	if(fat_mkdir(vol, "FRAG") || fat_chdir(vol, "FRAG"))
+		return -1;
+	/* Files end within their last cluster, so none is allocated past it */
+	for(n = 0; ; n++) {
+		if(!(n % FRAG_DIR_FILES)) {
+			if(sub && fat_chdir(vol, ".."))
+				return -1;
+			sub = 0;
+			sprintf(name, "D%03u", n / FRAG_DIR_FILES);
+			if(fat_mkdir(vol, name) || fat_chdir(vol, name))
+				break;
+			sub = 1;
+		}
+		sprintf(name, "F%05u", n);
+		if(fill_file(vol, name, per * csize - SECTOR_SIZE))
+			break;
+	}
+	if(sub && fat_chdir(vol, ".."))
+		return -1;
+
+	for(uint32_t i = 0; i < n; i += 2) {
+		if(!(i % FRAG_DIR_FILES)) {
+			if(i && fat_chdir(vol, ".."))
+				return -1;
+			sprintf(name, "D%03u", i / FRAG_DIR_FILES);
+			if(fat_chdir(vol, name))
+				return -1;
+		}
+		sprintf(name, "F%05u", i);
+		if(fat_unlink(vol, name))
+			return -1;
+	}
+	return fat_chdir(vol, "..") || fat_chdir(vol, "..");
+}
+
+/* The library's sector buffer is tagged with the device, so the image
+ * is reset under the other of two devices, and nothing stale is found. */
+static struct ram_dev devs[2];
+static int cur_dev;
+static uint8_t *pristine, *pristine_dirs;
+static uint32_t pristine_sectors;
+
+static struct ram_dev *image_load(const uint8_t *image)
+{
+	struct ram_dev *dev;
+
+	cur_dev ^= 1;
+	dev = &devs[cur_dev];
+	memcpy(dev->data, image, (size_t)pristine_sectors * SECTOR_SIZE);
+	dev->sectors = pristine_sectors;
+	dev->rd_calls = dev->rd_sectors = 0;
+	dev->wr_calls = dev->wr_sectors = 0;
+	return dev;
+}
+
+static struct ram_dev *image_reset(void)
+{
+	return image_load(pristine);
+}
+
+static int save_image(const uint8_t *image, const char *dir, int type,
+		const char *variant, const char *suffix)
+{
+	char path[1024];
+	FILE *f;
+	size_t len = (size_t)pristine_sectors * SECTOR_SIZE;
+
+	snprintf(path, sizeof(path), "%s/bench-fat%d-%s%s.img", dir, type,
+			variant, suffix);
+	f = fopen(path, "wb");
+	if(!f)
+		return -1;
+	if(fwrite(image, 1, len, f) != len) {
+		fclose(f);
+		return -1;
+	}
+	return fclose(f);
+}
+
+static int build_image(const struct image_spec *spec, const char *variant)
+{
+	uint32_t clusters = format_image(pristine, spec);
+	struct ram_dev *dev;
+	FatVol vol;
+
+	pristine_sectors = spec->sectors;
+	if(!clusters)
+		return -1;
+	if(strcmp(variant, "frag") == 0) {
+		dev = image_reset();
+		if(fat_vol_init(&dev->bldev, &vol) ||
+		   fragment_image(&vol, clusters) || fat_vol_umount(&vol))
+			return -1;
+		memcpy(pristine, dev->data, (size_t)spec->sectors * SECTOR_SIZE);
+	}
+	return 0;
+}
+
+/* Add directories LOOKUP/Nn of n files, for n of 10 up to max_entries */
+static int build_dirs_image(uint32_t max_entries)
+{
+	struct ram_dev *dev = image_reset();
+	char name[16];
+	FatVol vol;
+	FatFile f;
+
+	if(fat_vol_init(&dev->bldev, &vol) || fat_mkdir(&vol, "LOOKUP") ||
+	   fat_chdir(&vol, "LOOKUP"))
+		return -1;
+	for(uint32_t n = 10; n <= max_entries; n *= 10) {
+		sprintf(name, "N%u", n);
+		if(fat_mkdir(&vol, name) || fat_chdir(&vol, name))
+			return -1;
+		for(uint32_t i = 0; i < n; i++) {
+			sprintf(name, "L%07u", i);
+			if(fat_create(&vol, name, 0, &f))
+				return -1;
+		}
+		if(fat_chdir(&vol, ".."))
+			return -1;
+	}
+	if(fat_vol_umount(&vol))
+		return -1;
+	memcpy(pristine_dirs, dev->data, (size_t)pristine_sectors * SECTOR_SIZE);
+	return 0;
+}
+
+/* Results */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct result {
+	const char *workload;
+	uint32_t param;
+	uint32_t ops;
+	uint64_t bytes;
+	uint64_t start, end;
+	uint64_t *lat;
+	uint32_t lat_max;
+	struct ram_dev *dev;
+	uint64_t rd_calls, rd_sectors, wr_calls, wr_sectors;
+};
+
+static int fat_type;
+static const char *variant;
+static int csv;
+
+static void result_begin(struct result *r, const char *workload,
+		uint32_t param, uint32_t maxops, struct ram_dev *dev)
+{
+	memset(r, 0, sizeof(*r));
+	r->workload = workload;
+	r->param = param;
+	r->lat_max = maxops;
+	r->lat = malloc(maxops * sizeof(*r->lat));
+	r->dev = dev;
+	r->rd_calls = dev->rd_calls;
+	r->rd_sectors = dev->rd_sectors;
+	r->wr_calls = dev->wr_calls;
+	r->wr_sectors = dev->wr_sectors;
+	r->start = now_ns();
+}
+
+static void result_op(struct result *r, uint64_t t0, uint64_t bytes)
+{
+	if(r->ops < r->lat_max)
+		r->lat[r->ops] = now_ns() - t0;
+	r->ops++;
+	r->bytes += bytes;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double pct_us(const struct result *r, uint32_t n, int pct)
+{
+	return n ? r->lat[(uint64_t)(n - 1) * pct / 100] / 1000.0 : 0;
+}
+
+static void result_end(struct result *r)
+{
+	struct ram_dev *dev = r->dev;
+	uint32_t n = (r->ops < r->lat_max) ? r->ops : r->lat_max;
+	double secs;
+
+	r->end = now_ns();
+	secs = (r->end - r->start) / 1e9;
+	qsort(r->lat, n, sizeof(*r->lat), cmp_u64);
+
+	if(csv)
+		printf("%d,%s,%s,%u,%u,%llu,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,"
+			"%llu,%llu,%llu,%llu\n", fat_type, variant,
+			r->workload, r->param, r->ops,
+			(unsigned long long)r->bytes, secs,
+			secs > 0 ? r->bytes / secs / 1e6 : 0,
+			pct_us(r, n, 50), pct_us(r, n, 90), pct_us(r, n, 99),
+			pct_us(r, n, 100),
+			(unsigned long long)(dev->rd_calls - r->rd_calls),
+			(unsigned long long)(dev->rd_sectors - r->rd_sectors),
+			(unsigned long long)(dev->wr_calls - r->wr_calls),
+			(unsigned long long)(dev->wr_sectors - r->wr_sectors));
+	else
+		printf("{\"fat\":%d,\"image\":\"%s\",\"workload\":\"%s\","
+			"\"param\":%u,\"ops\":%u,\"bytes\":%llu,"
+			"\"secs\":%.6f,\"mb_s\":%.3f,\"p50_us\":%.3f,"
+			"\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,"
+			"\"rd_calls\":%llu,\"rd_sectors\":%llu,"
+			"\"wr_calls\":%llu,\"wr_sectors\":%llu}\n",
+			fat_type, variant, r->workload, r->param, r->ops,
+			(unsigned long long)r->bytes, secs,
+			secs > 0 ? r->bytes / secs / 1e6 : 0,
+			pct_us(r, n, 50), pct_us(r, n, 90), pct_us(r, n, 99),
+			pct_us(r, n, 100),
+			(unsigned long long)(dev->rd_calls - r->rd_calls),
+			(unsigned long long)(dev->rd_sectors - r->rd_sectors),
+			(unsigned long long)(dev->wr_calls - r->wr_calls),
+			(unsigned long long)(dev->wr_sectors - r->wr_sectors));
+	fflush(stdout);
+	free(r->lat);
+}
+
+/* Reproducible random numbers, independent of the C library */
+static uint32_t rand_state;
+
+static uint32_t bench_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static void fail(const char *workload)
+{
+	fprintf(stderr, "fatbench: %s failed on FAT%d %s image\n",
+			workload, fat_type, variant);
+	exit(1);
+}
+
+/* Workloads.  Each starts from a fresh image and fails hard on error. */
+static void bench_seqwrite(uint32_t chunk)
+{
+	struct ram_dev *dev = image_reset();
+	uint8_t *buf = calloc(1, chunk);
+	struct result r;
+	FatVol vol;
+	FatFile f;
+
+	if(fat_vol_init(&dev->bldev, &vol) || fat_create(&vol, "SEQ.BIN", 0, &f))
+		fail("seqwrite");
+	result_begin(&r, "seqwrite", chunk, SEQ_SIZE / chunk, dev);
+	for(uint32_t done = 0; done < SEQ_SIZE; done += chunk) {
+		uint64_t t0 = now_ns();
+		memset(buf, done / chunk, chunk);
+		if(fat_write(&f, buf, chunk) != (int)chunk)
+			fail("seqwrite");
+		result_op(&r, t0, chunk);
+	}
+	if(fat_file_sync(&f))
+		fail("seqwrite");
+	result_end(&r);
+	fat_vol_umount(&vol);
+	free(buf);
+}
+
+/* Mount a fresh image holding SEQ.BIN, and open it */
+static struct ram_dev *seq_prepare(FatVol *vol, FatFile *f, const char *wl)
+{
+	struct ram_dev *dev = image_reset();
+
+	if(fat_vol_init(&dev->bldev, vol) || fill_file(vol, "SEQ.BIN", SEQ_SIZE) ||
+	   fat_vol_umount(vol) || fat_vol_init(&dev->bldev, vol) ||
+	   fat_open(vol, "SEQ.BIN", O_RDONLY, f))
+		fail(wl);
+	return dev;
+}
+
+static void bench_seqread(uint32_t chunk)
+{
+	uint8_t *buf = malloc(chunk);
+	struct ram_dev *dev;
+	struct result r;
+	FatVol vol;
+	FatFile f;
+
+	dev = seq_prepare(&vol, &f, "seqread");
+	result_begin(&r, "seqread", chunk, SEQ_SIZE / chunk, dev);
+	for(uint32_t done = 0; done < SEQ_SIZE; done += chunk) {
+		uint64_t t0 = now_ns();
+		if(fat_read(&f, buf, chunk) != (int)chunk)
+			fail("seqread");
+		result_op(&r, t0, chunk);
+	}
+	result_end(&r);
+	free(buf);
+}
+
+static void bench_randread(uint32_t size, uint32_t ops)
+{
+	uint8_t *buf = malloc(size);
+	struct ram_dev *dev;
+	struct result r;
+	FatVol vol;
+	FatFile f;
+
+	dev = seq_prepare(&vol, &f, "randread");
+	result_begin(&r, "randread", size, ops, dev);
+	for(uint32_t i = 0; i < ops; i++) {
+		off_t pos = bench_rand() % (SEQ_SIZE - size + 1);
+		uint64_t t0 = now_ns();
+		if((fat_lseek(&f, pos, SEEK_SET) != pos) ||
+		   (fat_read(&f, buf, size) != (int)size))
+			fail("randread");
+		result_op(&r, t0, size);
+	}
+	result_end(&r);
+	free(buf);
+}
+
+/* Create small files then delete them, reported separately */
+static void bench_smallfiles(int do_create, int do_delete)
+{
+	struct ram_dev *dev = image_reset();
+	uint8_t buf[SMALL_SIZE];
+	struct result r;
+	char name[16];
+	FatVol vol;
+	FatFile f;
+
+	memset(buf, 0x5A, sizeof(buf));
+	if(fat_vol_init(&dev->bldev, &vol) || fat_mkdir(&vol, "SMALL") ||
+	   fat_chdir(&vol, "SMALL"))
+		fail("create");
+	result_begin(&r, "create", SMALL_SIZE, SMALL_FILES, dev);
+	for(int i = 0; i < SMALL_FILES; i++) {
+		uint64_t t0 = now_ns();
+		sprintf(name, "S%05d.DAT", i);
+		if(fat_create(&vol, name, 0, &f) ||
+		   (fat_write(&f, buf, sizeof(buf)) != sizeof(buf)) ||
+		   fat_file_sync(&f))
+			fail("create");
+		result_op(&r, t0, sizeof(buf));
+	}
+	if(do_create)
+		result_end(&r);
+	else
+		free(r.lat);
+
+	if(do_delete) {
+		result_begin(&r, "delete", SMALL_SIZE, SMALL_FILES, dev);
+		for(int i = 0; i < SMALL_FILES; i++) {
+			uint64_t t0 = now_ns();
+			sprintf(name, "S%05d.DAT", i);
+			if(fat_unlink(&vol, name))
+				fail("delete");
+			result_op(&r, t0, 0);
+		}
+		result_end(&r);
+	}
+	fat_vol_umount(&vol);
+}
+
+/* Open random names in a directory of entries files */
+static void bench_lookup(uint32_t entries, uint32_t ops)
+{
+	struct ram_dev *dev = image_load(pristine_dirs);
+	struct result r;
+	char name[16];
+	FatVol vol;
+	FatFile f;
+
+	sprintf(name, "N%u", entries);
+	if(fat_vol_init(&dev->bldev, &vol) || fat_chdir(&vol, "LOOKUP") ||
+	   fat_chdir(&vol, name))
+		fail("lookup");
+
+	result_begin(&r, "lookup", entries, ops, dev);
+	for(uint32_t i = 0; i < ops; i++) {
+		uint64_t t0;
+		sprintf(name, "L%07u", bench_rand() % entries);
+		t0 = now_ns();
+		if(fat_open(&vol, name, O_RDONLY, &f))
+			fail("lookup");
+		result_op(&r, t0, 0);
+	}
+	result_end(&r);
+}
+
+/* Open a file PATH_DEPTH directories down by its full path */
+static void bench_deeppath(uint32_t ops)
+{
+	struct ram_dev *dev = image_reset();
+	char path[16 * PATH_DEPTH + 16] = "";
+	struct result r;
+	char name[16];
+	FatVol *vol;
+	FatFile *f;
+
+	vol = ufat_mount(&dev->bldev);
+	if(!vol)
+		fail("deeppath");
+	for(int i = 0; i < PATH_DEPTH; i++) {
+		sprintf(name, "DIR%d", i);
+		if(fat_mkdir(vol, name) || fat_chdir(vol, name))
+			fail("deeppath");
+		strcat(path, "/");
+		strcat(path, name);
+	}
+	if(fill_file(vol, "FILE.TXT", SMALL_SIZE))
+		fail("deeppath");
+	strcat(path, "/FILE.TXT");
+	ufat_umount(vol);
+
+	vol = ufat_mount(&dev->bldev);
+	if(!vol)
+		fail("deeppath");
+	result_begin(&r, "deeppath", PATH_DEPTH, ops, dev);
+	for(uint32_t i = 0; i < ops; i++) {
+		uint64_t t0 = now_ns();
+		f = ufat_open(vol, path, O_RDONLY);
+		if(!f)
+			fail("deeppath");
+		ufat_close(f);
+		result_op(&r, t0, 0);
+	}
+	result_end(&r);
+	ufat_umount(vol);
+}
+
+static const char *workloads[] = {
+	"seqwrite", "seqread", "randread", "create", "delete", "lookup",
+	"deeppath",
+};
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: fatbench [-t 12|16|32] [-w workload] "
+			"[-f json|csv] [-o dir] [-n ops] [-l max_entries] "
+			"[-s seed]\nworkloads:");
+	for(unsigned i = 0; i < NWORKLOADS; i++)
+		fprintf(stderr, " %s", workloads[i]);
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	static const uint32_t chunks[] = {512, 4096, 32768};
+	int types = 0, wl = 0;
+	const char *outdir = NULL;
+	uint32_t ops = 1000, max_entries = 10000, seed = 1;
+	uint32_t max_sectors = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "t:w:f:o:n:l:s:")) != -1) {
+		unsigned i;
+		switch(opt) {
+		case 't':
+			for(i = 0; i < 3; i++)
+				if(specs[i].type == atoi(optarg))
+					break;
+			if(i == 3)
+				usage();
+			types |= 1 << i;
+			break;
+		case 'w':
+			for(i = 0; i < NWORKLOADS; i++)
+				if(strcmp(optarg, workloads[i]) == 0)
+					break;
+			if(i == NWORKLOADS)
+				usage();
+			wl |= 1 << i;
+			break;
+		case 'f':
+			if(strcmp(optarg, "csv") == 0)
+				csv = 1;
+			else if(strcmp(optarg, "json") != 0)
+				usage();
+			break;
+		case 'o':
+			outdir = optarg;
+			break;
+		case 'n':
+			ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			max_entries = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if(!types)
+		types = 7;
+	if(!wl)
+		wl = (1 << NWORKLOADS) - 1;
+	if(!ops || !seed)
+		usage();
+
+	for(int i = 0; i < 3; i++)
+		if(specs[i].sectors > max_sectors)
+			max_sectors = specs[i].sectors;
+	pristine = malloc((size_t)max_sectors * SECTOR_SIZE);
+	pristine_dirs = malloc((size_t)max_sectors * SECTOR_SIZE);
+	if(!pristine_dirs)
+		pristine = NULL;
+	for(int i = 0; i < 2; i++) {
+		devs[i].bldev.get_sector_size = ram_get_sector_size;
+		devs[i].bldev.get_info = ram_get_info;
+		devs[i].bldev.read_sectors = ram_read_sectors;
+		devs[i].bldev.write_sectors = ram_write_sectors;
+		devs[i].data = malloc((size_t)max_sectors * SECTOR_SIZE);
+		if(!devs[i].data)
+			pristine = NULL;
+	}
+	if(!pristine) {
+		fprintf(stderr, "fatbench: out of memory\n");
+		return 1;
+	}
+
+	if(csv)
+		printf("fat,image,workload,param,ops,bytes,secs,mb_s,"
+			"p50_us,p90_us,p99_us,max_us,"
+			"rd_calls,rd_sectors,wr_calls,wr_sectors\n");
+
+	for(int t = 0; t < 3; t++) {
+		if(!(types & (1 << t)))
+			continue;
+		fat_type = specs[t].type;
+		for(unsigned v = 0; v < 2; v++) {
+			variant = variants[v];
+			rand_state = seed;
+			if(build_image(&specs[t], variant))
+				fail("format");
+			if((wl & (1 << 5)) && build_dirs_image(max_entries))
+				fail("format");
+			if(outdir && (save_image(pristine, outdir, fat_type,
+						variant, "") ||
+			   ((wl & (1 << 5)) && save_image(pristine_dirs,
+						outdir, fat_type, variant,
+						"-dirs")))) {
+				fprintf(stderr, "fatbench: can't save image "
+						"in %s\n", outdir);
+				return 1;
+			}
+
+			for(unsigned c = 0; c < 3; c++) {
+				if(wl & (1 << 0))
+					bench_seqwrite(chunks[c]);
+				if(wl & (1 << 1))
+					bench_seqread(chunks[c]);
+			}
+			if(wl & (1 << 2))
+				bench_randread(SECTOR_SIZE, ops);
+			if(wl & ((1 << 3) | (1 << 4)))
+				bench_smallfiles(wl & (1 << 3), wl & (1 << 4));
+			if(wl & (1 << 5))
+				for(uint32_t n = 10; n <= max_entries; n *= 10)
+					bench_lookup(n, ops);
+			if(wl & (1 << 6))
+				bench_deeppath(ops);
+		}
+	}
+
+	return 0;
+}
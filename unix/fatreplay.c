@@ -0,0 +1,470 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replay recorded filesystem calls against an image.
+ *
+ * The log is a file of records as described in openfat/trace.h, such as
+ * written by trace_file.c.  Each call is made again with the same
+ * arguments, on handles matched up by the recorded handle addresses, and
+ * written data is a fixed pattern.  The image is changed, so replay onto
+ * a copy.  For each kind of call the recorded and replayed times are
+ * printed, with the number of calls that returned something different.
+ *
+ * Usage: fatreplay [-b file|direct|mmap|writeback] [-c] [-i] [-v]
+ *                  <log> <image>
+ *   -b	Block device for the image, file by default
+ *   -c	Put a caching block device in front
+ *   -i	Print I/O counts by region of the volume
+ *   -v	Print each call that returned something different
+ */
+
+#define _GNU_SOURCE		/* For O_DIRECT */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "openfat.h"
+#include "openfat/bcache.h"
+#include "openfat/iostat.h"
+#include "openfat/trace.h"
+#include "openfat/unixlike.h"
+
+/* Prototypes for blockdev_*.c functions */
+extern struct block_device *
+block_device_file_open(const char *filename, int flags, uint16_t sector_size);
+extern struct block_device *
+block_device_mmap_new(const char *filename, int writable);
+extern int block_device_mmap_sync(struct block_device *bldev);
+extern struct block_device *
+block_device_writeback_new(struct block_device *lower, uint32_t nsectors,
+		unsigned dirty_ratio, unsigned max_age_ms);
+extern int block_device_writeback_destroy(struct block_device *bldev);
+
+/* Prototypes for iostat_report.c functions */
+extern void iostat_print(FILE *f, const struct block_iostat *stat);
+
+#define CACHE_LINES	16
+#define CACHE_LINE_SECTORS	8
+#define CACHE_WINDOW	32
+#define WRITEBACK_SECTORS	1024
+
+static const char *op_names[FAT_TRACE_OPS] = {
+	[FAT_TRACE_MOUNT] = "mount",
+	[FAT_TRACE_UMOUNT] = "umount",
+	[FAT_TRACE_CHDIR] = "chdir",
+	[FAT_TRACE_MKDIR] = "mkdir",
+	[FAT_TRACE_OPEN] = "open",
+	[FAT_TRACE_CREATE] = "create",
+	[FAT_TRACE_SYNC] = "sync",
+	[FAT_TRACE_READ] = "read",
+	[FAT_TRACE_WRITE] = "write",
+	[FAT_TRACE_LSEEK] = "lseek",
+	[FAT_TRACE_UNLINK] = "unlink",
+	[FAT_TRACE_COMPACT] = "compact",
+	[FAT_TRACE_READDIR] = "readdir",
+	[FAT_TRACE_GETDENTS] = "getdents",
+	[FAT_TRACE_STREAM] = "stream",
+	[FAT_TRACE_STREAM_END] = "stream_end",
+	[FAT_TRACE_UFAT_OPEN] = "ufat_open",
+};
+
+struct rec {
+	uint8_t op;
+	uint8_t aux;
+	uint32_t vol;
+	uint32_t file;
+	int64_t arg;
+	int64_t ret;
+	uint32_t time;
+	char name[FAT_TRACE_NAME_MAX + 1];
+};
+
+struct op_stats {
+	uint32_t calls;
+	uint32_t differ;
+	uint64_t bytes;
+	uint64_t rec_time;
+	uint64_t replay_ns;
+	uint64_t max_ns;
+};
+
+/* Handles seen in the log, by recorded address.  Handles are allocated
+ * separately as the library keeps pointers to them. */
+struct vol_slot {
+	uint32_t id;
+	FatVol *vol;
+};
+
+struct file_slot {
+	uint32_t id;
+	FatFile *file;
+	int from_ufat;		/* file was allocated by ufat_open() */
+	struct fat_stream *stream;
+	void *stream_buf;
+};
+
+static struct vol_slot *vols;
+static int nvols;
+static struct file_slot *files;
+static int nfiles;
+
+static struct block_device *dev;
+static uint8_t *buf;
+static int32_t buf_size;
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int read_rec(FILE *f, struct rec *r)
+{
+	uint8_t hdr[FAT_TRACE_HEADER];
+	uint16_t len;
+
+	if(fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+		return -1;
+	r->op = hdr[0];
+	r->aux = hdr[1];
+	len = hdr[2] | (hdr[3] << 8);
+	r->vol = get_le32(hdr + 4);
+	r->file = get_le32(hdr + 8);
+	r->arg = (int32_t)get_le32(hdr + 12);
+	r->ret = (int32_t)get_le32(hdr + 16);
+	r->time = get_le32(hdr + 24);
+	if(r->op == FAT_TRACE_LSEEK) {
+		/* Offsets are 32 bits with the signs kept separately */
+		r->arg = get_le32(hdr + 12);
+		r->ret = get_le32(hdr + 16);
+		if(r->aux & FAT_TRACE_SEEK_ARG_NEG)
+			r->arg -= (int64_t)1 << 32;
+		if(r->aux & FAT_TRACE_SEEK_RET_NEG)
+			r->ret -= (int64_t)1 << 32;
+		r->aux &= FAT_TRACE_SEEK_WHENCE;
+	}
+	if((r->op == 0) || (r->op >= FAT_TRACE_OPS) ||
+	   (len > FAT_TRACE_NAME_MAX) || (fread(r->name, 1, len, f) != len))
+		return -1;
+	r->name[len] = 0;
+	return 0;
+}
+
+static FatVol *find_vol(uint32_t id, int add)
+{
+	for(int i = 0; i < nvols; i++)
+		if(vols[i].id == id)
+			return vols[i].vol;
+	if(!add)
+		return NULL;
+	vols = realloc(vols, (nvols + 1) * sizeof(*vols));
+	vols[nvols].id = id;
+	vols[nvols].vol = malloc(sizeof(FatVol));
+	return vols[nvols++].vol;
+}
+
+static struct file_slot *find_file(uint32_t id, int add)
+{
+	for(int i = 0; i < nfiles; i++)
+		if(files[i].id == id)
+			return &files[i];
+	if(!add)
+		return NULL;
+	files = realloc(files, (nfiles + 1) * sizeof(*files));
+	memset(&files[nfiles], 0, sizeof(*files));
+	files[nfiles].id = id;
+	return &files[nfiles++];
+}
+
+/* Give the slot a handle of its own for fat_open() and fat_create() */
+static FatFile *slot_handle(struct file_slot *s)
+{
+	if(s->from_ufat) {
+		ufat_close(s->file);
+		s->file = NULL;
+		s->from_ufat = 0;
+	}
+	if(!s->file)
+		s->file = calloc(1, sizeof(*s->file));
+	return s->file;
+}
+
+static void grow_buf(int32_t size)
+{
+	if(size <= buf_size)
+		return;
+	buf = realloc(buf, size);
+	for(int32_t i = buf_size; i < size; i++)
+		buf[i] = i * 7 + (i >> 9);
+	buf_size = size;
+}
+
+/* Make the call again, returns its result */
+static int64_t replay(const struct rec *r, struct op_stats *st)
+{
+	struct file_slot *s = NULL;
+	struct fat_stream *stream;
+	void *stream_buf;
+	FatVol *vol;
+	FatFile *h;
+	int64_t ret;
+
+	if(r->op == FAT_TRACE_MOUNT)
+		return fat_vol_mount(dev, find_vol(r->vol, 1), r->arg);
+
+	vol = find_vol(r->vol, 0);
+	if(!vol) {
+		/* Recording started after the volume was mounted */
+		vol = find_vol(r->vol, 1);
+		if(fat_vol_init(dev, vol))
+			return -EIO;
+	}
+
+	switch(r->op) {
+	case FAT_TRACE_UMOUNT:
+		return fat_vol_umount(vol);
+	case FAT_TRACE_CHDIR:
+		return fat_chdir(vol, r->name);
+	case FAT_TRACE_MKDIR:
+		return fat_mkdir(vol, r->name);
+	case FAT_TRACE_UNLINK:
+		return fat_unlink(vol, r->name);
+	case FAT_TRACE_COMPACT:
+		/* The handles passed weren't recorded */
+		return fat_dir_compact(vol, r->name, NULL, 0);
+	case FAT_TRACE_OPEN:
+		return fat_open(vol, r->name, r->arg,
+				slot_handle(find_file(r->file, 1)));
+	case FAT_TRACE_CREATE:
+		return fat_create(vol, r->name, r->arg,
+				slot_handle(find_file(r->file, 1)));
+	case FAT_TRACE_UFAT_OPEN:
+		h = ufat_open(vol, r->name, r->arg);
+		if(!h)
+			return -1;
+		s = find_file(r->file, 1);
+		if(s->from_ufat)
+			ufat_close(s->file);
+		else
+			free(s->file);
+		s->file = h;
+		s->from_ufat = 1;
+		return 0;
+	}
+
+	/* Calls on a file opened before recording started are skipped */
+	s = find_file(r->file, 0);
+	if(!s || !s->file)
+		return r->ret;
+	h = s->file;
+
+	switch(r->op) {
+	case FAT_TRACE_SYNC:
+		return fat_file_sync(h);
+	case FAT_TRACE_READ:
+		grow_buf(r->arg);
+		ret = fat_read(h, buf, r->arg);
+		break;
+	case FAT_TRACE_WRITE:
+		grow_buf(r->arg);
+		ret = fat_write(h, buf, r->arg);
+		break;
+	case FAT_TRACE_LSEEK:
+		return fat_lseek(h, r->arg, r->aux);
+	case FAT_TRACE_READDIR: {
+		struct dirent ent;
+		return fat_readdir(h, &ent);
+	}
+	case FAT_TRACE_GETDENTS:
+		grow_buf(r->arg * sizeof(struct fat_dirent_plus));
+		return fat_getdents(h, (void*)buf, r->arg);
+	case FAT_TRACE_STREAM:
+		/* The handle keeps using a stream it already has */
+		stream = malloc(sizeof(*stream));
+		stream_buf = malloc(r->arg);
+		ret = fat_file_stream(h, stream, stream_buf, r->arg);
+		if(ret) {
+			free(stream);
+			free(stream_buf);
+			return ret;
+		}
+		free(s->stream);
+		free(s->stream_buf);
+		s->stream = stream;
+		s->stream_buf = stream_buf;
+		return 0;
+	case FAT_TRACE_STREAM_END:
+		return fat_file_stream_end(h);
+	default:
+		return r->ret;
+	}
+
+	if(ret > 0)
+		st->bytes += ret;
+	return ret;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: fatreplay [-b file|direct|mmap|writeback] "
+			"[-c] [-i] [-v] <log> <image>\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct block_cache cache;
+	static struct block_cache_line cache_lines[CACHE_LINES];
+	static uint8_t cache_data[CACHE_LINES * CACHE_LINE_SECTORS * 512];
+	static uint8_t cache_window[CACHE_WINDOW * 512];
+	static struct block_iostat iostat;
+	struct op_stats stats[FAT_TRACE_OPS];
+	struct block_device *image, *lower;
+	const char *backend = "file";
+	int cached = 0, counted = 0, verbose = 0;
+	uint32_t n = 0;
+	struct rec r;
+	FILE *log;
+	int opt;
+
+	while((opt = getopt(argc, argv, "b:civ")) != -1) {
+		switch(opt) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 'c':
+			cached = 1;
+			break;
+		case 'i':
+			counted = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if(argc - optind != 2)
+		usage();
+
+	log = fopen(argv[optind], "rb");
+	if(!log) {
+		fprintf(stderr, "Can't open %s\n", argv[optind]);
+		return 1;
+	}
+
+	if(strcmp(backend, "mmap") == 0)
+		image = block_device_mmap_new(argv[optind + 1], 1);
+	else if(strcmp(backend, "direct") == 0)
+		image = block_device_file_open(argv[optind + 1],
+				O_RDWR | O_DIRECT, 512);
+	else if((strcmp(backend, "file") == 0) ||
+		(strcmp(backend, "writeback") == 0))
+		image = block_device_file_open(argv[optind + 1], O_RDWR, 512);
+	else
+		usage();
+	if(!image) {
+		fprintf(stderr, "Can't open %s\n", argv[optind + 1]);
+		return 1;
+	}
+	lower = image;
+	if(strcmp(backend, "writeback") == 0)
+		lower = block_device_writeback_new(image, WRITEBACK_SECTORS,
+				50, 1000);
+
+	dev = lower;
+	if(cached) {
+		block_cache_init(&cache, dev, cache_lines, CACHE_LINES,
+			CACHE_LINE_SECTORS, cache_data,
+			cache_window, CACHE_WINDOW);
+		dev = &cache.bldev;
+	}
+	if(counted) {
+		block_iostat_init(&iostat, dev);
+		dev = &iostat.bldev;
+	}
+
+	memset(stats, 0, sizeof(stats));
+	while(read_rec(log, &r) == 0) {
+		struct op_stats *st = &stats[r.op];
+		uint64_t t0 = now_ns(), t;
+		int64_t ret;
+
+		ret = replay(&r, st);
+		t = now_ns() - t0;
+		n++;
+		st->calls++;
+		st->rec_time += r.time;
+		st->replay_ns += t;
+		if(t > st->max_ns)
+			st->max_ns = t;
+		if(counted && (r.op == FAT_TRACE_WRITE))
+			block_iostat_add_user(&iostat, ret > 0 ? ret : 0);
+		if(ret != r.ret) {
+			st->differ++;
+			if(verbose)
+				printf("%u: %s(%s, %lld) returned %lld, "
+					"recorded %lld\n", n, op_names[r.op],
+					r.name, (long long)r.arg,
+					(long long)ret, (long long)r.ret);
+		}
+	}
+	if(!feof(log))
+		fprintf(stderr, "Bad record after %u calls\n", n);
+	fclose(log);
+
+	if(cached)
+		block_cache_flush(&cache);
+	if(lower != image)
+		block_device_writeback_destroy(lower);
+	if(strcmp(backend, "mmap") == 0)
+		block_device_mmap_sync(image);
+
+	printf("%-10s %8s %8s %12s %12s %12s %10s\n", "call", "calls",
+			"differ", "bytes", "recorded", "replay_us", "max_us");
+	for(int i = 1; i < FAT_TRACE_OPS; i++) {
+		struct op_stats *st = &stats[i];
+		if(!st->calls)
+			continue;
+		printf("%-10s %8u %8u %12llu %12llu %12.1f %10.1f\n",
+			op_names[i], st->calls, st->differ,
+			(unsigned long long)st->bytes,
+			(unsigned long long)st->rec_time,
+			st->replay_ns / 1e3, st->max_ns / 1e3);
+	}
+	if(counted)
+		iostat_print(stdout, &iostat);
+
+	return 0;
+}
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <assert.h>
 
@@ -62,6 +63,68 @@ void print_tree(struct fat_vol_handle *vol, struct fat_file_handle *dir,
 
 }
 
+/* Long names with a one character basis are given short names with both
+ * simple and hashed tails.  Check that none is given out twice. */
+#define SNAME_TEST_FILES	1500
+
+static int sname_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, 11);
+}
+
+void test_short_names(struct fat_vol_handle *vol)
+{
+	static char snames[SNAME_TEST_FILES][11];
+	struct fat_file_handle file;
+	struct dirent ent;
+	char name[16];
+	int n = 0;
+
+	assert(fat_mkdir(vol, "Short names") == 0);
+	assert(fat_chdir(vol, "Short names") == 0);
+	for(int i = 0; i < SNAME_TEST_FILES; i++) {
+		sprintf(name, "a.txt%d", i);
+		assert(fat_create(vol, name, O_WRONLY, &file) == 0);
+	}
+
+	assert(fat_open(vol, ".", O_RDONLY, &file) == 0);
+	while(!fat_readdir(&file, &ent)) {
+		if(ent.d_name[0] == '.')
+			continue;
+		assert(n < SNAME_TEST_FILES);
+		memcpy(snames[n++], ent.fat_sname, 11);
+	}
+	assert(n == SNAME_TEST_FILES);
+	qsort(snames, n, 11, sname_cmp);
+	for(int i = 1; i < n; i++)
+		assert(memcmp(snames[i - 1], snames[i], 11) != 0);
+	assert(fat_chdir(vol, "..") == 0);
+}
+
+/* A file created in the entries of a deleted one must not hide the entry
+ * after them from an indexed lookup. */
+void test_index_holes(struct fat_vol_handle *vol)
+{
+	static struct fat_dir_index idx;
+	static struct fat_dir_index_entry ent[16];
+	struct fat_file_handle file;
+
+	assert(fat_mkdir(vol, "Index holes") == 0);
+	assert(fat_chdir(vol, "Index holes") == 0);
+	assert(fat_create(vol, "first long name", O_WRONLY, &file) == 0);
+	assert(fat_create(vol, "deleted long name", O_WRONLY, &file) == 0);
+	assert(fat_create(vol, "after long name", O_WRONLY, &file) == 0);
+	assert(fat_unlink(vol, "deleted long name") == 0);
+	/* Index is built with the deleted entries in place */
+	fat_dir_index_add(vol, &idx, ent, 16);
+	assert(fat_open(vol, "after long name", O_RDONLY, &file) == 0);
+	assert(fat_create(vol, "created long name", O_WRONLY, &file) == 0);
+	assert(fat_open(vol, "after long name", O_RDONLY, &file) == 0);
+	assert(fat_open(vol, "created long name", O_RDONLY, &file) == 0);
+	assert(fat_open(vol, "deleted long name", O_RDONLY, &file) == -ENOENT);
+	assert(fat_chdir(vol, "..") == 0);
+}
+
 int main(int argc, char *argv[])
 {
 	struct block_device *bldev;
@@ -93,6 +156,10 @@ int main(int argc, char *argv[])
 	assert(fat_open(&vol, ".", O_RDONLY, &file) == 0);
 	print_tree(&vol, &file, rootpath[0] == '/' ? rootpath + 1 : rootpath);
 
+	test_short_names(&vol);
+	test_index_holes(&vol);
+
+	assert(fat_vol_umount(&vol) == 0);
 	block_device_file_destroy(bldev);
 }
 
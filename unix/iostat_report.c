@@ -0,0 +1,79 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Reports for the I/O accounting block device:
+ * a summary of the counts, and a trace file with a line per request.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "openfat/iostat.h"
+
+static const char *region_names[BLOCK_IOSTAT_REGIONS] = {
+	"boot", "fat", "root", "data",
+};
+
+static void print_counts(FILE *f, const char *name,
+		const struct block_iostat_counts *c)
+{
+	fprintf(f, "%s: %u calls, %u sectors, %llu bytes, "
+			"largest %u sectors, %.2f sectors per call\n",
+			name, c->calls, c->sectors, (unsigned long long)c->bytes,
+			c->max_sectors,
+			c->calls ? (double)c->sectors / c->calls : 0);
+	fprintf(f, "  sectors by region:");
+	for(int i = 0; i < BLOCK_IOSTAT_REGIONS; i++)
+		fprintf(f, " %s %u", region_names[i], c->region[i]);
+	fprintf(f, "\n  calls by size:");
+	for(int i = 0; i < BLOCK_IOSTAT_SIZES; i++)
+		if(c->sizes[i])
+			fprintf(f, " %u%s:%u", 1u << i,
+				(i == BLOCK_IOSTAT_SIZES - 1) ? "+" : "", 
+				c->sizes[i]);
+	fprintf(f, "\n  seeks: %u, mean distance %.1f sectors\n", c->seeks,
+			c->seeks ? (double)c->seek_sectors / c->seeks : 0);
+}
+
+void iostat_print(FILE *f, const struct block_iostat *stat)
+{
+	print_counts(f, "read", &stat->read);
+	print_counts(f, "write", &stat->write);
+	if(stat->user_bytes)
+		fprintf(f, "write amplification: %.2f (%llu device bytes for "
+				"%llu user bytes)\n",
+				(double)stat->write.bytes / stat->user_bytes,
+				(unsigned long long)stat->write.bytes,
+				(unsigned long long)stat->user_bytes);
+}
+
+static void trace_line(void *priv, const struct block_iostat_req *req)
+{
+	fprintf(priv, "%c %u %u %s %d %d\n", req->write ? 'W' : 'R',
+			req->sector, req->count, region_names[req->region],
+			req->seek, req->ret);
+}
+
+/* Write a line per request to f: R or W, first sector, sector count,
+ * region of the first sector, seek distance and the device's return. */
+void iostat_trace_file(struct block_iostat *stat, FILE *f)
+{
+	block_iostat_set_trace(stat, f ? trace_line : NULL, f);
+}
@@ -0,0 +1,378 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Simulated SD card in SPI mode.
+ * A byte level model of the card side of the SPI bus, enough to run the
+ * MMC driver on the host.  Commands are counted and the card is busy for
+ * a configurable number of bytes after programming, so the cost of a
+ * transfer strategy can be measured without hardware.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "openfat/blockdev.h"
+#include "mmc.h"
+#include "mmc_sim.h"
+
+#define R1_IDLE			0x01
+#define R1_ILLEGAL_COMMAND	0x04
+#define R1_ADDRESS_ERROR	0x20
+#define R1_PARAMETER_ERROR	0x40
+
+#define OCR_POWER_UP		0x80	/* In first byte of OCR */
+#define OCR_CCS			0x40
+#define OCR_HCS_ARG		0x40000000
+
+enum {
+	SIM_CMD,
+	SIM_READ_MULTI,
+	SIM_WRITE_SINGLE,
+	SIM_WRITE_MULTI,
+	SIM_WRITE_DATA,
+};
+
+static void sim_queue(struct mmc_sim *sim, uint8_t byte)
+{
+	if(sim->outlen < (int)sizeof(sim->out))
+		sim->out[sim->outlen++] = byte;
+}
+
+static void sim_queue_block(struct mmc_sim *sim, const uint8_t *buf, int len)
+{
+	sim_queue(sim, 0xFF);
+	sim_queue(sim, 0xFE);
+	if(len > (int)sizeof(sim->out) - sim->outlen)
+		len = sizeof(sim->out) - sim->outlen;
+	memcpy(&sim->out[sim->outlen], buf, len);
+	sim->outlen += len;
+	/* CRC is not checked in SPI mode */
+	sim_queue(sim, 0xFF);
+	sim_queue(sim, 0xFF);
+}
+
+static void sim_queue_sector(struct mmc_sim *sim)
+{
+	uint8_t buf[SIM_SECTOR_SIZE];
+
+	if((sim->sector >= sim->sector_count) ||
+	   (block_read_sectors(sim->backing, sim->sector, 1, buf) != 1)) {
+		sim_queue(sim, 0x08); /* Out of range error token */
+		sim->state = SIM_CMD;
+		return;
+	}
+	sim_queue_block(sim, buf, sizeof(buf));
+	sim->sector++;
+	sim->blocks_read++;
+}
+
+static void sim_queue_csd(struct mmc_sim *sim)
+{
+	uint8_t csd[16];
+	uint32_t c_size;
+
+	memset(csd, 0, sizeof(csd));
+	csd[5] = 0x59; /* Command classes, READ_BL_LEN = 512 */
+	if(sim->sdhc) {
+		c_size = sim->sector_count / 1024 - 1;
+		csd[0] = 0x40;
+		csd[7] = (c_size >> 16) & 0x3F;
+		csd[8] = c_size >> 8;
+		csd[9] = c_size;
+	} else {
+		/* C_SIZE_MULT = 7, multiplier of 512 */
+		c_size = sim->sector_count / 512 - 1;
+		csd[6] = (c_size >> 10) & 0x03;
+		csd[7] = c_size >> 2;
+		csd[8] = (c_size & 0x03) << 6;
+		csd[9] = 0x03;
+		csd[10] = 0x80;
+	}
+	sim_queue_block(sim, csd, sizeof(csd));
+}
+
+/* Check the address of a data command, returns R1 error bits */
+static uint8_t sim_address(struct mmc_sim *sim, uint32_t arg)
+{
+	if(sim->sdhc) {
+		sim->sector = arg;
+	} else {
+		if(arg % SIM_SECTOR_SIZE)
+			return R1_ADDRESS_ERROR;
+		sim->sector = arg / SIM_SECTOR_SIZE;
+	}
+	if(sim->sector >= sim->sector_count)
+		return R1_PARAMETER_ERROR;
+	return 0;
+}
+
+static void sim_app_command(struct mmc_sim *sim, uint8_t cmd, uint32_t arg)
+{
+	uint8_t status[64];
+
+	sim->acmds[cmd]++;
+
+	switch(cmd) {
+	case SD_SEND_OP_COND:
+		if((++sim->polls >= sim->init_polls) && 
+		   (!sim->sdhc || (arg & OCR_HCS_ARG)))
+			sim->idle = 0;
+		sim_queue(sim, sim->idle);
+		break;
+	case SD_STATUS:
+		if(sim->idle) {
+			sim_queue(sim, R1_IDLE | R1_ILLEGAL_COMMAND);
+			break;
+		}
+		sim_queue(sim, 0);
+		sim_queue(sim, 0);
+		memset(status, 0, sizeof(status));
+		status[10] = sim->au_size << 4;
+		sim_queue_block(sim, status, sizeof(status));
+		break;
+	case SD_SET_WR_BLK_ERASE_COUNT:
+		sim->pre_erased += arg & 0x7FFFFF;
+		sim_queue(sim, sim->idle);
+		break;
+	default:
+		sim_queue(sim, sim->idle | R1_ILLEGAL_COMMAND);
+	}
+}
+
+static void sim_command(struct mmc_sim *sim)
+{
+	uint8_t cmd = sim->cmd[0] & 0x3F;
+	uint32_t arg = (sim->cmd[1] << 24) | (sim->cmd[2] << 16) |
+			(sim->cmd[3] << 8) | sim->cmd[4];
+	int app = sim->app;
+	uint8_t r1;
+
+	sim->app = 0;
+	/* A command ends any transfer in progress */
+	sim->outlen = sim->outpos = 0;
+	sim->state = SIM_CMD;
+	/* One byte before the response */
+	sim_queue(sim, 0xFF);
+
+	if(app) {
+		sim_app_command(sim, cmd, arg);
+		return;
+	}
+	sim->cmds[cmd]++;
+
+	switch(cmd) {
+	case MMC_GO_IDLE_STATE:
+		sim->idle = 1;
+		sim->polls = 0;
+		sim_queue(sim, R1_IDLE);
+		return;
+	case MMC_SEND_IF_COND:
+		sim_queue(sim, sim->idle);
+		sim_queue(sim, 0);
+		sim_queue(sim, 0);
+		sim_queue(sim, (arg >> 8) & 0x0F);
+		sim_queue(sim, arg & 0xFF);
+		return;
+	case MMC_APP_CMD:
+		sim->app = 1;
+		sim_queue(sim, sim->idle);
+		return;
+	case MMC_READ_OCR:
+		sim_queue(sim, sim->idle);
+		sim_queue(sim, sim->idle ? 0 : 
+			OCR_POWER_UP | (sim->sdhc ? OCR_CCS : 0));
+		sim_queue(sim, 0xFF);
+		sim_queue(sim, 0x80);
+		sim_queue(sim, 0);
+		return;
+	case MMC_CRC_ON_OFF:
+		sim_queue(sim, sim->idle);
+		return;
+	}
+
+	if(sim->idle) { /* Nothing else until initialised */
+		sim_queue(sim, R1_IDLE | R1_ILLEGAL_COMMAND);
+		return;
+	}
+
+	switch(cmd) {
+	case MMC_SEND_CSD:
+		sim_queue(sim, 0);
+		sim_queue_csd(sim);
+		break;
+	case MMC_SET_BLOCKLEN:
+		sim_queue(sim, (arg == SIM_SECTOR_SIZE) ? 0 : 
+				R1_PARAMETER_ERROR);
+		break;
+	case MMC_STOP_TRANSMISSION:
+		sim_queue(sim, 0);
+		break;
+	case MMC_SEND_STATUS:
+		sim_queue(sim, 0);
+		sim_queue(sim, 0);
+		break;
+	case MMC_READ_SINGLE_BLOCK:
+	case MMC_READ_MULTIPLE_BLOCK:
+	case MMC_WRITE_BLOCK:
+	case MMC_WRITE_MULTIPLE_BLOCK:
+		r1 = sim_address(sim, arg);
+		sim_queue(sim, r1);
+		if(r1)
+			break;
+		if(cmd == MMC_READ_SINGLE_BLOCK)
+			sim_queue_sector(sim);
+		else if(cmd == MMC_READ_MULTIPLE_BLOCK)
+			sim->state = SIM_READ_MULTI;
+		else if(cmd == MMC_WRITE_BLOCK)
+			sim->state = SIM_WRITE_SINGLE;
+		else
+			sim->state = SIM_WRITE_MULTI;
+		break;
+	default:
+		sim_queue(sim, R1_ILLEGAL_COMMAND);
+	}
+}
+
+/* A data block has been received */
+static void sim_write_block(struct mmc_sim *sim)
+{
+	int multi = (sim->data[0] == 0xFC);
+
+	if((sim->sector >= sim->sector_count) ||
+	   (block_write_sectors(sim->backing, sim->sector, 1, 
+				&sim->data[1]) != 1)) {
+		sim_queue(sim, 0x0D); /* Write error */
+		sim->state = SIM_CMD;
+		return;
+	}
+	sim->sector++;
+	sim->blocks_written++;
+	sim_queue(sim, 0x05); /* Data accepted */
+	sim->busy = sim->busy_block;
+	sim->state = multi ? SIM_WRITE_MULTI : SIM_CMD;
+}
+
+static void sim_input(struct mmc_sim *sim, uint8_t in)
+{
+	switch(sim->state) {
+	case SIM_WRITE_DATA:
+		sim->data[sim->datalen++] = in;
+		/* Token, data and CRC */
+		if(sim->datalen == SIM_SECTOR_SIZE + 3)
+			sim_write_block(sim);
+		return;
+	case SIM_WRITE_SINGLE:
+	case SIM_WRITE_MULTI:
+		if(((sim->state == SIM_WRITE_SINGLE) && (in == 0xFE)) ||
+		   ((sim->state == SIM_WRITE_MULTI) && (in == 0xFC))) {
+			sim->data[0] = in;
+			sim->datalen = 1;
+			sim->state = SIM_WRITE_DATA;
+		} else if((sim->state == SIM_WRITE_MULTI) && (in == 0xFD)) {
+			sim->busy = sim->busy_stop;
+			sim->state = SIM_CMD;
+		}
+		return;
+	}
+
+	/* Commands start with 01 in the top bits */
+	if(!sim->cmdlen && ((in & 0xC0) != 0x40))
+		return;
+	sim->cmd[sim->cmdlen++] = in;
+	if(sim->cmdlen == sizeof(sim->cmd)) {
+		sim->cmdlen = 0;
+		sim_command(sim);
+	}
+}
+
+static uint8_t sim_xfer(const struct mmc_port *mmc, uint8_t in)
+{
+	struct mmc_sim *sim = mmc->priv;
+	uint8_t out = 0xFF;
+
+	if(!sim->selected)
+		return 0xFF;
+	sim->bytes++;
+
+	if((sim->outpos == sim->outlen) && (sim->state == SIM_READ_MULTI) &&
+	   !sim->cmdlen) {
+		sim->outlen = sim->outpos = 0;
+		sim_queue_sector(sim);
+	}
+
+	if(sim->outpos < sim->outlen) {
+		out = sim->out[sim->outpos++];
+	} else if(sim->busy) {
+		sim->busy--;
+		sim->busy_bytes++;
+		out = 0;
+	}
+
+	sim_input(sim, in);
+
+	return out;
+}
+
+static void sim_chip_select(const struct mmc_port *mmc, int select)
+{
+	struct mmc_sim *sim = mmc->priv;
+
+	sim->selected = select;
+	if(!select) {
+		sim->cmdlen = 0;
+		if(sim->state == SIM_READ_MULTI)
+			sim->state = SIM_CMD;
+	}
+}
+
+const struct mmc_spi_ops mmc_sim_spi_ops = {
+	.xfer = sim_xfer,
+	.chip_select = sim_chip_select,
+};
+
+void mmc_sim_init(struct mmc_sim *sim, struct block_device *backing,
+		uint32_t sector_count, int sdhc)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->backing = backing;
+	sim->sector_count = sector_count;
+	sim->sdhc = sdhc;
+	sim->init_polls = 4;
+	sim->busy_block = 64;
+	sim->busy_stop = 256;
+	sim->au_size = 9; /* 4MB */
+	sim->idle = 1;
+}
+
+void mmc_sim_print_stats(const struct mmc_sim *sim)
+{
+	for(int i = 0; i < 64; i++)
+		if(sim->cmds[i])
+			printf("CMD%-2d  %u\n", i, sim->cmds[i]);
+	for(int i = 0; i < 64; i++)
+		if(sim->acmds[i])
+			printf("ACMD%-2d %u\n", i, sim->acmds[i]);
+	printf("blocks read %u, written %u, pre-erased %u\n", 
+		sim->blocks_read, sim->blocks_written, sim->pre_erased);
+	printf("bytes clocked %u, busy %u\n", sim->bytes, sim->busy_bytes);
+}
+
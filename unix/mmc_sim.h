@@ -0,0 +1,82 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Simulated SD card in SPI mode.
+ * Plugs into the MMC driver as its SPI transport, and keeps the card
+ * contents on another block device.
+ */
+
+#ifndef __MMC_SIM_H
+#define __MMC_SIM_H
+
+#include <stdint.h>
+
+#include "openfat/blockdev.h"
+#include "mmc.h"
+
+#define SIM_SECTOR_SIZE		512
+
+struct mmc_sim {
+	/* Card configuration */
+	struct block_device *backing;
+	uint32_t sector_count;
+	int sdhc;		/* High capacity, block addressed */
+	int init_polls;		/* ACMD41s before the card leaves idle */
+	int busy_block;		/* Busy bytes after each block written */
+	int busy_stop;		/* Busy bytes after a multiple block write */
+	uint8_t au_size;	/* AU_SIZE code reported in SD status */
+
+	/* Statistics */
+	uint32_t cmds[64];
+	uint32_t acmds[64];
+	uint32_t blocks_read;
+	uint32_t blocks_written;
+	uint32_t pre_erased;	/* Sectors announced by ACMD23 */
+	uint32_t busy_bytes;	/* Bytes clocked while busy */
+	uint32_t bytes;		/* All bytes clocked while selected */
+
+	/* Card state */
+	int selected;
+	int state;
+	int idle;
+	int app;
+	int polls;
+	int busy;
+	uint32_t sector;
+	uint8_t cmd[6];
+	int cmdlen;
+	uint8_t out[16 + SIM_SECTOR_SIZE + 4];
+	int outlen, outpos;
+	uint8_t data[SIM_SECTOR_SIZE + 3];	/* Token, data and CRC */
+	int datalen;
+};
+
+/* Set up a card of sector_count sectors, stored on backing.
+ * Defaults can be changed in sim before mmc_card_init() is called. */
+void mmc_sim_init(struct mmc_sim *sim, struct block_device *backing,
+		uint32_t sector_count, int sdhc);
+
+/* Transport for mmc_card_init(), pass the struct mmc_sim as priv. */
+extern const struct mmc_spi_ops mmc_sim_spi_ops;
+
+void mmc_sim_print_stats(const struct mmc_sim *sim);
+
+#endif
+
@@ -0,0 +1,245 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Example running the MMC driver against a simulated SD card.
+ * The card contents are kept in an image file.  A test file is written
+ * and read back through the FAT layer, then a run of sectors is read and
+ * rewritten with multiple block transfers, and the card commands used
+ * are printed.  With the stream option the test file is written in
+ * streaming mode, so it goes to the card in long multiple block writes.
+ * The iostat option prints the requests made by the FAT layer by region
+ * of the volume, and trace=<file> writes them out one per line.
+ * record=<file> records the calls made to the FAT layer for fatreplay,
+ * if the library was built with TRACE=1.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+#include "openfat.h"
+#include "openfat/bcache.h"
+#include "openfat/iostat.h"
+#include "mmc.h"
+#include "mmc_sim.h"
+
+/* Prototypes for blockdev_file.c functions */
+extern struct block_device * 
+block_device_file_new(const char *filename, const char *mode);
+extern void block_device_file_destroy(struct block_device *bldev);
+
+/* Prototypes for iostat_report.c functions */
+extern void iostat_print(FILE *f, const struct block_iostat *stat);
+extern void iostat_trace_file(struct block_iostat *stat, FILE *f);
+
+/* Prototypes for trace_file.c functions */
+extern int trace_file_start(const char *filename);
+extern int trace_file_stop(void);
+
+#define TEST_SIZE	(64 * 1024)
+#define RAW_SECTORS	64
+
+#define CACHE_LINES	16
+#define CACHE_LINE_SECTORS	8
+#define CACHE_WINDOW	32
+
+#define STREAM_BUF_SIZE	(16 * 1024)
+
+static uint8_t wbuf[TEST_SIZE], rbuf[TEST_SIZE];
+static uint8_t stream_buf[STREAM_BUF_SIZE];
+
+static struct block_cache cache;
+static struct block_cache_line cache_lines[CACHE_LINES];
+static uint8_t cache_data[CACHE_LINES * CACHE_LINE_SECTORS * 512];
+static uint8_t cache_window[CACHE_WINDOW * 512];
+
+static struct block_iostat iostat;
+
+/* Write the test file in pieces, as data would arrive from a logger */
+static int stream_write(FatFile *file)
+{
+	struct fat_stream stream;
+
+	if(fat_file_stream(file, &stream, stream_buf, sizeof(stream_buf)))
+		return -1;
+	for(int i = 0; i < TEST_SIZE; i += 1000) {
+		int len = (TEST_SIZE - i < 1000) ? TEST_SIZE - i : 1000;
+		if(fat_write(file, wbuf + i, len) != len)
+			return -1;
+	}
+	return fat_file_stream_end(file);
+}
+
+static int fat_test(struct block_device *bldev, int streamed)
+{
+	FatVol vol;
+	FatFile file;
+	int i;
+
+	if(fat_vol_init(bldev, &vol)) {
+		fprintf(stderr, "fat_vol_init failed\n");
+		return -1;
+	}
+
+	for(i = 0; i < TEST_SIZE; i++)
+		wbuf[i] = i * 7 + (i >> 9);
+
+	if(fat_open(&vol, "MMCSIM.DAT", O_RDWR | O_CREAT | O_TRUNC, &file) ||
+	   (streamed ? stream_write(&file) : 
+		(fat_write(&file, wbuf, TEST_SIZE) != TEST_SIZE)) ||
+	   fat_file_sync(&file)) {
+		fprintf(stderr, "Failed to write MMCSIM.DAT\n");
+		return -1;
+	}
+	if(bldev == &iostat.bldev)
+		block_iostat_add_user(&iostat, TEST_SIZE);
+
+	if(fat_open(&vol, "MMCSIM.DAT", O_RDONLY, &file)) {
+		fprintf(stderr, "Failed to open MMCSIM.DAT\n");
+		return -1;
+	}
+	for(i = 0; i < TEST_SIZE; i += 16384)
+		if(fat_read(&file, rbuf + i, 16384) != 16384)
+			break;
+	if((i != TEST_SIZE) || memcmp(wbuf, rbuf, TEST_SIZE)) {
+		fprintf(stderr, "MMCSIM.DAT read back wrong\n");
+		return -1;
+	}
+	return fat_vol_umount(&vol);
+}
+
+/* Rewrite sectors unchanged, so the image is left as it was */
+static int raw_test(struct block_device *bldev)
+{
+	if(block_read_sectors(bldev, 0, RAW_SECTORS, wbuf) != RAW_SECTORS) {
+		fprintf(stderr, "Multiple block read failed\n");
+		return -1;
+	}
+	if(block_write_sectors(bldev, 0, RAW_SECTORS, wbuf) != RAW_SECTORS) {
+		fprintf(stderr, "Multiple block write failed\n");
+		return -1;
+	}
+	if((block_read_sectors(bldev, 0, RAW_SECTORS, rbuf) != RAW_SECTORS) ||
+	   memcmp(wbuf, rbuf, RAW_SECTORS * 512)) {
+		fprintf(stderr, "Multiple block read back wrong\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct block_device *bldev;
+	struct mmc_sim sim;
+	struct mmc_port mmc;
+	struct block_device *dev;
+	struct block_device_info info;
+	struct stat st;
+	int sdhc = 0, cached = 0, streamed = 0, counted = 0;
+	FILE *trace = NULL;
+	const char *record = NULL;
+	int ret;
+
+	for(int i = 2; i < argc; i++) {
+		if(strcmp(argv[i], "sdhc") == 0) {
+			sdhc = 1;
+		} else if(strcmp(argv[i], "cache") == 0) {
+			cached = 1;
+		} else if(strcmp(argv[i], "stream") == 0) {
+			streamed = 1;
+		} else if(strcmp(argv[i], "iostat") == 0) {
+			counted = 1;
+		} else if(strncmp(argv[i], "record=", 7) == 0) {
+			record = argv[i] + 7;
+		} else if(strncmp(argv[i], "trace=", 6) == 0) {
+			counted = 1;
+			trace = fopen(argv[i] + 6, "w");
+			if(!trace) {
+				fprintf(stderr, "Can't open %s\n", argv[i] + 6);
+				return 1;
+			}
+		} else {
+			argc = 0;
+			break;
+		}
+	}
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s <image> [sdhc] [cache] [stream] "
+				"[iostat] [trace=<file>] [record=<file>]\n", 
+				argv[0]);
+		return 1;
+	}
+
+	if(stat(argv[1], &st) || !(bldev = block_device_file_new(argv[1], "r+"))) {
+		fprintf(stderr, "Can't open %s\n", argv[1]);
+		return 1;
+	}
+
+	mmc_sim_init(&sim, bldev, st.st_size / 512, sdhc);
+	memset(&mmc, 0, sizeof(mmc));
+	if(mmc_card_init(&mmc, &mmc_sim_spi_ops, &sim)) {
+		fprintf(stderr, "Card initialisation failed\n");
+		return 1;
+	}
+	block_get_info(&mmc.bldev, &info);
+	printf("Card type %d, %s addressed, %u sectors, AU %u sectors\n", 
+			mmc.type, mmc.block_addr ? "block" : "byte", 
+			info.sector_count, info.erase_size);
+
+	dev = &mmc.bldev;
+	if(cached) {
+		block_cache_init(&cache, dev, cache_lines, CACHE_LINES, 
+			CACHE_LINE_SECTORS, cache_data, 
+			cache_window, CACHE_WINDOW);
+		dev = &cache.bldev;
+	}
+
+	if(record && trace_file_start(record)) {
+		fprintf(stderr, "Can't record calls to %s\n", record);
+		return 1;
+	}
+	if(counted) {
+		block_iostat_init(&iostat, dev);
+		iostat_trace_file(&iostat, trace);
+		ret = fat_test(&iostat.bldev, streamed);
+	} else {
+		ret = fat_test(dev, streamed);
+	}
+	if(record)
+		trace_file_stop();
+	ret = ret || raw_test(dev);
+	if(cached && block_cache_flush(&cache))
+		ret = 1;
+
+	mmc_sim_print_stats(&sim);
+	if(counted)
+		iostat_print(stdout, &iostat);
+	if(trace)
+		fclose(trace);
+	block_device_file_destroy(bldev);
+
+	return ret;
+}
+
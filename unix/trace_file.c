@@ -0,0 +1,81 @@
+/*
+ * This file is part of the openfat project.
+ *
+ * Copyright (C) 2011  Department of Physics, University of Otago
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Recording of filesystem calls to a file, for fatreplay.
+ * The file holds the records one after another, see openfat/trace.h.
+ * Times are in microseconds.  The library must be built with TRACE=1.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "openfat/trace.h"
+
+static FILE *trace_out;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void file_write(void *priv, const void *rec, int len)
+{
+	pthread_mutex_lock(&trace_mutex);
+	fwrite(rec, 1, len, priv);
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+static uint32_t file_clock(void *priv)
+{
+	struct timespec ts;
+
+	(void)priv;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const struct fat_trace_ops file_ops = {
+	.write = file_write,
+	.clock = file_clock,
+};
+
+/* Returns 0, or negative if the file can't be created or the library
+ * doesn't record calls */
+int trace_file_start(const char *filename)
+{
+	int ret;
+
+	trace_out = fopen(filename, "wb");
+	if(!trace_out)
+		return -1;
+	ret = fat_trace_init(&file_ops, trace_out);
+	if(ret) {
+		fclose(trace_out);
+		trace_out = NULL;
+	}
+	return ret;
+}
+
+int trace_file_stop(void)
+{
+	FILE *f = trace_out;
+
+	fat_trace_init(NULL, NULL);
+	trace_out = NULL;
+	return f ? fclose(f) : 0;
+}